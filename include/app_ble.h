@@ -19,6 +19,41 @@ void app_ble_stop(){
 }
 
 void app_ble_send_notification(uint8_t profile_id, uint8_t* data, uint16_t length){
+    // The push wakes the notification scheduler which sends the data
     bsp_push_data_to_notification_queue(profile_id, data, length);
-    bsp_send_notification_data(profile_id);
+}
+
+uint32_t app_ble_publish_notification(uint8_t profile_id, uint8_t* data, uint16_t length, notification_complete_cb_t complete_callback){
+    // Returns at once, the outcome is reported to complete_callback from the BSP
+    return bsp_publish_notification(profile_id, data, length, complete_callback);
+}
+
+void app_ble_send_notification_with_ttl(uint8_t profile_id, uint8_t* data, uint16_t length, uint32_t ttl_ms){
+    // The data is dropped instead of sent once it is older than ttl_ms
+    bsp_push_data_to_notification_queue_with_ttl(profile_id, data, length, ttl_ms);
+}
+
+uint8_t* app_ble_acquire_notification_buffer(uint8_t profile_id){
+    // The buffer comes from the notification pool and is filled in place by the caller
+    return bsp_acquire_notification_buffer(profile_id);
+}
+
+void app_ble_send_notification_buffer(uint8_t profile_id, uint8_t* buffer, uint16_t length){
+    // The buffer is handed over without a copy and returns to the pool once the notification pipeline is done with it
+    bsp_push_notification_buffer(profile_id, buffer, length);
+}
+
+void app_ble_set_notification_delta(uint8_t profile_id, bool enabled){
+    // Only for clients that decode the full and delta frames
+    bsp_set_notification_delta(profile_id, enabled);
+}
+
+bool app_ble_send_characteristic(uint8_t profile_id, uint8_t characteristic, uint8_t* data, uint16_t length){
+    // The other send functions notify characteristic 0 of the profile
+    return bsp_push_characteristic_data(profile_id, characteristic, data, length);
+}
+
+uint8_t app_ble_send_characteristic_updates(uint8_t profile_id, const characteristic_update_t* updates, uint8_t num_updates){
+    // Related values of one profile are queued together, returns how many were queued
+    return bsp_push_characteristic_updates(profile_id, updates, num_updates);
 }
\ No newline at end of file
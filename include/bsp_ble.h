@@ -1,22 +1,148 @@
 #pragma once
 
+#include <assert.h>
+#include <stdatomic.h>
+
 #include "hal_ble.h"
 
-#define NUM_PROFILES 4
+// #define NOTIFICATION_BATCHING // Uncomment to add the batch profile whose characteristic packs the updates of several profiles into one notification
+#define NOTIFICATION_LATENCY_HISTOGRAMS // Comment out to remove the latency histograms of the notification pipeline
+// #define ATTRIBUTE_TABLE_AUTO_RESPONSE // Uncomment to create every service as one attribute table whose values the stack stores and answers reads from
+// #define DEFERRED_GATT_EVENTS // Uncomment to only queue the GATT events on the Bluetooth task and handle them on a worker task of the server
+// #define SINGLE_GATT_APPLICATION // Uncomment to register one GATT application whose interface hosts the services of every profile
+
+/*
+    Profile Descriptor Table
+
+    Every profile of the server is one line of PROFILE_DESCRIPTORS and each of its characteristics is one line of
+    CHARACTERISTIC_DESCRIPTORS. The IDs, storage, UUIDs, log tags, handle counts and event handling of the profiles are
+    all generated from these lines at compile time.
+    Profile: X(name,service uuid,flags,queue policy,priority,time to live)
+    Characteristic: X(profile name,name,characteristic uuid,characteristic length,flags)
+*/
+
+#define PROFILE_FLAG_CONN_PARAMS 0x01 // The preferred connection parameters are requested when the client connects
+#define PROFILE_FLAG_PRESENCE 0x02 // The connection of the client is tracked for the power management task
+#define PROFILE_FLAG_ADVERTISE 0x04 // Advertising is restarted when the client disconnects
+#define PROFILE_FLAG_BATCH 0x08 // The characteristic carries the batched updates of the other profiles
+
+#define CHARACTERISTIC_FLAG_NOTIFY 0x01 // The characteristic has a CCCD and is notified or indicated to the client
+#define CHARACTERISTIC_FLAG_WRITABLE 0x02 // The client can write the value of the characteristic
+
+#define MAX_PROFILE_CHARACTERISTICS 4 // Characteristics a profile can own
+
+// Track changes and todo edits must all reach the client, while only the latest time and playback state matter
+// Playback state is what the user is looking at so it is sent before the metadata and time, and the todo list goes last
+#define PROFILE_DESCRIPTORS(X) \
+    X(MUSIC,0x1840,PROFILE_FLAG_PRESENCE | PROFILE_FLAG_ADVERTISE,NOTIFICATION_QUEUE_FIFO_ALL,NOTIFICATION_PRIORITY_NORMAL,NOTIFICATION_TTL_NONE) \
+    X(TODO,0x1801,PROFILE_FLAG_CONN_PARAMS | PROFILE_FLAG_ADVERTISE,NOTIFICATION_QUEUE_FIFO_ALL,NOTIFICATION_PRIORITY_LOW,NOTIFICATION_TTL_NONE) \
+    X(TIME,0x1847,PROFILE_FLAG_CONN_PARAMS | PROFILE_FLAG_ADVERTISE,NOTIFICATION_QUEUE_KEEP_LATEST,NOTIFICATION_PRIORITY_NORMAL,TIME_NOTIFICATION_TTL) \
+    X(MUSIC_PLAYBACK,0x1848,PROFILE_FLAG_PRESENCE | PROFILE_FLAG_ADVERTISE,NOTIFICATION_QUEUE_KEEP_LATEST,NOTIFICATION_PRIORITY_HIGH,MUSIC_PLAYBACK_NOTIFICATION_TTL) \
+    BATCH_PROFILE_DESCRIPTOR(X)
+
+// The characteristics of a profile are created in the order of their lines, the first one is characteristic 0 of the profile
+#define CHARACTERISTIC_DESCRIPTORS(X) \
+    X(MUSIC,MUSIC_METADATA,0x2B93,32,CHARACTERISTIC_FLAG_NOTIFY | CHARACTERISTIC_FLAG_WRITABLE) \
+    X(TODO,TODO_LIST,0x2A3D,32,CHARACTERISTIC_FLAG_WRITABLE) \
+    X(TIME,CURRENT_TIME,0x2A2B,5,CHARACTERISTIC_FLAG_WRITABLE) \
+    X(MUSIC_PLAYBACK,PLAYBACK_STATE,0x2BA3,5,CHARACTERISTIC_FLAG_NOTIFY | CHARACTERISTIC_FLAG_WRITABLE) \
+    BATCH_CHARACTERISTIC_DESCRIPTOR(X)
+
+// The batch characteristic is the largest notification that fits in one LL packet with data length extension, limited to the ATT MTU at runtime
+#ifdef NOTIFICATION_BATCHING
+    #define BATCH_PROFILE_DESCRIPTOR(X) X(BATCH,0xFF10,PROFILE_FLAG_BATCH,NOTIFICATION_QUEUE_FIFO_ALL,NOTIFICATION_PRIORITY_NORMAL,NOTIFICATION_TTL_NONE)
+    #define BATCH_CHARACTERISTIC_DESCRIPTOR(X) X(BATCH,BATCH_RECORDS,0xFF11,244,CHARACTERISTIC_FLAG_NOTIFY)
+#else
+    #define BATCH_PROFILE_DESCRIPTOR(X)
+    #define BATCH_CHARACTERISTIC_DESCRIPTOR(X)
+#endif
 
 /*
-    Profile ID's
+    Profile & Characteristic ID's
 */
-#define MUSIC_PROFILE_ID 0
-#define TODO_PROFILE_ID 1
-#define TIME_PROFILE_ID 2
-#define MUSIC_PLAYBACK_PROFILE_ID 3
+#define PROFILE_ID_ENTRY(name,service_uuid,flags,policy,priority,ttl) name##_PROFILE_ID,
+typedef enum{
+    PROFILE_DESCRIPTORS(PROFILE_ID_ENTRY)
+    NUM_PROFILES
+} profile_id_t;
+
+#define PROFILE_FLAGS_ENTRY(name,service_uuid,flags,policy,priority,ttl) name##_PROFILE_FLAGS = (flags),
+enum{
+    PROFILE_DESCRIPTORS(PROFILE_FLAGS_ENTRY)
+};
+
+// Index of a characteristic in bsp_characteristic_descriptors, the index within its profile is assigned when the server table is created
+#define CHARACTERISTIC_ID_ENTRY(profile,name,characteristic_uuid,length,flags) name##_CHARACTERISTIC_ID,
+typedef enum{
+    CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_ID_ENTRY)
+    NUM_CHARACTERISTICS
+} characteristic_id_t;
 
 /*
     Macros For Notification Management
 */
-#define MAX_NOTIFCATION_RETRIES 3
-#define NOTIFICATION_INTERVAL 500 // 0.5 second interval for notifications
+#define MAX_NOTIFCATION_RETRIES 3 // Default number of times a failed notification is retried before it is dropped
+#define NOTIFICATION_RETRY_BASE_DELAY 50 // Default delay in ms before the first retry, doubled for every following retry
+#define NOTIFICATION_RETRY_MAX_DELAY 1000 // Default upper limit in ms of the retry delay
+#define NOTIFICATION_INTERVAL 500 // Default time in ms for a profile to earn a notification token (2 notifications per second)
+#define NOTIFICATION_BURST 2 // Default number of notification tokens a profile can save up to send back to back
+#define INDICATION_TIMEOUT 5000 // Default time in ms to wait for the client to confirm an indication before it is retried
+#define NOTIFICATION_TTL_NONE 0 // Time to live of payloads that never expire
+#define TIME_NOTIFICATION_TTL 1000 // Default time in ms before a time update is too old to be sent
+#define MUSIC_PLAYBACK_NOTIFICATION_TTL 1000 // Default time in ms before a playback position update is too old to be sent
+#define NOTIFICATION_QUANTUM 32 // Default number of payload bytes a profile may send per deficit round robin round of its priority class
+#define NOTIFICATION_SCHEDULER_STACK_SIZE 2048 // Stack of the notification scheduler task that replaced the 1024 byte task of every profile
+#define NOTIFICATION_DELTA_MAX_RUNS 4 // Changed byte ranges a delta frame may carry before a full frame is sent instead
+#define NOTIFICATION_FRAME_FULL 0x00 // Frame type of a full value, only used by profiles in delta mode
+#define NOTIFICATION_FRAME_DELTA 0x01 // Frame type of the changed byte ranges of a value, only used by profiles in delta mode
+#define NOTIFICATION_HISTOGRAM_BUCKETS 24 // Log2 buckets of a latency histogram, the last one holds every latency of 2^23 us (about 8 s) and more
+#define NOTIFICATION_BATCH_WINDOW 20 // Time in ms the first update of a batch waits for the updates of other profiles, only used when NOTIFICATION_BATCHING is defined
+#define NOTIFICATION_POLL_INTERVAL 100 // Only used when NOTIFICATION_POLLING_MODE is defined
+// #define NOTIFICATION_POLLING_MODE // Uncomment to wake the notification scheduler on a timer instead of on every push (used for latency comparison)
+
+/*
+    Macros For Connection Management
+*/
+
+#define MAX_CONNECTIONS 4 // Number of connections whose state is tracked by the server
+
+/*
+    Macros For GATT Applications
+*/
+
+#ifdef SINGLE_GATT_APPLICATION
+    #define NUM_GATT_APPLICATIONS 1 // Every service is created under the interface of application 0
+#else
+    #define NUM_GATT_APPLICATIONS NUM_PROFILES // Each profile registers the application whose ID is its profile ID
+#endif
+
+/*
+    Macros For Deferred GATT Events
+*/
+
+#define GATT_EVENT_QUEUE_LENGTH 16 // GATT events that can wait for the worker, only used when DEFERRED_GATT_EVENTS is defined
+#define GATT_EVENT_WORKER_STACK_SIZE 4096 // Stack of the worker task that runs the profile handlers, only used when DEFERRED_GATT_EVENTS is defined
+#define GATT_EVENT_WRITE_VALUE_SIZE 32 // Bytes of a written value kept in a queued event, must hold the longest characteristic value
+
+/*
+    Macros For Notification Queue Management
+*/
+
+#define NOTIFICATION_QUEUE_SLOTS 4 // Number of payloads that can be waiting to be notified per profile (must be a power of 2)
+#define NOTIFICATION_QUEUE_MASK (NOTIFICATION_QUEUE_SLOTS - 1)
+
+_Static_assert((NOTIFICATION_QUEUE_SLOTS & NOTIFICATION_QUEUE_MASK) == 0,"NOTIFICATION_QUEUE_SLOTS must be a power of 2");
+
+/*
+    Macros For The Notification Buffer Pool
+*/
+
+#define NOTIFICATION_POOL_BLOCK_SIZE 32 // Size of a pool block, must hold the largest payload of a characteristic
+#define NOTIFICATION_POOL_STORED_BLOCKS NUM_CHARACTERISTICS // The block of the last sent payload of a characteristic is kept as its stored value
+#define NOTIFICATION_POOL_BLOCKS (NUM_PROFILES*(NOTIFICATION_QUEUE_SLOTS + 1) + NOTIFICATION_POOL_STORED_BLOCKS + 2) // Queue slots and the payload in flight of every profile, the stored values, plus two blocks being filled by producers
+#define NOTIFICATION_POOL_NO_BLOCK 0xFF // Block index of a payload that does not live in the pool
+
+_Static_assert(NOTIFICATION_POOL_BLOCKS <= 32,"The free blocks of the notification pool are tracked in a 32 bit mask");
 
 /*
     Macros For Power Management
@@ -28,10 +154,40 @@
     Macros For Storage Profile Storage Limits
 */
 
-#define MUSIC_PROFILE_CHAR_LEN 32
-#define TODO_PROFILE_CHAR_LEN 32
-#define TIME_PROFILE_CHAR_LEN 5
-#define MUSIC_PLAYBACK_CHAR_LEN 5
+#define CHARACTERISTIC_LEN_ENTRY(profile,name,characteristic_uuid,length,flags) name##_CHARACTERISTIC_LEN = (length),
+enum{
+    CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_LEN_ENTRY)
+};
+
+#define DEFAULT_ATT_MTU 23 // ATT MTU of a connection until the client negotiates a larger one
+
+// Bytes of the profile storage arena, the initial storage of every characteristic and the batch buffer
+#define CHARACTERISTIC_STORAGE_ENTRY(profile,name,characteristic_uuid,length,flags) + (length)
+#ifdef NOTIFICATION_BATCHING
+    #define PROFILE_STORAGE_ARENA_SIZE (0 CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_STORAGE_ENTRY) + BATCH_RECORDS_CHARACTERISTIC_LEN)
+#else
+    #define PROFILE_STORAGE_ARENA_SIZE (0 CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_STORAGE_ENTRY))
+#endif
+
+// Handles of a characteristic, its declaration, its value and the CCCD of a notified characteristic
+#define CHARACTERISTIC_NUM_HANDLES(flags) (2 + (((flags) & CHARACTERISTIC_FLAG_NOTIFY) ? 1 : 0))
+
+// Entries of the attribute table of a profile, its service declaration and every handle of its characteristics
+#define PROFILE_MAX_ATTRIBUTES (1 + MAX_PROFILE_CHARACTERISTICS*CHARACTERISTIC_NUM_HANDLES(CHARACTERISTIC_FLAG_NOTIFY))
+
+// Handles of the services of every profile, the stack hands them out in one contiguous range as the services are created
+#define CHARACTERISTIC_HANDLE_ENTRY(profile,name,characteristic_uuid,length,flags) + CHARACTERISTIC_NUM_HANDLES(flags)
+#define ATTRIBUTE_ROUTE_TABLE_SIZE (NUM_PROFILES CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_HANDLE_ENTRY))
+
+// The batch packs the updates of the other profiles so it is the only payload that does not go through the notification pool
+// A written value is published from a pool block so the batch characteristic cannot be writable
+#define CHARACTERISTIC_POOL_BLOCK_CHECK(profile,name,characteristic_uuid,length,flags) \
+    _Static_assert((length) <= NOTIFICATION_POOL_BLOCK_SIZE || ((profile##_PROFILE_FLAGS & PROFILE_FLAG_BATCH) && !((flags) & CHARACTERISTIC_FLAG_WRITABLE)),#name " payloads must fit in a notification pool block");
+CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_POOL_BLOCK_CHECK)
+
+// Every writable value fits in a pool block, so a queued write can carry one whole
+_Static_assert(GATT_EVENT_WRITE_VALUE_SIZE >= NOTIFICATION_POOL_BLOCK_SIZE,"A deferred write must hold the longest writable value");
+
 
 /*
     Macros For Debugging
@@ -48,20 +204,16 @@
 #define GATT_CALLBACK "GATT_CALLBACK"
 #define GAP_INIT "GAP_INIT"
 #define GAP_CALLBACK "GAP_CALLBACK"
-#define MUSIC_PROFILE_CB "MUSIC_PROFILE_CB"
-#define MUSIC_PLAYBACK_PROFILE_CB "MUSIC_PLAYBACK_CB"
-#define TODO_PROFILE_CB "TODO_PROFILE_CB"
-#define TIME_PROFILE_CB "TIME_PROFILE_CB"
+#define BATCH_PROFILE_CB "BATCH_PROFILE_CB"
+#define NOTIFICATION_SCHEDULER "NOTIFICATION_SCHEDULER"
 
+#define PROFILE_LOG_TAG_ENTRY(name,service_uuid,flags,policy,priority,ttl) #name "_PROFILE_CB",
 static char* log_tags[] = {
     "GATT_INIT",
     "GATT_CALLBACK",
     "GAP_INIT",
     "GAP_CALLBACK",
-    "MUSIC_PROFILE_CB",
-    "TODO_PROFILE_CB",
-    "TIME_PROFILE_CB",
-    "MUSIC_PLAYBACK_PROFILE_CB"
+    PROFILE_DESCRIPTORS(PROFILE_LOG_TAG_ENTRY)
 };
 
 static uint8_t profile_service_uuids[32] = {
@@ -73,30 +225,373 @@ static uint8_t profile_service_uuids[32] = {
 };
 
 /*!
-    @brief Profile Structure to hold the GATT Profile Information & Storage
+    @brief Policies deciding what happens to a payload pushed to the notification queue
+*/
+typedef enum {
+    NOTIFICATION_QUEUE_KEEP_LATEST      = 0, // Only the newest payload is kept, a pending payload is overwritten (coalesced)
+    NOTIFICATION_QUEUE_FIFO_ALL         = 1, // Every payload is queued, new payloads are rejected when the queue is full
+    NOTIFICATION_QUEUE_DROP_OLDEST      = 2, // Every payload is queued, the oldest payload is dropped when the queue is full
+} notification_queue_policy_t;
+
+/*!
+    @brief Outcome of a published notification reported to its completion callback
+*/
+typedef enum{
+    NOTIFICATION_RESULT_SENT = 0, // Sent to the client, confirmed by it for an indication, or already held by it
+    NOTIFICATION_RESULT_DROPPED = 1, // Rejected by a full queue, dropped or coalesced by a newer payload, or the pool was exhausted
+    NOTIFICATION_RESULT_EXPIRED = 2, // Its deadline passed before it could be sent
+    NOTIFICATION_RESULT_NOT_SUBSCRIBED = 3, // The client was not subscribed when it was published
+    NOTIFICATION_RESULT_FAILED = 4, // Every retry of the send failed
+} notification_result_t;
+
+/*!
+    @brief Completion callback of a published notification
+    @param profile_id The profile ID
+    @param ticket The ticket returned when the notification was published
+    @param result The outcome of the notification
+*/
+typedef void (*notification_complete_cb_t)(int profile_id,uint32_t ticket,notification_result_t result);
+
+/*!
+    @brief Metadata of a payload in the notification queue
 */
 typedef struct{
-    esp_gatt_if_t profile_interface;
-    uint16_t application_id;
+    uint8_t block; // Pool block holding the payload, NOTIFICATION_POOL_NO_BLOCK when it is not in the pool
+    uint8_t length;
+    uint8_t profile_id;
+    uint8_t characteristic; // Index of the characteristic within the profile the payload is notified on
+    uint32_t ticket; // Ticket returned by bsp_publish_notification(), 0 when the payload was pushed without one
+    notification_complete_cb_t complete_callback; // Called once with the outcome of the payload, NULL when nobody waits for it
+    uint64_t push_time; // Time in microseconds when the payload was pushed
+    uint64_t deadline; // Time in microseconds after which the payload is stale and dropped instead of sent, 0 when it never expires
+} notification_entry_t;
+
+/*!
+    @brief Fixed-block pool of payload buffers shared by every profile
+
+    A producer fills a block in place and hands it to the notification queue, the queue hands it to the payload
+    in flight and a sent payload becomes the stored value of the profile. Only the block index moves along the
+    pipeline, the payload itself is copied once into the BLE stack when it is sent.
+*/
+typedef struct{
+    uint8_t blocks[NOTIFICATION_POOL_BLOCKS][NOTIFICATION_POOL_BLOCK_SIZE];
+    atomic_uint free_blocks; // Bit per free block
+    atomic_uint exhausted_count; // Acquires that failed because every block was in use
+} notification_pool_t;
+
+/*!
+    @brief Bounded lock-free ring of payloads waiting to be notified for a profile
+
+    Producers and the notification scheduler never take a lock, each slot carries a sequence counter telling
+    whether it is free for the producer at enqueue_position or filled for the consumer at dequeue_position.
+    The slots only hold the pool block of a payload, so a push or pop never copies the payload. The payloads
+    of every characteristic of the profile share the ring.
+*/
+typedef struct{
+    notification_entry_t slot_entries[NOTIFICATION_QUEUE_SLOTS];
+    atomic_uint slot_sequences[NOTIFICATION_QUEUE_SLOTS];
+    atomic_uint enqueue_position;
+    atomic_uint dequeue_position;
+    atomic_uchar policy;
+    atomic_uint coalesced_count; // Payloads overwritten by a newer one (keep latest)
+    atomic_uint rejected_count; // Payloads rejected because the queue was full (fifo all)
+    atomic_uint dropped_count; // Payloads dropped to make room for a newer one (drop oldest)
+    atomic_uint expired_count; // Payloads dropped because their deadline passed before they could be sent
+} notification_queue_t;
+
+/*!
+    @brief Token bucket limiting the notification rate of a profile
+*/
+typedef struct{
+    uint32_t token_interval; // Time in microseconds to earn one token
+    uint8_t burst; // Maximum number of tokens that can be saved up
+    uint64_t credit; // Time in microseconds earned towards tokens, token_interval of credit is one token
+    uint64_t last_refill_time;
+} notification_token_bucket_t;
+
+/*!
+    @brief Priority classes of the notification scheduler, a class is only served when no higher class can send
+*/
+typedef enum{
+    NOTIFICATION_PRIORITY_HIGH = 0,
+    NOTIFICATION_PRIORITY_NORMAL = 1,
+    NOTIFICATION_PRIORITY_LOW = 2,
+    NUM_NOTIFICATION_PRIORITIES = 3,
+} notification_priority_t;
+
+/*!
+    @brief Scheduling state of a profile, profiles of the same priority class share the link with deficit round robin
+*/
+typedef struct{
+    uint8_t priority; // One of notification_priority_t
+    uint16_t quantum; // Payload bytes added to the deficit every round
+    int32_t deficit; // Payload bytes the profile may still send in this round
+} notification_schedule_t;
+
+/*!
+    @brief Retry policy and state of the notification that is being sent for a profile
+*/
+typedef struct{
+    uint8_t max_retries;
+    uint16_t base_delay; // Delay in ms before the first retry
+    uint16_t max_delay; // Upper limit in ms of the retry delay
+    uint8_t retry_count; // Retries of the payload that is being sent
+    atomic_bool retry_scheduled; // Set while the retry timer is running
+    uint32_t failed_count; // Payloads dropped after running out of retries
+    TimerHandle_t retry_timer;
+} notification_retry_t;
+
+/*!
+    @brief States of the indication that is being sent for a profile
+*/
+typedef enum{
+    INDICATION_IDLE = 0, // No indication is waiting for a confirmation
+    INDICATION_PENDING = 1, // Sent and waiting for the confirmation of the client
+    INDICATION_CONFIRMED = 2, // Confirmed by the client, completed by the notification scheduler
+    INDICATION_FAILED = 3, // Timed out or rejected by the client, retried by the notification scheduler
+} indication_state_t;
+
+/*!
+    @brief Confirmation tracking of the indication that is being sent for a profile
+*/
+typedef struct{
+    atomic_uchar state; // One of indication_state_t
+    uint16_t connection_id; // Connection the pending indication was sent on
+    uint16_t handle; // Characteristic value handle the pending indication was sent on
+    uint16_t timeout; // Time in ms to wait for the confirmation
+    uint32_t confirmed_count; // Indications confirmed by the client
+    uint32_t timeout_count; // Indications that were not confirmed in time
+    TimerHandle_t timeout_timer;
+} notification_indication_t;
+
+/*!
+    @brief Delta encoding of the notifications of a profile
+
+    In delta mode every value is sent as a frame. A full frame is [NOTIFICATION_FRAME_FULL][value]. A
+    delta frame is [NOTIFICATION_FRAME_DELTA][value length] followed by [offset][length][bytes] runs of
+    the bytes that changed since the stored value, which is the last value the client received. The
+    full frame is used after a reconnect, a new subscription or an unconfirmed indication, and whenever
+    the delta frame would not be smaller.
+*/
+typedef struct{
+    bool enabled; // Set when the client of the profile decodes frames
+    uint32_t full_count; // Full frames sent
+    uint32_t delta_count; // Delta frames sent
+    uint32_t saved_bytes; // Bytes saved by sending delta frames instead of full frames
+} notification_delta_t;
+
+/*!
+    @brief Stages of the notification pipeline whose latencies are collected
+*/
+typedef enum{
+    NOTIFICATION_STAGE_QUEUE = 0, // Push until the notification scheduler takes the payload out of the queue, includes the rate limit
+    NOTIFICATION_STAGE_RATE_LIMIT = 1, // Time a pending payload of the profile waited for a token
+    NOTIFICATION_STAGE_SEND = 2, // Taken out of the queue until the stack accepted it or the client confirmed it, includes retries and congestion
+    NOTIFICATION_STAGE_TOTAL = 3, // Push until the stack accepted the payload or the client confirmed it
+    NUM_NOTIFICATION_STAGES = 4,
+} notification_stage_t;
+
+/*!
+    @brief Log2 histogram of the latencies of one stage of the notification pipeline
+*/
+typedef struct{
+    uint16_t buckets[NOTIFICATION_HISTOGRAM_BUCKETS]; // Bucket i counts latencies of 2^i to 2^(i+1) - 1 us, bucket 0 also counts 0 us, saturates at 65535
+    uint32_t max; // Longest latency in us
+} notification_histogram_t;
+
+/*!
+    @brief Latency histograms of the notification pipeline of a profile, only kept when NOTIFICATION_LATENCY_HISTOGRAMS is defined
+*/
+typedef struct{
+    notification_histogram_t stages[NUM_NOTIFICATION_STAGES];
+    uint64_t dequeue_time; // Time in microseconds the payload in flight was taken out of the queue, 0 when there is none
+    uint64_t rate_limit_start; // Time in microseconds the profile started waiting for a token, 0 when it is not waiting
+} notification_latency_t;
+
+/*!
+    @brief Batch of updates packed into one notification of the batch characteristic
+
+    Each update is a TLV record of the profile ID, the payload length and the payload. The payload of a
+    member profile stays in flight until the batch is sent and is then completed like a notification,
+    the records are only assembled from the member payloads when the batch is sent.
+*/
+typedef struct{
+    uint32_t members; // Bit per profile whose payload is packed in the batch
+    const uint8_t* payloads[NUM_PROFILES]; // In flight payload of each member
+    uint8_t lengths[NUM_PROFILES]; // Length of the payload of each member
+    bool full; // Set when an update did not fit, the batch is sent without waiting for the window
+    uint16_t mtu; // ATT MTU of the connection of the batch profile
+    uint32_t batch_count; // Batches sent
+    uint32_t batched_count; // Updates sent inside a batch
+} notification_batch_t;
+
+/*!
+    @brief GATT event copied by the Bluetooth callback for the worker task, only used when DEFERRED_GATT_EVENTS is defined
+
+    The pointers of the parameters belong to the stack and are gone once the callback returns, so the data they
+    point to is copied into the record and the worker points them at the copy.
+*/
+typedef struct{
+    esp_gatts_cb_event_t event;
+    esp_gatt_if_t gatt_interface;
+    esp_ble_gatts_cb_param_t param;
+    union{
+        uint8_t write_value[GATT_EVENT_WRITE_VALUE_SIZE]; // Value of a write, longer writes are rejected by the handlers without reading it
+        uint16_t attribute_handles[PROFILE_MAX_ATTRIBUTES]; // Handles of a created attribute table
+    } data;
+} gatt_event_record_t;
+
+/*!
+    @brief Time the Bluetooth task spends in the GATT callback of the server
+*/
+typedef struct{
+    uint32_t max_duration; // Longest callback in us
+    esp_gatts_cb_event_t max_duration_event; // Event of the longest callback
+    uint32_t events; // Callbacks measured
+    uint32_t dropped_events; // Events dropped because the queue of the worker was full, only used when DEFERRED_GATT_EVENTS is defined
+} gatt_callback_stats_t;
+
+/*!
+    @brief Double buffered stored value of a characteristic, published with a sequence counter so that reads take no lock
+
+    Writers hold the profile semaphore, fill a buffer of their own and publish it in the free slot by incrementing the
+    sequence. A reader copies the slot of the sequence it loaded and retries if the sequence has changed meanwhile, so it
+    never blocks and never returns a partly written value.
+*/
+typedef struct{
+    uint8_t* _Atomic buffers[2]; // The stored value is buffers[sequence & 1], the last sent or written payload
+    atomic_uchar lengths[2];
+    uint8_t blocks[2]; // Pool block of each buffer, NOTIFICATION_POOL_NO_BLOCK while it is the slice of the profile storage
+    atomic_uint sequence; // Incremented by every publish
+} stored_value_t;
+
+/*!
+    @brief State & Storage of one characteristic of a profile used by the notify and read paths
+*/
+typedef struct{
+    stored_value_t stored_value;
+    uint16_t handle;
+    uint16_t cccd_status;
+    uint8_t local_storage_limit;
+    atomic_bool delta_synced; // Set while the client holds the stored value so that deltas can be applied to it
+} characteristic_t;
+
+/*!
+    @brief Profile Structure to hold the GATT Profile State & Storage used by the notify and read paths
+
+    The fields read for every notification come first, ordered by size so that they pack without padding.
+    The setup only information of the profile is kept apart in profile_config_t.
+*/
+typedef struct{
+    uint8_t *notification_buffer; // Payload taken from the notification queue that is being sent, points into the pool block of the entry
     uint16_t connection_id;
-    uint16_t service_handle;
-    uint16_t service_id;
-    uint16_t characteristic_handle;
+    esp_gatt_if_t profile_interface;
+    uint8_t num_characteristics;
+    characteristic_t characteristics[MAX_PROFILE_CHARACTERISTICS];
+    notification_entry_t notification_entry; // Length is 0 when no payload is being sent
+    notification_token_bucket_t notification_token_bucket;
+    notification_schedule_t notification_schedule;
+    notification_retry_t notification_retry;
+    notification_indication_t notification_indication;
+    notification_delta_t notification_delta;
+    atomic_uint notification_ttl; // Default time to live in ms of the payloads pushed to the profile, NOTIFICATION_TTL_NONE when they never expire
+    notification_queue_t notification_queue;
+    #ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+        notification_latency_t notification_latency;
+    #endif
+} profile_t;
+
+/*!
+    @brief Setup only information of a characteristic, used when it is added to the service of its profile
+*/
+typedef struct{
     esp_attr_value_t attribute_value;
     esp_bt_uuid_t characteristic_uuid;
-    esp_gatt_perm_t attribute_permissions;
-    esp_gatt_perm_t characteristic_properties;
-    uint16_t characteristic_descriptor_handle;
     esp_bt_uuid_t characteristic_descriptor_uuid;
-    esp_gatts_cb_t profile_event_handler;
-    uint16_t cccd_status;
-    uint8_t *local_storage;
-    uint8_t local_storage_limit;
-    uint8_t local_storage_len;
-    uint64_t last_notification_time;
-    uint8_t *notification_queue_buffer;
-    uint8_t notification_queue_len;
-} profile_t;
+    uint16_t characteristic_descriptor_handle;
+    esp_gatt_perm_t attribute_permissions;
+    esp_gatt_char_prop_t characteristic_properties;
+    uint8_t flags; // CHARACTERISTIC_FLAG_* bits of its descriptor
+} characteristic_config_t;
+
+/*!
+    @brief Setup only information of a profile, used when it is registered and its service and characteristics are created
+*/
+typedef struct{
+    characteristic_config_t characteristics[MAX_PROFILE_CHARACTERISTICS];
+    uint16_t application_id;
+    uint16_t service_handle;
+    uint16_t service_id;
+    uint8_t num_handles; // Handles reserved for the service of the profile
+    uint8_t characteristics_added; // Characteristics added to the service so far, they are added one at a time
+    #ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+        esp_gatts_attr_db_t attribute_table[PROFILE_MAX_ATTRIBUTES]; // The stack reads the UUIDs and values it points to after the request returns
+        uint8_t service_uuid[ESP_UUID_LEN_128]; // The 16 bit service UUID in the 128 bit form used by hal_ble_create_service_id
+    #endif
+} profile_config_t;
+
+/*!
+    @brief Compile time description of a profile, one entry of PROFILE_DESCRIPTORS
+*/
+typedef struct{
+    uint16_t service_uuid;
+    uint8_t flags; // PROFILE_FLAG_* bits selecting how the profile handles its events
+    notification_queue_policy_t notification_queue_policy;
+    notification_priority_t notification_priority;
+    uint32_t notification_ttl; // Default time to live in ms of the payloads, NOTIFICATION_TTL_NONE when they never expire
+} profile_descriptor_t;
+
+/*!
+    @brief Compile time description of a characteristic, one entry of CHARACTERISTIC_DESCRIPTORS
+*/
+typedef struct{
+    uint8_t profile_id; // The profile that owns the characteristic
+    uint16_t uuid;
+    uint8_t length; // Largest value of the characteristic, its slice of the profile storage
+    uint8_t flags; // CHARACTERISTIC_FLAG_* bits
+} characteristic_descriptor_t;
+
+/*!
+    @brief One value of a characteristic pushed together with the values of the other characteristics of its profile
+*/
+typedef struct{
+    uint8_t characteristic; // Index of the characteristic within the profile
+    const uint8_t* data;
+    uint16_t length;
+} characteristic_update_t;
+
+/*!
+    @brief Role of an attribute handle of a profile
+*/
+typedef enum{
+    ATTRIBUTE_ROLE_NONE = 0, // The handle does not belong to a profile
+    ATTRIBUTE_ROLE_SERVICE = 1,
+    ATTRIBUTE_ROLE_VALUE = 2, // The value of a characteristic
+    ATTRIBUTE_ROLE_CCCD = 3, // The client characteristic configuration descriptor of a characteristic
+    ATTRIBUTE_ROLE_USER_DESCRIPTION = 4, // The user description descriptor of a characteristic
+} attribute_role_t;
+
+/*!
+    @brief Owner of an attribute handle, looked up to dispatch the reads and writes of the client
+*/
+typedef struct{
+    uint8_t profile_id;
+    uint8_t characteristic; // Index of the characteristic within the profile
+    uint8_t role; // attribute_role_t of the handle
+} attribute_route_t;
+
+/*!
+    @brief Static arena holding the server profile table and the storage of every profile
+
+    Its size is fixed at compile time from the characteristic lengths so the server table is never allocated from the
+    heap, and creating the table again after bsp_stop_server() reuses the same memory. The arena is placed in
+    internal DRAM because the notify and read paths go through it.
+*/
+typedef struct{
+    profile_t profiles[NUM_PROFILES];
+    uint8_t storage[PROFILE_STORAGE_ARENA_SIZE];
+    uint16_t storage_used; // Bytes of the storage handed out since the server table was created
+} profile_arena_t;
 
 /*
     Structures For The Server
@@ -164,25 +659,26 @@ esp_ble_conn_update_params_t conn_params = {
 */
 
 
-//Creating an array of 16 bit UUIDs for the services that will be created based on the bluetooth specification used as standard
-
-static uint16_t service_uuids[NUM_PROFILES] = {
-    0x1840, // Music Service 
-    0x1801, // Todo Service
-    0x1847, // Time Service
-    0x1848 // Music Playback Service
+// Creating the table of the profile descriptors, the 16 bit UUIDs of the services and characteristics are based on the bluetooth specification used as standard
+#define PROFILE_DESCRIPTOR_ENTRY(name,service_uuid,flags,policy,priority,ttl) {service_uuid,flags,policy,priority,ttl},
+static const profile_descriptor_t bsp_profile_descriptors[NUM_PROFILES] = {
+    PROFILE_DESCRIPTORS(PROFILE_DESCRIPTOR_ENTRY)
 };
 
-// Creating array of 16 bit UUIDs for the characteristics that will be created based on the bluetooth specification used as standard
-static uint16_t characteristic_uuids[NUM_PROFILES] = {
-    0x2B93, // Music Characteristic
-    0x2A3D, // Todo Characteristic
-    0x2A2B, // Time Characteristic
-    0x2BA3 // Music Playback Characteristic
+// Creating the table of the characteristic descriptors, the characteristics of a profile are carved from its storage in this order
+#define CHARACTERISTIC_DESCRIPTOR_ENTRY(profile,name,characteristic_uuid,length,flags) {profile##_PROFILE_ID,characteristic_uuid,length,flags},
+static const characteristic_descriptor_t bsp_characteristic_descriptors[NUM_CHARACTERISTICS] = {
+    CHARACTERISTIC_DESCRIPTORS(CHARACTERISTIC_DESCRIPTOR_ENTRY)
 };
 
+// Creating the arena the server profile table and the profile storage are carved from
+static DRAM_ATTR profile_arena_t bsp_profile_arena;
+
 profile_t* bsp_gatt_server_application_profile_table;
 
+// Creating the table of the setup only information of the profiles, kept out of the arena as the notify and read paths never touch it
+static profile_config_t bsp_gatt_server_profile_config_table[NUM_PROFILES];
+
 /*
     State Variables
 */
@@ -197,6 +693,90 @@ static TimerHandle_t advertisement_timer; // This timer will be used to switch b
 // Creating mutex for each of the number of profiles so that mutual exclusions can be created for anything
 // targeting the local storage and the notification queue especially when there is a writing being carried out to the notification and the local storage
 static SemaphoreHandle_t bsp_profile_semaphores[NUM_PROFILES];
+static StaticSemaphore_t bsp_profile_semaphore_storage[NUM_PROFILES];
+
+// Creating the storage of the notification timers of every profile, they are created once and reused when the server is initialized again
+static StaticTimer_t bsp_notification_retry_timer_storage[NUM_PROFILES];
+static TimerHandle_t bsp_notification_retry_timers[NUM_PROFILES];
+static StaticTimer_t bsp_indication_timeout_timer_storage[NUM_PROFILES];
+static TimerHandle_t bsp_indication_timeout_timers[NUM_PROFILES];
+
+// Creating the table routing each attribute handle of the profiles to its owner, indexed from the first handle of the first service
+static attribute_route_t bsp_attribute_routes[ATTRIBUTE_ROUTE_TABLE_SIZE];
+static uint16_t bsp_attribute_route_base; // Handle of entry 0 of the route table, 0 until the first service is created
+
+// Creating a congestion flag for each connection, set by the GATT callbacks when the controller buffers are full so that the notification scheduler holds their payloads
+static atomic_bool bsp_connection_congested[MAX_CONNECTIONS];
+
+// Creating a counter for each connection of how many times it has been congested
+static uint32_t bsp_connection_congestion_count[MAX_CONNECTIONS];
+
+// Creating a response for each connection, filled in place for every read and write so the 600 byte response is never built on the BTC task stack
+static esp_gatt_rsp_t bsp_gatt_responses[MAX_CONNECTIONS];
+
+#ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+// Creating the UUIDs and initial values the attribute tables point to, the stack reads them after the table is requested
+static const uint16_t bsp_primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
+static const uint16_t bsp_characteristic_declaration_uuid = ESP_GATT_UUID_CHAR_DECLARE;
+static const uint16_t bsp_client_configuration_uuid = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+static const uint8_t bsp_client_configuration_value[2] = {0x00,0x00};
+#endif
+
+// Creating a slot for each connection holding the profile ID + 1 of the profile waiting for an indication confirmation, 0 when no indication is outstanding
+static atomic_int bsp_connection_indicating_profile[MAX_CONNECTIONS];
+
+#ifdef NOTIFICATION_BATCHING
+    // Creating the batch that is being packed by the notification scheduler
+    static notification_batch_t bsp_notification_batch = {.mtu = DEFAULT_ATT_MTU};
+#endif
+
+// Creating the pool of payload buffers used by the notification queues of every profile
+static notification_pool_t bsp_notification_pool;
+
+#ifdef TESTING
+    /*!
+        @brief Number of times a payload was copied at each stage of the notification pipeline
+    */
+    typedef struct{
+        atomic_uint producer_copies; // Payloads copied into a pool block by bsp_push_data_to_notification_queue()
+        atomic_uint batch_copies; // Payloads copied when the batch is assembled
+        atomic_uint stack_copies; // Payloads handed to the BLE stack, which copies them into the PDU
+    } notification_copy_counts_t;
+
+    static notification_copy_counts_t bsp_notification_copy_counts;
+
+    // Creating the lowest stack high-water mark seen at the end of a GATT callback and its event, the callbacks run on the BTC task
+    // They are atomic because the GATT event worker logs them when DEFERRED_GATT_EVENTS is defined
+    static atomic_uint bsp_btc_stack_high_water_mark = ~0u;
+    static atomic_int bsp_btc_stack_high_water_mark_event;
+
+    // Creating the boot benchmark of the server, the free heap and time when the initialization starts and the services started since
+    static uint32_t bsp_server_init_free_heap;
+    static uint64_t bsp_server_init_time;
+    static uint8_t bsp_services_started;
+    static bool bsp_advertising_start_reported;
+#endif
+
+// Creating a handle for the notification scheduler task that sends the payloads of every profile, so that the producers can wake it up directly when data is pushed
+static TaskHandle_t bsp_notification_scheduler_handle;
+static StaticTask_t bsp_notification_scheduler_tcb;
+static StackType_t bsp_notification_scheduler_stack[NOTIFICATION_SCHEDULER_STACK_SIZE];
+
+// Creating the worst case time the Bluetooth task has spent in the GATT callback, only the callback writes it
+static atomic_uint bsp_gatt_callback_max_duration;
+static atomic_int bsp_gatt_callback_max_duration_event;
+static atomic_uint bsp_gatt_callback_events;
+
+#ifdef DEFERRED_GATT_EVENTS
+    // Creating the queue the GATT callback copies the events into and the worker task that handles them, both static so they do not come from the heap
+    static QueueHandle_t bsp_gatt_event_queue;
+    static StaticQueue_t bsp_gatt_event_queue_storage;
+    static uint8_t bsp_gatt_event_queue_buffer[GATT_EVENT_QUEUE_LENGTH*sizeof(gatt_event_record_t)];
+    static TaskHandle_t bsp_gatt_event_worker_handle;
+    static StaticTask_t bsp_gatt_event_worker_tcb;
+    static StackType_t bsp_gatt_event_worker_stack[GATT_EVENT_WORKER_STACK_SIZE];
+    static atomic_uint bsp_gatt_events_dropped;
+#endif
 
 // Creating a timer for the server start
 
@@ -221,6 +801,13 @@ uint8_t current_power_mode = HIGH_POWER_MODE;
     @param param The parameters for the event
 */
 static void bsp_server_gatt_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
+/*!
+    @brief GATT Server Callback registered with the stack, runs on the Bluetooth task and measures how long it holds it
+    @param event The event that is being handled
+    @param gatt_interface The GATT Interface
+    @param param The parameters for the event
+*/
+static void bsp_server_gatt_callback(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
 /*!
     @brief GAP Server Profile Event Handler
     @param event The event that is being handled
@@ -229,36 +816,49 @@ static void bsp_server_gatt_profile_handler(esp_gatts_cb_event_t event,esp_gatt_
 static void bsp_server_gap_profile_handler(esp_gap_ble_cb_event_t event,esp_ble_gap_cb_param_t *param);
 
 /*!
-    @brief Music Profile Event Handler
-    @param event The event that is being handled
-    @param gatt_interface The GATT Interface
-    @param param The parameters for the event
+    @brief Clear the attribute route table, before the services of the profiles are created again
 */
-static void bsp_gatt_server_music_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
+void bsp_reset_attribute_routes();
 /*!
-    @brief Todo Profile Event Handler
-    @param event The event that is being handled
-    @param gatt_interface The GATT Interface
-    @param param The parameters for the event
+    @brief Route an attribute handle to its profile, called as the services, characteristics and descriptors are added
+    @param handle The attribute handle
+    @param profile_id The profile the handle belongs to
+    @param characteristic The index of the characteristic within the profile
+    @param role The role of the handle
+    @return True if the handle was routed, false if it is outside of the handle range of the profiles
 */
-static void bsp_gatt_server_todo_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
+bool bsp_add_attribute_route(uint16_t handle,int profile_id,uint8_t characteristic,attribute_role_t role);
 /*!
-    @brief Time Profile Event Handler
-    @param event The event that is being handled
-    @param gatt_interface The GATT Interface
-    @param param The parameters for the event
+    @brief Look up the owner of an attribute handle
+    @param handle The attribute handle
+    @return The route of the handle, NULL if the handle does not belong to a profile
 */
-static void bsp_gatt_server_time_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
+const attribute_route_t* bsp_get_attribute_route(uint16_t handle);
+
 /*!
-    @brief Music Playback Profile Event Handler
+    @brief Profile Event Handler shared by every profile, the flags of its descriptor select how each event is handled
     @param event The event that is being handled
     @param gatt_interface The GATT Interface
     @param param The parameters for the event
+    @param profile_id The ID of the profile the event is for
 */
-static void bsp_gatt_server_music_playback_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param);
+static void bsp_gatt_server_profile_event_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
 
 //  Creating modular functions to implement certain functions in order to make the code more readable
 
+/*!
+    @brief Answer a read or write request of the client from the preallocated response of its connection
+    @param gatt_interface The GATT Interface
+    @param connection_id The connection ID
+    @param trans_id The transfer ID of the request
+    @param status The status of the response
+    @param handle The attribute handle
+    @param length The length of the value, only these bytes are copied into the response
+    @param value The value, NULL when length is 0
+    @return ESP_OK on success, otherwise the error of the stack
+*/
+esp_err_t bsp_send_gatt_response(esp_gatt_if_t gatt_interface,uint16_t connection_id,uint32_t trans_id,esp_gatt_status_t status,uint16_t handle,uint16_t length,const uint8_t* value);
+
 /*!
     @brief Handle Client Characteristic Configuration Descriptor of the Server Characteristic depending on the configuration
     @param gatt_interface The GATT Interface
@@ -291,17 +891,37 @@ void bsp_handle_read_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param
     @param gatt_interface The GATT Interface
     @param param The parameters for the event
     @param profile_id The profile ID
-    @param requires_notifications If the profile requires notifications
 */
-void bsp_handle_create_service_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id,bool requires_notifications);
+void bsp_handle_create_service_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
+#ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+/*!
+    @brief Create the service of a profile and all of its characteristics as one attribute table answered by the stack
+    @param gatt_interface The GATT Interface
+    @param profile_id The profile ID
+    @return ESP_OK on success, otherwise the error of the stack
+*/
+esp_err_t bsp_create_attribute_table(esp_gatt_if_t gatt_interface,int profile_id);
+/*!
+    @brief Handle Create Attribute Table Request, recording the handles of the table and starting the service
+    @param gatt_interface The GATT Interface
+    @param param The parameters for the event
+    @param profile_id The profile ID
+*/
+void bsp_handle_create_attribute_table_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
+#endif
 /*!
-    @brief Handle Add Characteristic Request
+    @brief Handle Add Characteristic Request, adding its CCCD or the next characteristic of the profile
     @param gatt_interface The GATT Interface
     @param param The parameters for the event
     @param profile_id The profile ID
-    @param requires_notifications If the profile requires notifications
 */
-void bsp_handle_add_characteristic_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id,bool requires_notifications);
+void bsp_handle_add_characteristic_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
+/*!
+    @brief Add the next characteristic of a profile to its service, the stack reports each one before the next can be added
+    @param profile_id The profile ID
+    @return True if a characteristic was added, false if every characteristic of the profile has been added
+*/
+bool bsp_add_next_characteristic(int profile_id);
 /*!
     @brief Handle Add Characteristic Descriptor Request
     @param gatt_interface The GATT Interface
@@ -342,25 +962,331 @@ void bsp_disable_notifications(uint16_t* cccd_status);
 */
 bool bsp_has_data_changed(const uint8_t* new_data,const uint8_t* old_data,uint16_t length);// Check if the data has changed
 /*!
-    @brief Notify the client of the data change
-    @param param The parameters for the event
+    @brief Copy the stored value of a characteristic without taking a lock, the copy is retried if a writer publishes meanwhile
+    @param characteristic The characteristic
+    @param destination The buffer the value is copied into
+    @param size The size of the buffer, a longer value is cut off
+    @return The length of the copied value
 */
-void bsp_start_notification_task(int profile_id);
+uint16_t bsp_read_stored_value(characteristic_t* characteristic,uint8_t* destination,uint16_t size);
 /*!
-    @brief Notify the client of the data change
-    @param param The parameters for the event
+    @brief Get the stored value of a characteristic in place, only for writers holding the profile semaphore
+    @param characteristic The characteristic
+    @param length Set to the length of the value
+    @return The buffer holding the value
+*/
+uint8_t* bsp_get_stored_value(characteristic_t* characteristic,uint8_t* length);
+/*!
+    @brief Publish a buffer as the stored value of a characteristic, the caller must hold the profile semaphore
+    @param characteristic The characteristic
+    @param buffer The buffer holding the new value, owned by the characteristic from now on
+    @param block The pool block of the buffer, NOTIFICATION_POOL_NO_BLOCK if it is not from the pool
+    @param length The length of the value
+    @return The buffer of the replaced value, its pool block has been released
+*/
+uint8_t* bsp_publish_stored_value(characteristic_t* characteristic,uint8_t* buffer,uint8_t block,uint8_t length);
+/*!
+    @brief Start the notification scheduler task and create the notification timers of every profile
+*/
+void bsp_start_notification_scheduler();
+/*!
+    @brief Send the queued payloads of every profile by priority class, sharing each class with deficit round robin
+    @param param The parameters for the task
+*/
+void bsp_notification_scheduler_task(void *param);
+/*!
+    @brief Wake the notification scheduler to look for payloads that can be sent
+*/
+void bsp_wake_notification_scheduler();
+/*!
+    @brief Change the priority class and deficit round robin quantum of a profile
+    @param profile_id The profile ID
+    @param priority The priority class of the profile
+    @param quantum The payload bytes the profile may send per round of its class
+*/
+void bsp_set_notification_priority(int profile_id,notification_priority_t priority,uint16_t quantum);
+/*!
+    @brief Copy the time the Bluetooth task has spent in the GATT callback
+    @param stats The copy of the callback statistics
+*/
+void bsp_get_gatt_callback_stats(gatt_callback_stats_t* stats);
+/*!
+    @brief Clear the time the Bluetooth task has spent in the GATT callback
 */
-void bsp_notify_task(void *param);
+void bsp_reset_gatt_callback_stats();
+/*!
+    @brief Log the worst case GATT callback duration and its event
+*/
+void bsp_dump_gatt_callback_stats();
+#ifdef DEFERRED_GATT_EVENTS
+    /*!
+        @brief Create the GATT event queue and start the worker task that handles its events
+    */
+    void bsp_start_gatt_event_worker();
+    /*!
+        @brief Run the profile handlers for the GATT events queued by the Bluetooth callback
+        @param param The parameters for the task
+    */
+    void bsp_gatt_event_worker_task(void *param);
+#endif
 /*!
     @brief Initialize the semaphores for the profiles
     @param num_profiles The number of profiles
 */
 void bsp_init_semaphores(uint8_t num_profiles);
 /*!
-    @brief Handle the advertisement timer
-    @param param The parameters for the event
+    @brief Copy data into a pool buffer and push it to the notification queue of a profile, waking up the notification scheduler
+    @param profile_id The profile ID
+    @param data The data to be notified
+    @param length The length of the data
 */
 void bsp_push_data_to_notification_queue(int profile_id,uint8_t * data,uint16_t length);
+/*!
+    @brief Copy data into a pool buffer and push it to the notification queue of a profile with its own time to live
+    @param profile_id The profile ID
+    @param data The data to be notified
+    @param length The length of the data
+    @param ttl_ms The time in ms after which the data is dropped if it has not been sent, NOTIFICATION_TTL_NONE to never drop it
+*/
+void bsp_push_data_to_notification_queue_with_ttl(int profile_id,uint8_t * data,uint16_t length,uint32_t ttl_ms);
+/*!
+    @brief Publish data to a profile without waiting for it to be sent
+    @param profile_id The profile ID
+    @param data The data to be notified
+    @param length The length of the data
+    @param complete_callback Called once with the outcome and must not block. Where it runs depends on the result:
+                             - SENT, EXPIRED, FAILED, NOT_SUBSCRIBED of a queued payload and DROPPED by coalescing run on the
+                               notification scheduler task with the semaphore of the profile held
+                             - NOT_SUBSCRIBED at publish and DROPPED for an exhausted pool run on the task calling this function
+                             - DROPPED by a full queue, the new payload or the oldest one it pushes out, runs on the task of that
+                               push, without the semaphore unless the push came from bsp_push_characteristic_updates()
+    @return The ticket passed to the callback, 0 if the profile or the length is invalid and the callback will not be called
+*/
+uint32_t bsp_publish_notification(int profile_id,uint8_t * data,uint16_t length,notification_complete_cb_t complete_callback);
+/*!
+    @brief Copy data into a pool buffer and push it to the notification queue of one characteristic of a profile
+    @param profile_id The profile ID
+    @param characteristic The index of the characteristic within the profile
+    @param data The data to be notified
+    @param length The length of the data
+    @return True if the data was queued, false if it was rejected
+*/
+bool bsp_push_characteristic_data(int profile_id,uint8_t characteristic,uint8_t * data,uint16_t length);
+/*!
+    @brief Push the values of several characteristics of a profile together, holding the semaphore of the profile so
+           the notification scheduler and the client writes see every value at once
+    @param profile_id The profile ID
+    @param updates The characteristic values
+    @param num_updates The number of values
+    @return The number of values that were queued
+*/
+uint8_t bsp_push_characteristic_updates(int profile_id,const characteristic_update_t* updates,uint8_t num_updates);
+/*!
+    @brief Take a buffer from the notification pool for a producer to fill in place
+    @param profile_id The profile ID
+    @return The buffer of at least local_storage_limit bytes of characteristic 0, NULL if the pool is exhausted
+*/
+uint8_t* bsp_acquire_notification_buffer(int profile_id);
+/*!
+    @brief Hand a filled pool buffer to the notification queue of a profile without copying it, waking up the notification scheduler
+    @param profile_id The profile ID
+    @param buffer The buffer returned by bsp_acquire_notification_buffer(), owned by the notification pipeline afterwards
+    @param length The length of the data in the buffer
+    @return True if the buffer was queued, false if it was rejected and returned to the pool
+*/
+bool bsp_push_notification_buffer(int profile_id,uint8_t* buffer,uint16_t length);
+/*!
+    @brief Hand a filled pool buffer to the notification queue of a profile with its own time to live
+    @param profile_id The profile ID
+    @param buffer The buffer returned by bsp_acquire_notification_buffer(), owned by the notification pipeline afterwards
+    @param length The length of the data in the buffer
+    @param ttl_ms The time in ms after which the data is dropped if it has not been sent, NOTIFICATION_TTL_NONE to never drop it
+    @return True if the buffer was queued, false if it was rejected and returned to the pool
+*/
+bool bsp_push_notification_buffer_with_ttl(int profile_id,uint8_t* buffer,uint16_t length,uint32_t ttl_ms);
+/*!
+    @brief Give an acquired buffer that was not pushed back to the notification pool
+    @param buffer The buffer returned by bsp_acquire_notification_buffer()
+*/
+void bsp_release_notification_buffer(uint8_t* buffer);
+/*!
+    @brief Initialize the notification pool with every block free
+*/
+void bsp_init_notification_pool();
+/*!
+    @brief Take a free block from the notification pool, safe to call from several tasks at once
+    @return The block index, NOTIFICATION_POOL_NO_BLOCK if the pool is exhausted
+*/
+uint8_t bsp_notification_pool_acquire();
+/*!
+    @brief Give a block back to the notification pool
+    @param block The block index, NOTIFICATION_POOL_NO_BLOCK is ignored
+*/
+void bsp_notification_pool_release(uint8_t block);
+/*!
+    @brief Initialize a notification queue
+    @param queue The notification queue
+    @param policy The policy of the notification queue
+*/
+void bsp_init_notification_queue(notification_queue_t* queue,notification_queue_policy_t policy);
+/*!
+    @brief Push a pool block to a notification queue according to its policy, safe to call from several tasks at once
+    @param queue The notification queue
+    @param entry The pool block and metadata of the payload, the block is owned by the queue afterwards
+    @return True if the payload was queued, false if it was rejected and its block returned to the pool
+*/
+bool bsp_notification_queue_push(notification_queue_t* queue,const notification_entry_t* entry);
+/*!
+    @brief Take the oldest payload out of a notification queue, when the policy is keep latest the newest one of the
+           payloads of the same characteristic waiting behind it
+    @param queue The notification queue
+    @param entry The pool block and metadata of the payload, owned by the caller afterwards
+    @return True if a payload was taken, false if the queue is empty
+*/
+bool bsp_notification_queue_pop(notification_queue_t* queue,notification_entry_t* entry);
+/*!
+    @brief Get the number of payloads waiting in a notification queue
+    @param queue The notification queue
+    @return The number of payloads
+*/
+uint8_t bsp_notification_queue_count(notification_queue_t* queue);
+/*!
+    @brief Change the rate limit of the notifications of a profile
+    @param profile_id The profile ID
+    @param token_interval_ms The time in milliseconds to earn one notification token
+    @param burst The number of tokens that can be saved up to send notifications back to back
+*/
+void bsp_set_notification_rate_limit(int profile_id,uint32_t token_interval_ms,uint8_t burst);
+/*!
+    @brief Get the time until a profile has a notification token, refilling its token bucket
+    @param profile_id The profile ID
+    @return The time in milliseconds until a token is available, 0 if a token is available
+*/
+uint32_t bsp_get_notification_token_wait_time(int profile_id);
+/*!
+    @brief Use up a notification token of a profile
+    @param profile_id The profile ID
+*/
+void bsp_consume_notification_token(int profile_id);
+/*!
+    @brief Change the retry policy of the notifications of a profile
+    @param profile_id The profile ID
+    @param max_retries The number of times a failed notification is retried before it is dropped
+    @param base_delay_ms The delay in ms before the first retry, doubled for every following retry
+    @param max_delay_ms The upper limit in ms of the retry delay
+*/
+void bsp_set_notification_retry_policy(int profile_id,uint8_t max_retries,uint16_t base_delay_ms,uint16_t max_delay_ms);
+/*!
+    @brief Handle a failed notification by scheduling a retry with exponential backoff and jitter, or dropping it
+    @param profile_id The profile ID
+*/
+void bsp_schedule_notification_retry(int profile_id);
+/*!
+    @brief Retry timer callback waking the notification scheduler for a profile
+    @param timer The retry timer
+*/
+void bsp_notification_retry_timer_callback(TimerHandle_t timer);
+/*!
+    @brief Handle a congestion event of a connection, waking the notification scheduler when the congestion is relieved
+    @param gatt_interface The GATT Interface
+    @param param The parameters for the event
+    @param profile_id The profile ID
+*/
+void bsp_handle_congestion_event(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
+/*!
+    @brief Handle the confirmation of an indication, waking the notification scheduler so the next indication of the connection is sent
+    @param gatt_interface The GATT Interface
+    @param param The parameters for the event
+    @param profile_id The profile ID
+*/
+void bsp_handle_indication_confirmation(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id);
+/*!
+    @brief Timeout timer callback failing the unconfirmed indication of a profile so that it is retried
+    @param timer The timeout timer
+*/
+void bsp_indication_timeout_timer_callback(TimerHandle_t timer);
+/*!
+    @brief Change the time a profile waits for an indication to be confirmed
+    @param profile_id The profile ID
+    @param timeout_ms The time in ms to wait for the confirmation
+*/
+void bsp_set_indication_timeout(int profile_id,uint16_t timeout_ms);
+/*!
+    @brief Enable or disable the delta encoding of the notifications of a profile
+    @param profile_id The profile ID
+    @param enabled True to send frames with only the changed byte ranges, false to send the plain value
+*/
+void bsp_set_notification_delta(int profile_id,bool enabled);
+/*!
+    @brief Check if a connection is congested
+    @param connection_id The connection ID
+    @return True if the connection is congested, false otherwise
+*/
+bool bsp_is_connection_congested(uint16_t connection_id);
+/*!
+    @brief Change the policy of the notification queue of a profile
+    @param profile_id The profile ID
+    @param policy The policy of the notification queue
+*/
+void bsp_set_notification_queue_policy(int profile_id,notification_queue_policy_t policy);
+/*!
+    @brief Change the default time to live of the payloads pushed to a profile
+    @param profile_id The profile ID
+    @param ttl_ms The time in ms after which a payload is dropped if it has not been sent, NOTIFICATION_TTL_NONE to never drop them
+*/
+void bsp_set_notification_ttl(int profile_id,uint32_t ttl_ms);
+
+#ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+    /*!
+        @brief Copy the latency histogram of one stage of the notification pipeline of a profile
+        @param profile_id The profile ID
+        @param stage The stage of the notification pipeline
+        @param histogram The copy of the histogram
+        @return True if the histogram was copied, false otherwise
+    */
+    bool bsp_get_notification_latency(int profile_id,notification_stage_t stage,notification_histogram_t* histogram);
+    /*!
+        @brief Clear the latency histograms of a profile
+        @param profile_id The profile ID
+    */
+    void bsp_reset_notification_latency(int profile_id);
+    /*!
+        @brief Format the latency histograms of a profile as one compact record
+        @param profile_id The profile ID
+        @param record The buffer the record is written to
+        @param size The size of the buffer
+        @return The length of the record, truncated to size - 1
+
+        The record is "p<id>" followed by ";<stage>:<max us>:<bucket 0>,<bucket 1>,..." for each of the
+        stages q (queue), r (rate limit), s (send) and t (total), trailing empty buckets are left out.
+    */
+    int bsp_format_notification_latency(int profile_id,char* record,size_t size);
+    /*!
+        @brief Log the latency record of every profile
+    */
+    void bsp_dump_notification_latency();
+#endif
+#ifdef NOTIFICATION_BATCHING
+/*!
+    @brief Check if the updates of a characteristic are packed into the batch characteristic instead of being notified on their own
+    @param profile_id The profile ID
+    @param characteristic The index of the characteristic within the profile, only characteristic 0 is batched
+    @return True if the client is subscribed to the batch characteristic and the characteristic does not use indications
+*/
+bool bsp_is_notification_batching_active(int profile_id,uint8_t characteristic);
+/*!
+    @brief Pack the payload that is being sent for a profile into the batch as a TLV record
+    @param profile_id The profile ID
+    @return True if the record was added, false if the batch is full and has to be sent first
+*/
+bool bsp_add_to_notification_batch(int profile_id);
+/*!
+    @brief Send the batch once its window has passed or it is full, completing the payloads of its members
+    @param wait_ticks Lowered to the remaining window when the batch is still waiting for updates
+    @return True if the batch was sent
+*/
+bool bsp_flush_notification_batch(TickType_t* wait_ticks);
+#endif
 
 // Power Management Functions
 
@@ -385,30 +1311,30 @@ void bsp_initialize_sleep_configuration();
 */
 void bsp_initialize_server(char* device_name);
 /*!
-    @brief Create the storage for the profile
+    @brief Carve the storage for the profile out of the profile arena
     @param max_length The maximum length of the storage
-    @return The storage for the profile
+    @return The zeroed storage for the profile, NULL if PROFILE_STORAGE_ARENA_SIZE is too small
 */
-uint8_t* bsp_create_profile_storage(uint8_t max_length);
+uint8_t* bsp_create_profile_storage(uint16_t max_length);
 
 /*!
-    @brief Create The Server Profile Table
+    @brief Create The Server Profile Table in the profile arena
     @param number_of_profiles The number of profiles
     @return The server profile table
 */
 profile_t* bsp_create_server_profile_table(uint8_t number_of_profiles);
 /*!
-    @brief Create a profile
+    @brief Create a profile and its characteristics as they are described in CHARACTERISTIC_DESCRIPTORS
     @param profile_id The profile ID
-    @param profile_event_handler The profile event handler
-    @param storage The storage for the profile
-    @param max_length The maximum length of the storage
-    @param notification_queue_buffer The notification queue buffer
-    @return The profile
+    @param storage The contiguous storage of the profile, sliced into the storage of each characteristic
+    @param notification_queue_policy The policy of the notification queue
+    @param notification_priority The priority class of the notifications of the profile
+    @param notification_ttl The default time to live in ms of the payloads, NOTIFICATION_TTL_NONE when they never expire
+    @return The profile, initialized in place in the profile arena
 */
-profile_t* bsp_create_profile(uint8_t profile_id,esp_gatts_cb_t profile_event_handler,uint8_t* storage,uint8_t max_length,uint8_t* notification_queue_buffer);
+profile_t* bsp_create_profile(uint8_t profile_id,uint8_t* storage,notification_queue_policy_t notification_queue_policy,notification_priority_t notification_priority,uint32_t notification_ttl);
 /*!
-    @brief Free the server profile table
+    @brief Free the server profile table, giving its storage back to the profile arena
     @param server_table The server table
     @param number_of_profiles The number of profiles
 */
@@ -428,6 +1354,18 @@ void bsp_stop_server();
     void music_metadata_notification_task(void *param); // Music Metadata Notification Task
     void start_music_notification_task(); // Start the music notification task
 
+    void test_notification_queue_contention(int profile_id,int producer_count,int pushes_per_producer); // Benchmark several producers pushing to one profile
+    void notification_queue_contention_task(void *param); // Producer task of the contention benchmark
+
+    void test_notification_zero_copy(int profile_id,int pushes); // Assert that payloads filled in place are only copied into the BLE stack
+
+    void test_profile_table_layout(int iterations); // Measure the size of the profile tables and the cost of the notify loop reading them
+
+    void test_gatt_response_stack_usage(); // Compare the stack used by a response built by value and one filled in place
+
+    void test_stored_value_consistency(int profile_id,int reader_count,int publishes); // Check that lock free readers never see a torn stored value while a writer publishes
+    void stored_value_reader_task(void *param); // Reader task of the stored value consistency test
+
 #endif
 
 // Disconnect Profile
@@ -25,6 +25,8 @@
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
 #include "esp_gatt_common_api.h"
+#include "esp_random.h"
+#include "esp_attr.h"
 
 #include "sdkconfig.h"
 
@@ -32,6 +34,17 @@
     HAL BLE API
 */
 
+// Largest attribute value that can be assembled from segments, the GATT limit on an attribute value
+#define HAL_BLE_MAX_PDU_LEN 512
+
+/*!
+    @brief Segment of a scatter-gather send, the segments are assembled in order into one value
+*/
+typedef struct{
+    const uint8_t* data; // Start of the segment
+    uint16_t length; // Length of the segment
+} hal_ble_segment_t;
+
 // Getters & Setters for BLE GATT Server
 
 /*!
@@ -237,6 +250,37 @@ esp_err_t hal_ble_send_notification(uint16_t gatt_if,uint16_t conn_id,uint16_t c
 */
 esp_err_t hal_ble_send_indication(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,uint16_t length,uint8_t *value);
 
+/*!
+    @brief Send Notification From Segments
+    @param gatt_if : The GATT Interface
+    @param conn_id : The Connection ID
+    @param char_handle : The Characteristic Handle
+    @param segments : The segments of the value, such as a header followed by the payload
+    @param num_segments : The number of segments
+    @param pdu : The buffer the segments are assembled into, NULL to use the staging buffer of the HAL
+    @param pdu_size : The size of the buffer, ignored when the staging buffer of the HAL is used
+    @return
+            - ESP_OK : Success - otherwise, error code
+
+    The segments are copied once into the buffer, which the stack copies into the PDU. A single segment is
+    passed to the stack as it is. The staging buffer of the HAL is shared so senders are serialized on it.
+*/
+esp_err_t hal_ble_send_notification_segments(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,const hal_ble_segment_t* segments,uint8_t num_segments,uint8_t* pdu,uint16_t pdu_size);
+
+/*!
+    @brief Send Indication From Segments
+    @param gatt_if : The GATT Interface
+    @param conn_id : The Connection ID
+    @param char_handle : The Characteristic Handle
+    @param segments : The segments of the value, such as a header followed by the payload
+    @param num_segments : The number of segments
+    @param pdu : The buffer the segments are assembled into, NULL to use the staging buffer of the HAL
+    @param pdu_size : The size of the buffer, ignored when the staging buffer of the HAL is used
+    @return
+            - ESP_OK : Success - otherwise, error code
+*/
+esp_err_t hal_ble_send_indication_segments(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,const hal_ble_segment_t* segments,uint8_t num_segments,uint8_t* pdu,uint16_t pdu_size);
+
 /*!
     @brief Update Connection Parammeters
     @param params : The connection parameters
@@ -267,6 +311,17 @@ esp_err_t hal_ble_send_gatt_response(uint16_t gatt_if,uint16_t conn_id,uint32_t
 */
 esp_err_t hal_ble_create_service(uint16_t gatt_if,esp_gatt_srvc_id_t* service_uuid,uint16_t num_handles);
 
+/*!
+    @brief Create Attribute Table
+    @param gatt_if : The GATT Interface
+    @param attribute_table : The attributes of the service, the UUIDs and values they point to must outlive the request
+    @param num_attributes : The number of attributes
+    @param service_instance : The instance ID of the service
+    @return
+            - ESP_OK : Success - otherwise, error code
+*/
+esp_err_t hal_ble_create_attribute_table(uint16_t gatt_if,const esp_gatts_attr_db_t* attribute_table,uint8_t num_attributes,uint8_t service_instance);
+
 /*!
     @brief Create Service ID
     @param service_id : The Service ID
@@ -297,15 +352,14 @@ esp_ble_conn_update_params_t hal_ble_create_conn_params(uint16_t min_interval,ui
 esp_bt_uuid_t hal_ble_create_uuid(uint16_t uuid,uint8_t len);
 
 /*!
-    @brief Create GATT Response
+    @brief Fill a GATT Response in place, only the used bytes of the value are copied
+    @param rsp : The response to fill, the rest of its value is left as it was
     @param handle : The handle
-    @param length : The length of the value
-    @param value : The value
-    @return
-            - The GATT Response
+    @param length : The length of the value, limited to ESP_GATT_MAX_ATTR_LEN
+    @param value : The value, may be NULL when length is 0 or point to the value of the response when it is already in place
 */
 
-esp_gatt_rsp_t hal_ble_create_gatt_response(uint16_t handle,uint16_t length,uint8_t *value);
+void hal_ble_fill_gatt_response(esp_gatt_rsp_t *rsp,uint16_t handle,uint16_t length,const uint8_t *value);
 
 /*!
     @brief Add Characteristic Descriptor
@@ -378,6 +432,10 @@ esp_err_t hal_sleep_set_pd_config(esp_sleep_pd_domain_t pd_domain,esp_sleep_pd_o
     return err;
 }
 
+uint32_t hal_get_random(){
+    return esp_random();
+}
+
 size_t hal_get_free_heap_size(){
     return xPortGetFreeHeapSize();
 }
@@ -1,64 +1,153 @@
 #include "bsp_ble.h"
 
 void bsp_free_server_profile_table(profile_t* server_table,uint8_t number_of_profiles){
+    // Nothing goes back to the heap, the storage of every profile is handed out again when the table is created
     for(int profile_no = 0; profile_no < number_of_profiles; profile_no++){
-        free(server_table[profile_no].local_storage);
-        free(server_table[profile_no].notification_queue_buffer);
+        // The stored values held in the notification pool are returned with the pool when it is initialized again
+        for(int characteristic = 0; characteristic < server_table[profile_no].num_characteristics; characteristic++){
+            server_table[profile_no].characteristics[characteristic].stored_value.blocks[0] = NOTIFICATION_POOL_NO_BLOCK;
+            server_table[profile_no].characteristics[characteristic].stored_value.blocks[1] = NOTIFICATION_POOL_NO_BLOCK;
+        }
     }
-    free(server_table);
+    bsp_profile_arena.storage_used = 0;
     ESP_LOGI("Server Profile Table","Server Profile Table Freed");
 } // Free the server profile table
 
 
-profile_t* bsp_create_profile(uint8_t profile_id,esp_gatts_cb_t profile_event_handler,uint8_t* storage,uint8_t max_length,uint8_t* notification_queue_buffer){
-    profile_t* profile = (profile_t*)malloc(sizeof(profile_t)); // Created the profile
+profile_t* bsp_create_profile(uint8_t profile_id,uint8_t* storage,notification_queue_policy_t notification_queue_policy,notification_priority_t notification_priority,uint32_t notification_ttl){
+    profile_t* profile = &bsp_profile_arena.profiles[profile_id]; // The profile is initialized in place in the arena
+    profile_config_t* profile_config = &bsp_gatt_server_profile_config_table[profile_id];
+
+    // Initialize the setup information of the profile
+    profile_config->application_id = profile_id;
+    profile_config->num_handles = 1; // The service declaration
+    profile_config->characteristics_added = 0;
 
     // Initialize the profile
     profile->profile_interface = ESP_GATT_IF_NONE;
-    profile->application_id = profile_id;
-    profile->profile_event_handler = profile_event_handler;
-    profile->attribute_value.attr_len = max_length;
-    profile->attribute_value.attr_max_len = max_length;
-    profile->attribute_value.attr_value = storage;
-    profile->local_storage = storage;
-    profile->local_storage_limit = max_length;
-    profile->local_storage_len = 0;
-    profile->notification_queue_buffer = notification_queue_buffer;
-    profile->notification_queue_len = 0;
-    profile->last_notification_time = 0;
-    profile->cccd_status = 0x0000;
+    profile->num_characteristics = 0;
+
+    // Every characteristic of the profile gets the next slice of the profile storage
+    for(int characteristic_id = 0; characteristic_id < NUM_CHARACTERISTICS; characteristic_id++){
+        const characteristic_descriptor_t* descriptor = &bsp_characteristic_descriptors[characteristic_id];
+        if(descriptor->profile_id != profile_id){
+            continue;
+        }
+        if(profile->num_characteristics == MAX_PROFILE_CHARACTERISTICS){
+            ESP_LOGE(log_tags[4+profile_id],"Profile Has More Than MAX_PROFILE_CHARACTERISTICS Characteristics");
+            break;
+        }
+        characteristic_t* characteristic = &profile->characteristics[profile->num_characteristics];
+        characteristic_config_t* characteristic_config = &profile_config->characteristics[profile->num_characteristics];
+
+        characteristic_config->attribute_value.attr_len = descriptor->length;
+        characteristic_config->attribute_value.attr_max_len = descriptor->length;
+        characteristic_config->attribute_value.attr_value = storage;
+        characteristic_config->characteristic_uuid = hal_ble_create_uuid(descriptor->uuid,ESP_UUID_LEN_16);
+        characteristic_config->attribute_permissions = hal_ble_create_permissions(true,true);
+        characteristic_config->characteristic_properties = hal_ble_create_characteristic_property(true,true,
+                (descriptor->flags & CHARACTERISTIC_FLAG_NOTIFY) != 0,(descriptor->flags & CHARACTERISTIC_FLAG_NOTIFY) != 0);
+        characteristic_config->flags = descriptor->flags;
+        profile_config->num_handles += CHARACTERISTIC_NUM_HANDLES(descriptor->flags);
+
+        // The slice of the profile storage is the first stored value, the other slot is filled by the first publish
+        atomic_init(&characteristic->stored_value.buffers[0],storage);
+        atomic_init(&characteristic->stored_value.buffers[1],NULL);
+        atomic_init(&characteristic->stored_value.lengths[0],0);
+        atomic_init(&characteristic->stored_value.lengths[1],0);
+        characteristic->stored_value.blocks[0] = NOTIFICATION_POOL_NO_BLOCK;
+        characteristic->stored_value.blocks[1] = NOTIFICATION_POOL_NO_BLOCK;
+        atomic_init(&characteristic->stored_value.sequence,0);
+        characteristic->handle = 0;
+        characteristic->cccd_status = 0x0000;
+        characteristic->local_storage_limit = descriptor->length;
+        atomic_init(&characteristic->delta_synced,false);
+
+        storage = (storage != NULL) ? storage + descriptor->length : NULL;
+        profile->num_characteristics++;
+    }
+    bsp_init_notification_queue(&profile->notification_queue,notification_queue_policy);
+    atomic_init(&profile->notification_ttl,notification_ttl);
+    profile->notification_buffer = NULL;
+    profile->notification_entry.block = NOTIFICATION_POOL_NO_BLOCK;
+    profile->notification_entry.length = 0;
+    profile->notification_entry.profile_id = profile_id;
+    profile->notification_entry.characteristic = 0;
+    profile->notification_entry.ticket = 0;
+    profile->notification_entry.complete_callback = NULL;
+    profile->notification_schedule.priority = notification_priority;
+    profile->notification_schedule.quantum = NOTIFICATION_QUANTUM;
+    profile->notification_schedule.deficit = 0;
+    profile->notification_token_bucket.token_interval = NOTIFICATION_INTERVAL*1000;
+    profile->notification_token_bucket.burst = NOTIFICATION_BURST;
+    profile->notification_token_bucket.credit = NOTIFICATION_BURST*NOTIFICATION_INTERVAL*1000; // Start with a full bucket
+    profile->notification_token_bucket.last_refill_time = 0;
+    profile->notification_retry.max_retries = MAX_NOTIFCATION_RETRIES;
+    profile->notification_retry.base_delay = NOTIFICATION_RETRY_BASE_DELAY;
+    profile->notification_retry.max_delay = NOTIFICATION_RETRY_MAX_DELAY;
+    profile->notification_retry.retry_count = 0;
+    atomic_init(&profile->notification_retry.retry_scheduled,false);
+    profile->notification_retry.failed_count = 0;
+    profile->notification_retry.retry_timer = NULL;
+    atomic_init(&profile->notification_indication.state,INDICATION_IDLE);
+    profile->notification_indication.connection_id = 0xFFFF;
+    profile->notification_indication.handle = 0;
+    profile->notification_indication.timeout = INDICATION_TIMEOUT;
+    profile->notification_indication.confirmed_count = 0;
+    profile->notification_indication.timeout_count = 0;
+    profile->notification_indication.timeout_timer = NULL;
+    profile->notification_delta.enabled = false;
+    profile->notification_delta.full_count = 0;
+    profile->notification_delta.delta_count = 0;
+    profile->notification_delta.saved_bytes = 0;
+    #ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+        memset(&profile->notification_latency,0,sizeof(notification_latency_t));
+    #endif
 
     return profile;
 } // Create a profile
 
 profile_t* bsp_create_server_profile_table(uint8_t number_of_profiles){
-    uint8_t* music_storage = bsp_create_profile_storage(MUSIC_PROFILE_CHAR_LEN);
-    uint8_t* notification_music_storage = bsp_create_profile_storage(MUSIC_PROFILE_CHAR_LEN);
-    uint8_t* todo_storage = bsp_create_profile_storage(TODO_PROFILE_CHAR_LEN);
-    uint8_t* notification_todo_storage = bsp_create_profile_storage(TODO_PROFILE_CHAR_LEN);
-    uint8_t* time_storage = bsp_create_profile_storage(TIME_PROFILE_CHAR_LEN);
-    uint8_t* notification_time_storage = bsp_create_profile_storage(TIME_PROFILE_CHAR_LEN);
-    uint8_t* music_playback_storage = bsp_create_profile_storage(MUSIC_PLAYBACK_CHAR_LEN);
-    uint8_t* notification_music_playback_storage = bsp_create_profile_storage(MUSIC_PLAYBACK_CHAR_LEN);
+    // The profiles and their storage are carved from the profile arena so the table is never allocated from the heap
+    // The notification queues of every profile share the blocks of the notification pool
+    memset(bsp_profile_arena.profiles,0,sizeof(bsp_profile_arena.profiles));
+    memset(bsp_gatt_server_profile_config_table,0,sizeof(bsp_gatt_server_profile_config_table));
+    bsp_profile_arena.storage_used = 0;
+    bsp_reset_attribute_routes(); // The handles are handed out again when the services are created
 
     // create a GATT Server Profile Table
-    profile_t* server_table = (profile_t*) malloc(number_of_profiles*sizeof(profile_t));
-
-    // Add the profiles to the server table
-    server_table[MUSIC_PROFILE_ID] = *bsp_create_profile(MUSIC_PROFILE_ID,bsp_gatt_server_music_profile_handler,music_storage,MUSIC_PROFILE_CHAR_LEN,notification_music_storage);
-    server_table[TODO_PROFILE_ID] = *bsp_create_profile(TODO_PROFILE_ID,bsp_gatt_server_todo_profile_handler,todo_storage,TODO_PROFILE_CHAR_LEN,notification_todo_storage);
-    server_table[TIME_PROFILE_ID] = *bsp_create_profile(TIME_PROFILE_ID,bsp_gatt_server_time_profile_handler,time_storage,TIME_PROFILE_CHAR_LEN,notification_time_storage);
-    server_table[MUSIC_PLAYBACK_PROFILE_ID] = *bsp_create_profile(MUSIC_PLAYBACK_PROFILE_ID,bsp_gatt_server_music_playback_profile_handler,music_playback_storage,MUSIC_PLAYBACK_CHAR_LEN,notification_music_playback_storage);
+    profile_t* server_table = bsp_profile_arena.profiles;
+
+    // Add the profiles to the server table as they are described in PROFILE_DESCRIPTORS
+    for(int profile_id = 0; profile_id < number_of_profiles; profile_id++){
+        const profile_descriptor_t* descriptor = &bsp_profile_descriptors[profile_id];
+        // The characteristics of a profile share one contiguous block of the arena so a profile is read from one place
+        uint16_t storage_length = 0;
+        for(int characteristic_id = 0; characteristic_id < NUM_CHARACTERISTICS; characteristic_id++){
+            if(bsp_characteristic_descriptors[characteristic_id].profile_id == profile_id){
+                storage_length += bsp_characteristic_descriptors[characteristic_id].length;
+            }
+        }
+        uint8_t* storage = bsp_create_profile_storage(storage_length);
+        bsp_create_profile(profile_id,storage,descriptor->notification_queue_policy,descriptor->notification_priority,descriptor->notification_ttl);
+    }
+    #ifdef NOTIFICATION_BATCHING
+        server_table[BATCH_PROFILE_ID].notification_buffer = bsp_create_profile_storage(BATCH_RECORDS_CHARACTERISTIC_LEN); // The batch is packed here, it is too large for a pool block
+    #endif
 
     return server_table;
 
 }  // Create the server profile table
 
-uint8_t* bsp_create_profile_storage(uint8_t max_length){
+uint8_t* bsp_create_profile_storage(uint16_t max_length){
     // Create the storage for the profile
-    uint8_t* storage = (uint8_t*)malloc(max_length*sizeof(uint8_t));
+    uint8_t* storage = NULL;
+    if(bsp_profile_arena.storage_used + max_length <= PROFILE_STORAGE_ARENA_SIZE){
+        storage = &bsp_profile_arena.storage[bsp_profile_arena.storage_used];
+        bsp_profile_arena.storage_used += max_length;
+    }
     if(storage == NULL){
-        ESP_LOGE("Profile Storage","Error Creating Profile Storage");
+        ESP_LOGE("Profile Storage","Error Creating Profile Storage, PROFILE_STORAGE_ARENA_SIZE Is Too Small");
     }else{
         ESP_LOGI("Profile Storage","Profile Storage Created");
         // Initializing the storage
@@ -71,12 +160,35 @@ uint8_t* bsp_create_profile_storage(uint8_t max_length){
 
 void bsp_initialize_server(char* device_name){
 
-    // Initialize the server table
+    #ifdef TESTING
+        uint32_t free_heap_before = hal_get_free_heap_size();
+        // The heap the stack has taken once every service has started is measured from here
+        bsp_server_init_free_heap = free_heap_before;
+        bsp_server_init_time = hal_ble_get_time(false);
+        bsp_services_started = 0;
+        bsp_advertising_start_reported = false;
+    #endif
+
+    // Initialize the notification pool and the server table
+    bsp_init_notification_pool();
     bsp_gatt_server_application_profile_table = bsp_create_server_profile_table(NUM_PROFILES);
 
     // Initialize the semaphores
     bsp_init_semaphores(NUM_PROFILES);
 
+    // Start the notification scheduler, it stays blocked until data is pushed for a profile
+    bsp_start_notification_scheduler();
+
+    #ifdef DEFERRED_GATT_EVENTS
+        // Start the worker that handles the GATT events the Bluetooth callback queues
+        bsp_start_gatt_event_worker();
+    #endif
+
+    #ifdef TESTING
+        // The profiles, their storage, semaphores, timers and the scheduler are all static so this stays at 0 bytes
+        ESP_LOGW(GATT_INIT,"TESTING Profile Setup Heap Usage: %lu bytes",(unsigned long)(free_heap_before - hal_get_free_heap_size()));
+    #endif
+
     // Start the power management task
     bsp_start_power_management_task();
 
@@ -155,7 +267,7 @@ void bsp_initialize_server(char* device_name){
         Register GATT & GAP Callback
     */
 
-    err = hal_ble_register_gatt_server_callback(bsp_server_gatt_profile_handler);
+    err = hal_ble_register_gatt_server_callback(bsp_server_gatt_callback);
     if(err != ESP_OK){
         ESP_LOGE(GATT_INIT,"Error Registering GATT Callback: %s",hal_err_to_string(err));
         return;
@@ -173,33 +285,14 @@ void bsp_initialize_server(char* device_name){
         Register the GATT Server Application Profiles
     */
 
-    err = hal_ble_register_gatt_server_app_profile(MUSIC_PROFILE_ID); // Triggers the registration event
-    if(err != ESP_OK){
-        ESP_LOGE(GATT_INIT,"Error Registering Music Profile: %s",hal_err_to_string(err));
-        return;
-    }
-    ESP_LOGI(GATT_INIT,"Music Profile Registered");
-
-    err = hal_ble_register_gatt_server_app_profile(TODO_PROFILE_ID);
-    if(err != ESP_OK){
-        ESP_LOGE(GATT_INIT,"Error Registering Todo Profile: %s",hal_err_to_string(err));
-        return;
-    }
-    ESP_LOGI(GATT_INIT,"Todo Profile Registered");
-
-    err = hal_ble_register_gatt_server_app_profile(TIME_PROFILE_ID); 
-    if(err != ESP_OK){
-        ESP_LOGE(GATT_INIT,"Error Registering Time Profile: %s",hal_err_to_string(err));
-        return;
-    }
-    ESP_LOGI(GATT_INIT,"Time Profile Registered");
-
-    err = hal_ble_register_gatt_server_app_profile(MUSIC_PLAYBACK_PROFILE_ID);
-    if(err != ESP_OK){
-        ESP_LOGE(GATT_INIT,"Error Registering Music Playback Profile: %s",hal_err_to_string(err));
-        return;
+    for(int app_id = 0; app_id < NUM_GATT_APPLICATIONS; app_id++){
+        err = hal_ble_register_gatt_server_app_profile(app_id); // Triggers the registration event
+        if(err != ESP_OK){
+            ESP_LOGE(GATT_INIT,"Error Registering GATT Application %d: %s",app_id,hal_err_to_string(err));
+            return;
+        }
+        ESP_LOGI(GATT_INIT,"GATT Application %d Registered",app_id);
     }
-    ESP_LOGI(GATT_INIT,"Music Playback Profile Registered");
 
     /*
         Set the GAP Server Advertisement Data
@@ -336,1029 +429,2679 @@ void bsp_power_management_task(void *param){
 
 }// Power Management Task
 
+static bool bsp_is_valid_profile(int profile_id){
+    // The public functions index the profile tables with the ID, so an ID from the application is checked first
+    if(profile_id < 0 || profile_id >= NUM_PROFILES){
+        ESP_LOGE(GATT_CALLBACK,"Invalid Profile ID: %d",profile_id);
+        return false;
+    }
+    return true;
+} // Check a profile ID passed to a public function
+
 void bsp_push_data_to_notification_queue(int profile_id,uint8_t * data,uint16_t length){
-    // Push the data to the notification queue
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    bsp_push_data_to_notification_queue_with_ttl(profile_id,data,length,atomic_load_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,memory_order_relaxed));
+}
+
+static bool bsp_push_characteristic_data_with_ttl(int profile_id,uint8_t characteristic,const uint8_t * data,uint16_t length,uint32_t ttl_ms);
+
+void bsp_push_data_to_notification_queue_with_ttl(int profile_id,uint8_t * data,uint16_t length,uint32_t ttl_ms){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    // Push the data to the notification queue of the first characteristic of the profile
+    bsp_push_characteristic_data_with_ttl(profile_id,0,data,length,ttl_ms);
+}
 
-    // Need to take the semaphore
+bool bsp_push_characteristic_data(int profile_id,uint8_t characteristic,uint8_t * data,uint16_t length){
+    if(!bsp_is_valid_profile(profile_id)){
+        return false;
+    }
+    return bsp_push_characteristic_data_with_ttl(profile_id,characteristic,data,length,atomic_load_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,memory_order_relaxed));
+}
+
+uint8_t bsp_push_characteristic_updates(int profile_id,const characteristic_update_t* updates,uint8_t num_updates){
+    if(!bsp_is_valid_profile(profile_id)){
+        return 0;
+    }
+    // The notification scheduler and the client writes take the same semaphore, so neither of them sees only part of the values
+    uint8_t pushed = 0;
     if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
-        ESP_LOGI(log_tags[4+profile_id],"Semaphore Taken for Profile: %d",profile_id);
-        if(bsp_has_data_changed(data,bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit)){
-            // Data has changed
-            memset(bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit);
-            memcpy(bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,data,length);
-            bsp_gatt_server_application_profile_table[profile_id].notification_queue_len = length;
-        }   
-
-        // The semaphore needs to be released
+        uint32_t ttl_ms = atomic_load_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,memory_order_relaxed);
+        for(uint8_t update = 0; update < num_updates; update++){
+            if(bsp_push_characteristic_data_with_ttl(profile_id,updates[update].characteristic,updates[update].data,updates[update].length,ttl_ms)){
+                pushed++;
+            }
+        }
         xSemaphoreGive(bsp_profile_semaphores[profile_id]);
-        ESP_LOGI(log_tags[4+profile_id],"Semaphore Released for Profile: %d",profile_id);
     }else{
         ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
     }
-}
-
-void bsp_init_semaphores(uint8_t num_profiles){
-    // Initialize the semaphores
-    for(int profile_no = 0; profile_no < num_profiles; profile_no++){
-       bsp_profile_semaphores[profile_no] = xSemaphoreCreateMutex();
-       ESP_LOGI(log_tags[4+profile_no],"Semaphore Created for Profile: %d",profile_no);
-    }
-} // Initialize the semaphores for the profiles
 
-void bsp_notify_task(void *param){
+    return pushed;
+} // Push the values of several characteristics of a profile at once
 
-    int profile_id = (int)param;
-    
-    while(1){
-        // Check if the data is changed
-        // Send a notification if the data has changed
+static uint8_t bsp_notification_pool_block_of(const uint8_t* buffer);
+static bool bsp_queue_notification_block(int profile_id,uint8_t characteristic,uint8_t block,uint16_t length,uint32_t ttl_ms,uint32_t ticket,notification_complete_cb_t complete_callback);
 
-        // I need to check if the profiles semaphore is available
-        if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
-            // The semaphore is available
-            ESP_LOGI(log_tags[4+profile_id],"Semaphore Taken for Profile: %d",profile_id);
-            if(bsp_has_data_changed(bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,bsp_gatt_server_application_profile_table[profile_id].local_storage,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit) && bsp_is_notification_enabled(bsp_gatt_server_application_profile_table[profile_id].cccd_status)){
-                // Data has changed and notifications are enabled
-                bsp_update_characteristic_data(profile_id);
-            }
+static bool bsp_push_characteristic_data_with_ttl(int profile_id,uint8_t characteristic,const uint8_t * data,uint16_t length,uint32_t ttl_ms){
+    // Push the data to the notification queue
+    // The queue is lock-free so producers never wait on the notification scheduler or the GATT callbacks
+    if(characteristic >= bsp_gatt_server_application_profile_table[profile_id].num_characteristics){
+        ESP_LOGE(log_tags[4+profile_id],"Invalid Characteristic: %d",characteristic);
+        return false;
+    }
+    if(length == 0 || length > bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].local_storage_limit){
+        ESP_LOGE(log_tags[4+profile_id],"Invalid Notification Data Length: %d Limit: %d",length,bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].local_storage_limit);
+        return false;
+    }
 
-            // Release the semaphore
-            xSemaphoreGive(bsp_profile_semaphores[profile_id]);
-            ESP_LOGI(log_tags[4+profile_id],"Semaphore Released for Profile: %d",profile_id);
-        }else{
-            ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
-        }       
-            // Delay the task
-        vTaskDelay(pdMS_TO_TICKS(100)); // Checking every 100ms to see if the data has changed
+    // Producers that can fill the buffer in place use bsp_acquire_notification_buffer() to skip this copy
+    uint8_t* buffer = bsp_acquire_notification_buffer(profile_id);
+    if(buffer == NULL){
+        return false;
     }
+    memcpy(buffer,data,length);
+    #ifdef TESTING
+        atomic_fetch_add(&bsp_notification_copy_counts.producer_copies,1);
+    #endif
 
-} // Notify the client of the data change
+    return bsp_queue_notification_block(profile_id,characteristic,bsp_notification_pool_block_of(buffer),length,ttl_ms,0,NULL);
+} // Copy data into a pool block and queue it for a characteristic
 
-void bsp_start_notification_task(int profile_id){
-    // Start the task to send notifications
-    int task_parameter = (int) malloc(sizeof(int));
-    task_parameter = profile_id;
-    xTaskCreatePinnedToCore(
-        bsp_notify_task,
-        "Notify Task",
-        1024,
-        (void*)task_parameter,
-        5,
-        NULL,
-        1
-    );
-    ESP_LOGI(log_tags[4+profile_id],"Notification Task Started");
-}
+static void bsp_report_notification_result(const notification_entry_t* entry,notification_result_t result){
+    if(entry->complete_callback != NULL){
+        entry->complete_callback(entry->profile_id,entry->ticket,result);
+    }
+} // Report the outcome of a payload to its publisher
+
+static bool bsp_queue_notification_block(int profile_id,uint8_t characteristic,uint8_t block,uint16_t length,uint32_t ttl_ms,uint32_t ticket,notification_complete_cb_t complete_callback){
+    // Only the block index is queued, the payload stays where the producer wrote it
+    notification_entry_t entry = {
+        .block = block,
+        .length = length,
+        .profile_id = profile_id,
+        .characteristic = characteristic,
+        .ticket = ticket,
+        .complete_callback = complete_callback,
+        .deadline = (ttl_ms == NOTIFICATION_TTL_NONE) ? 0 : hal_ble_get_time(false) + (uint64_t)ttl_ms*1000,
+    };
+    bool data_pushed = bsp_notification_queue_push(&bsp_gatt_server_application_profile_table[profile_id].notification_queue,&entry);
+
+    #ifndef NOTIFICATION_POLLING_MODE
+        // Wake the notification scheduler directly so that it only runs when there is data to be sent
+        if(data_pushed){
+            bsp_wake_notification_scheduler();
+        }
+    #endif
 
-bool bsp_has_data_changed(const uint8_t* new_data,const uint8_t* old_data,uint16_t length){
-    return memcmp(new_data,old_data,length) != 0;
-} // Check if the data has changed
+    return data_pushed;
+} // Queue a filled pool block for the notification scheduler
 
-void bsp_disable_notifications(uint16_t* cccd_status){
-    *cccd_status = 0x0000;
-} // Disable the notifications
+uint32_t bsp_publish_notification(int profile_id,uint8_t * data,uint16_t length,notification_complete_cb_t complete_callback){
+    if(!bsp_is_valid_profile(profile_id)){
+        return 0;
+    }
+    static atomic_uint ticket_counter = 0;
 
-void bsp_enable_notifications(uint16_t* cccd_status){
-    *cccd_status = 0x0001;
-} // Enable the notifications
+    if(length == 0 || length > bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit){
+        ESP_LOGE(log_tags[4+profile_id],"Invalid Notification Data Length: %d Limit: %d",length,bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit);
+        return 0;
+    }
 
-bool bsp_is_notification_enabled(uint16_t cccd_status){
-    return (cccd_status & 0x0001);
-}// Check if the notifications are enabled
+    // Every ticket is non zero so that 0 can mean the publish was refused
+    uint32_t ticket = atomic_fetch_add_explicit(&ticket_counter,1,memory_order_relaxed) + 1;
+    if(ticket == 0){
+        ticket = atomic_fetch_add_explicit(&ticket_counter,1,memory_order_relaxed) + 1;
+    }
+    notification_entry_t entry = {.profile_id = profile_id,.ticket = ticket,.complete_callback = complete_callback};
 
-void bsp_update_characteristic_data(int profile_id){
-    // Characteristic data needs to be updated and the notifications need to be sent
-    
-    // Updating the local storage for the characteristic from the notification queue buffer
-    memset(bsp_gatt_server_application_profile_table[profile_id].local_storage,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit);
-    memcpy(bsp_gatt_server_application_profile_table[profile_id].local_storage,bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,bsp_gatt_server_application_profile_table[profile_id].notification_queue_len);
+    bool notifications_enabled = bsp_is_notification_enabled(bsp_gatt_server_application_profile_table[profile_id].characteristics[0].cccd_status);
+    #ifdef NOTIFICATION_BATCHING
+        notifications_enabled = notifications_enabled || bsp_is_notification_batching_active(profile_id,0);
+    #endif
+    if(!notifications_enabled){
+        // Nothing would send the data until the client subscribes, so the publisher is told right away
+        bsp_report_notification_result(&entry,NOTIFICATION_RESULT_NOT_SUBSCRIBED);
+        return ticket;
+    }
 
-    bsp_gatt_server_application_profile_table[profile_id].local_storage_len = bsp_gatt_server_application_profile_table[profile_id].notification_queue_len;
+    uint8_t* buffer = bsp_acquire_notification_buffer(profile_id);
+    if(buffer == NULL){
+        bsp_report_notification_result(&entry,NOTIFICATION_RESULT_DROPPED);
+        return ticket;
+    }
+    memcpy(buffer,data,length);
+    #ifdef TESTING
+        atomic_fetch_add(&bsp_notification_copy_counts.producer_copies,1);
+    #endif
 
-    // Need to change the characteristic value
-    esp_err_t err = hal_ble_set_attr_value( bsp_gatt_server_application_profile_table[profile_id].characteristic_handle,
-                                            bsp_gatt_server_application_profile_table[profile_id].local_storage_len,
-                                            bsp_gatt_server_application_profile_table[profile_id].local_storage);
-    if(err != ESP_OK){
-        ESP_LOGE(log_tags[4+profile_id],"Error Setting Attribute Value");
-    }else{
-        ESP_LOGI(log_tags[4+profile_id],"Attribute Value Set");
+    // A rejected payload is reported by the queue
+    bsp_queue_notification_block(profile_id,0,bsp_notification_pool_block_of(buffer),length,atomic_load_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,memory_order_relaxed),ticket,complete_callback);
+    return ticket;
+} // Publish data without waiting for it to be sent
+
+uint8_t* bsp_acquire_notification_buffer(int profile_id){
+    if(!bsp_is_valid_profile(profile_id)){
+        return NULL;
     }
 
-    // Send the notification to the client
-    bsp_send_notification_data(profile_id);
-}
+    uint8_t block = bsp_notification_pool_acquire();
+    if(block == NOTIFICATION_POOL_NO_BLOCK){
+        ESP_LOGE(log_tags[4+profile_id],"Notification Pool Exhausted");
+        return NULL;
+    }
 
-void bsp_handle_add_characteristic_descriptor_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    return bsp_notification_pool.blocks[block];
+} // Take a buffer from the notification pool
 
-    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event status: %d",param->add_char_descr.status);
-    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event Attribute Handle: %d",param->add_char_descr.attr_handle);
-    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event Service Handle: %d",param->add_char_descr.service_handle);
+static uint8_t bsp_notification_pool_block_of(const uint8_t* buffer){
+    // Find the block a buffer belongs to, NOTIFICATION_POOL_NO_BLOCK if it is not the start of a pool block
+    if(buffer < bsp_notification_pool.blocks[0] || buffer > bsp_notification_pool.blocks[NOTIFICATION_POOL_BLOCKS - 1]){
+        return NOTIFICATION_POOL_NO_BLOCK;
+    }
 
-    // Get the CCCD Value
-    uint16_t cccd_value = 0;
-    uint16_t cccd_len = sizeof(cccd_value);
-    esp_err_t err = esp_ble_gatts_get_attr_value(param->add_char_descr.attr_handle, &cccd_len, (const uint8_t **)&cccd_value);
+    uint32_t offset = buffer - bsp_notification_pool.blocks[0];
+    if(offset % NOTIFICATION_POOL_BLOCK_SIZE != 0){
+        return NOTIFICATION_POOL_NO_BLOCK;
+    }
 
-    bsp_gatt_server_application_profile_table[profile_id].characteristic_descriptor_handle = param->add_char_descr.attr_handle;
-    bsp_gatt_server_application_profile_table[profile_id].cccd_status = cccd_value;
+    return offset / NOTIFICATION_POOL_BLOCK_SIZE;
+}
 
-    if(err != ESP_OK){
-        ESP_LOGE(log_tags[4+profile_id],"Error Getting CCCD Value");
-    }else{
-        ESP_LOGI(log_tags[4+profile_id],"CCCD Value: %d",cccd_value);
+bool bsp_push_notification_buffer(int profile_id,uint8_t* buffer,uint16_t length){
+    if(!bsp_is_valid_profile(profile_id)){
+        bsp_release_notification_buffer(buffer); // A rejected buffer is always returned to the pool
+        return false;
     }
+    return bsp_push_notification_buffer_with_ttl(profile_id,buffer,length,atomic_load_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,memory_order_relaxed));
 }
 
-void bsp_handle_add_characteristic_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id,bool requires_notifications){
-    
-    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event status: %d",param->add_char.status);
-    uint16_t attribute_length = 0;
-    const uint8_t *attribute_value = NULL;
+bool bsp_push_notification_buffer_with_ttl(int profile_id,uint8_t* buffer,uint16_t length,uint32_t ttl_ms){
+    if(!bsp_is_valid_profile(profile_id)){
+        bsp_release_notification_buffer(buffer); // A rejected buffer is always returned to the pool
+        return false;
+    }
+    uint8_t block = bsp_notification_pool_block_of(buffer);
+    if(block == NOTIFICATION_POOL_NO_BLOCK){
+        ESP_LOGE(log_tags[4+profile_id],"Notification Buffer Is Not From The Pool");
+        return false;
+    }
+    if(length == 0 || length > bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit){
+        ESP_LOGE(log_tags[4+profile_id],"Invalid Notification Data Length: %d Limit: %d",length,bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit);
+        bsp_notification_pool_release(block);
+        return false;
+    }
 
-    #ifdef DEBUG
-        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event status: %d",param->add_char.status);
-        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event Attribute Handle: %d",param->add_char.attr_handle);
-        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event Service Handle: %d",param->add_char.service_handle);
-    #endif
+    return bsp_queue_notification_block(profile_id,0,block,length,ttl_ms,0,NULL);
+} // Hand a filled pool buffer to the notification queue
 
-    bsp_gatt_server_application_profile_table[profile_id].characteristic_handle = param->add_char.attr_handle;
+void bsp_release_notification_buffer(uint8_t* buffer){
+    bsp_notification_pool_release(bsp_notification_pool_block_of(buffer));
+} // Give an unused buffer back to the notification pool
 
-    #ifdef DEBUG
+void bsp_init_notification_pool(){
+    memset(bsp_notification_pool.blocks,0,sizeof(bsp_notification_pool.blocks));
+    atomic_init(&bsp_notification_pool.free_blocks,(NOTIFICATION_POOL_BLOCKS == 32) ? 0xFFFFFFFFu : ((1u << NOTIFICATION_POOL_BLOCKS) - 1));
+    atomic_init(&bsp_notification_pool.exhausted_count,0);
+} // Initialize the notification pool
 
-        // Getting the attribute value to see if it was set correctly
-        esp_err_t err = hal_ble_get_attr_value(param->add_char.attr_handle,&attribute_length,&attribute_value);
-        if(err != ESP_OK){
-            ESP_LOGE(log_tags[4+profile_id],"Error Getting Attribute Value");
-        }
+uint8_t bsp_notification_pool_acquire(){
+    unsigned int free_blocks = atomic_load_explicit(&bsp_notification_pool.free_blocks,memory_order_relaxed);
 
-        ESP_LOGI(log_tags[4+profile_id],"Attribute Length: %d",attribute_length);
-        ESP_LOGI(log_tags[4+profile_id],"Attribute Value: %s",attribute_value);
-        ESP_LOGI(log_tags[4+profile_id],"Attribute Handle: %d",param->add_char.attr_handle);
-    #endif
+    // Claim the lowest free block, the mask cannot suffer from ABA since a bit is only ever set by the owner of the block
+    while(free_blocks != 0){
+        unsigned int block = __builtin_ctz(free_blocks);
+        if(atomic_compare_exchange_weak_explicit(&bsp_notification_pool.free_blocks,&free_blocks,free_blocks & ~(1u << block),memory_order_acquire,memory_order_relaxed)){
+            return block;
+        }
+    }
 
-    if(requires_notifications){
-        // Adding a characteristic descriptor UUID
-        esp_bt_uuid_t cccd_uuid = hal_ble_create_uuid(ESP_GATT_UUID_CHAR_CLIENT_CONFIG,ESP_UUID_LEN_16);
+    atomic_fetch_add_explicit(&bsp_notification_pool.exhausted_count,1,memory_order_relaxed);
+    return NOTIFICATION_POOL_NO_BLOCK;
+} // Take a free block from the notification pool
 
-        esp_gatt_perm_t perm = hal_ble_create_permissions(true,true);
+void bsp_notification_pool_release(uint8_t block){
+    if(block >= NOTIFICATION_POOL_BLOCKS){
+        return;
+    }
 
-        err = hal_ble_add_char_descriptor(param->add_char.service_handle,&cccd_uuid,perm,false);
+    atomic_fetch_or_explicit(&bsp_notification_pool.free_blocks,1u << block,memory_order_release);
+} // Give a block back to the notification pool
+
+void bsp_init_notification_queue(notification_queue_t* queue,notification_queue_policy_t policy){
+    memset(queue,0,sizeof(notification_queue_t));
+    atomic_init(&queue->policy,policy);
+    atomic_init(&queue->enqueue_position,0);
+    atomic_init(&queue->dequeue_position,0);
+    // Slot i is free for the producer whose enqueue position is i
+    for(int slot = 0; slot < NOTIFICATION_QUEUE_SLOTS; slot++){
+        atomic_init(&queue->slot_sequences[slot],slot);
+    }
+} // Initialize a notification queue
 
-        bsp_gatt_server_application_profile_table[profile_id].characteristic_descriptor_uuid = cccd_uuid;
-        bsp_gatt_server_application_profile_table[profile_id].characteristic_handle = param->add_char.attr_handle;
+static bool bsp_notification_queue_enqueue(notification_queue_t* queue,const notification_entry_t* entry){
+    unsigned int position = atomic_load_explicit(&queue->enqueue_position,memory_order_relaxed);
+    unsigned int slot;
 
-        if(err != ESP_OK){
-            ESP_LOGE(log_tags[4+profile_id],"Error Adding Characteristic Descriptor");
+    while(1){
+        slot = position & NOTIFICATION_QUEUE_MASK;
+        unsigned int sequence = atomic_load_explicit(&queue->slot_sequences[slot],memory_order_acquire);
+        int difference = (int)(sequence - position);
+        if(difference == 0){
+            // The slot is free, claim it by moving the enqueue position forward
+            if(atomic_compare_exchange_weak_explicit(&queue->enqueue_position,&position,position + 1,memory_order_relaxed,memory_order_relaxed)){
+                break;
+            }
+        }else if(difference < 0){
+            // The slot still holds a payload from the previous lap so the queue is full
+            return false;
+        }else{
+            // Another producer claimed the slot first
+            position = atomic_load_explicit(&queue->enqueue_position,memory_order_relaxed);
         }
-    }else{
-        ESP_LOGI(log_tags[4+profile_id],"Notifications Not Required");
     }
-}
 
-void bsp_handle_create_service_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id,bool requires_notifications){
-    esp_gatt_status_t create_status = param->create.status;
-    if(create_status == ESP_OK){
-        // The service has been created in the event ESP_GATTS_REG_EVT, now the service handle must be created and service must be started
-        // Create the service handle
-        bsp_gatt_server_application_profile_table[profile_id].service_handle = param->create.service_handle;
-        bsp_gatt_server_application_profile_table[profile_id].service_id = param->create.service_id.id.uuid.uuid.uuid16;
-        ESP_LOGI(log_tags[4+profile_id],"Profile Service Handle: %d",param->create.service_handle);
+    queue->slot_entries[slot] = *entry;
+    queue->slot_entries[slot].push_time = hal_ble_get_time(false);
 
-        // Since the service is being created, the characteristics for the service must be created
-        // Create the characteristic for the service
-        esp_bt_uuid_t characteristic_uuid = hal_ble_create_uuid(characteristic_uuids[profile_id],ESP_UUID_LEN_16);
+    // Publish the payload to the consumer
+    atomic_store_explicit(&queue->slot_sequences[slot],position + 1,memory_order_release);
+    return true;
+}
 
-        bsp_gatt_server_application_profile_table[profile_id].characteristic_uuid = characteristic_uuid;
+static bool bsp_notification_queue_dequeue_matching(notification_queue_t* queue,notification_entry_t* entry,int characteristic){
+    // Takes the oldest payload, only if it belongs to the characteristic unless characteristic is -1
+    unsigned int position = atomic_load_explicit(&queue->dequeue_position,memory_order_relaxed);
+    unsigned int slot;
 
-        ESP_LOGI(log_tags[4+profile_id],"Attempting To Start Service: 0x%X",param->create.service_id.id.uuid.uuid.uuid16);
-        esp_err_t err = hal_ble_start_service(param->create.service_handle);
-        if(err != ESP_OK){
-            ESP_LOGE(log_tags[4+profile_id],"Error In Starting Service for service id: 0x%X with handle: %d",param->create.service_id.id.uuid.uuid.uuid16,param->create.service_handle);
+    while(1){
+        slot = position & NOTIFICATION_QUEUE_MASK;
+        unsigned int sequence = atomic_load_explicit(&queue->slot_sequences[slot],memory_order_acquire);
+        int difference = (int)(sequence - (position + 1));
+        if(difference == 0){
+            // A payload of another characteristic is left in the queue, the check is repeated if the slot is claimed by someone else first
+            if(characteristic >= 0 && queue->slot_entries[slot].characteristic != characteristic){
+                return false;
+            }
+            // The slot holds a published payload, claim it by moving the dequeue position forward
+            if(atomic_compare_exchange_weak_explicit(&queue->dequeue_position,&position,position + 1,memory_order_relaxed,memory_order_relaxed)){
+                break;
+            }
+        }else if(difference < 0){
+            // The slot has not been published yet so the queue is empty
+            return false;
+        }else{
+            // A producer dropping the oldest payload claimed the slot first
+            position = atomic_load_explicit(&queue->dequeue_position,memory_order_relaxed);
         }
+    }
 
-        esp_gatt_perm_t perm;
-        esp_gatt_char_prop_t prop;
+    *entry = queue->slot_entries[slot];
 
-        if(requires_notifications){
-            perm = hal_ble_create_permissions(true,true);
-            prop = hal_ble_create_characteristic_property(true,true,true,false);
+    // Hand the slot back to the producer of the next lap
+    atomic_store_explicit(&queue->slot_sequences[slot],position + NOTIFICATION_QUEUE_SLOTS,memory_order_release);
+    return true;
+}
 
-        }else{
-            perm = hal_ble_create_permissions(true,true);
-            prop = hal_ble_create_characteristic_property(true,true,false,false);
-        }
+static bool bsp_notification_queue_dequeue(notification_queue_t* queue,notification_entry_t* entry){
+    return bsp_notification_queue_dequeue_matching(queue,entry,-1);
+}
 
-        // Adding the characteristic to the service
-        err = hal_ble_add_characteristic(param->create.service_handle,&characteristic_uuid,perm,prop,&bsp_gatt_server_application_profile_table[profile_id].attribute_value);
-        if (err != ESP_OK){
-            ESP_LOGE(log_tags[4+profile_id],"Error Adding Characteristic for Music Profile");
-        }else{
-            ESP_LOGI(log_tags[4+profile_id],"Added Characteristic for Music Profile");
+bool bsp_notification_queue_push(notification_queue_t* queue,const notification_entry_t* entry){
+    notification_entry_t dropped_entry;
+
+    while(!bsp_notification_queue_enqueue(queue,entry)){
+        if(atomic_load_explicit(&queue->policy,memory_order_relaxed) == NOTIFICATION_QUEUE_FIFO_ALL){
+            // The queue is full so the new payload is rejected
+            atomic_fetch_add_explicit(&queue->rejected_count,1,memory_order_relaxed);
+            bsp_notification_pool_release(entry->block);
+            bsp_report_notification_result(entry,NOTIFICATION_RESULT_DROPPED);
+            return false;
         }
+        // The oldest payload is dropped to make room for the new one
+        if(bsp_notification_queue_dequeue(queue,&dropped_entry)){
+            atomic_fetch_add_explicit(&queue->dropped_count,1,memory_order_relaxed);
+            bsp_notification_pool_release(dropped_entry.block);
+            bsp_report_notification_result(&dropped_entry,NOTIFICATION_RESULT_DROPPED);
+        }
+    }
 
-        ESP_LOGI(log_tags[4+profile_id],"Sucessfully Started Service for service id: 0x%X with handle: %d",param->create.service_id.id.uuid.uuid.uuid16,param->create.service_handle);
-        }else{
-            ESP_LOGE(log_tags[4+profile_id],"Failed To Start Service For ID: 0x%X",param->create.service_id.id.uuid.uuid.uuid16);
+    return true;
+} // Push a payload to a notification queue
+
+bool bsp_notification_queue_pop(notification_queue_t* queue,notification_entry_t* entry){
+    if(!bsp_notification_queue_dequeue(queue,entry)){
+        return false;
+    }
+
+    if(atomic_load_explicit(&queue->policy,memory_order_relaxed) == NOTIFICATION_QUEUE_KEEP_LATEST){
+        // Coalesce the pending payloads of the same characteristic into the newest one, the next characteristic is popped on its own
+        notification_entry_t newer_entry;
+        while(bsp_notification_queue_dequeue_matching(queue,&newer_entry,entry->characteristic)){
+            atomic_fetch_add_explicit(&queue->coalesced_count,1,memory_order_relaxed);
+            bsp_notification_pool_release(entry->block);
+            bsp_report_notification_result(entry,NOTIFICATION_RESULT_DROPPED);
+            *entry = newer_entry;
         }
-}
+    }
 
-void bsp_handle_read_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
-    // This event is when the client wants to execute a read operation
-    ESP_LOGI(log_tags[4+profile_id],"GATT Server Read Event handle: %d",param->read.handle);
-    // Create response to send to the client
-    esp_gatt_rsp_t resp = hal_ble_create_gatt_response(param->read.handle,bsp_gatt_server_application_profile_table[profile_id].local_storage_len,bsp_gatt_server_application_profile_table[profile_id].local_storage);
+    return true;
+} // Take a payload out of a notification queue
+
+static void bsp_release_notification_entry(int profile_id,notification_result_t result){
+    // The payload in flight is finished without being sent, its block goes back to the pool
+    bsp_report_notification_result(&bsp_gatt_server_application_profile_table[profile_id].notification_entry,result);
+    bsp_notification_pool_release(bsp_gatt_server_application_profile_table[profile_id].notification_entry.block);
+    bsp_gatt_server_application_profile_table[profile_id].notification_entry.block = NOTIFICATION_POOL_NO_BLOCK;
+    bsp_gatt_server_application_profile_table[profile_id].notification_entry.length = 0;
+} // Drop the payload in flight of a profile
+
+static bool bsp_drop_expired_notification(int profile_id){
+    // Returns true if the payload in flight was past its deadline and has been dropped
+    notification_entry_t* entry = &bsp_gatt_server_application_profile_table[profile_id].notification_entry;
+    if(entry->length == 0 || entry->deadline == 0 || hal_ble_get_time(false) < entry->deadline){
+        return false;
+    }
 
-    esp_err_t err = hal_ble_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_OK,&resp);
-    if(err != ESP_OK){
-        ESP_LOGE(log_tags[4+profile_id],"Error Sending Response");
+    // A stale payload waiting for its retry is not retried
+    notification_retry_t* retry = &bsp_gatt_server_application_profile_table[profile_id].notification_retry;
+    if(atomic_exchange(&retry->retry_scheduled,false) && retry->retry_timer != NULL){
+        xTimerStop(retry->retry_timer,0);
+    }
+    retry->retry_count = 0;
+
+    ESP_LOGW(log_tags[4+profile_id],"Notification Expired %llu us After Its Deadline",hal_ble_get_time(false) - entry->deadline);
+    atomic_fetch_add_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_queue.expired_count,1,memory_order_relaxed);
+    bsp_release_notification_entry(profile_id,NOTIFICATION_RESULT_EXPIRED);
+    return true;
+} // Drop the payload in flight of a profile if it is too old to be sent
+
+uint8_t bsp_notification_queue_count(notification_queue_t* queue){
+    unsigned int enqueue_position = atomic_load_explicit(&queue->enqueue_position,memory_order_relaxed);
+    unsigned int dequeue_position = atomic_load_explicit(&queue->dequeue_position,memory_order_relaxed);
+    int count = (int)(enqueue_position - dequeue_position);
+    return (count < 0) ? 0 : (count > NOTIFICATION_QUEUE_SLOTS) ? NOTIFICATION_QUEUE_SLOTS : count;
+} // Get the number of payloads waiting in a notification queue
+
+void bsp_set_notification_rate_limit(int profile_id,uint32_t token_interval_ms,uint8_t burst){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    // The token bucket belongs to the notification scheduler so the semaphore is needed to change it
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        notification_token_bucket_t* bucket = &bsp_gatt_server_application_profile_table[profile_id].notification_token_bucket;
+        bucket->token_interval = token_interval_ms*1000;
+        bucket->burst = (burst > 0) ? burst : 1;
+        if(bucket->credit > (uint64_t)bucket->burst*bucket->token_interval){
+            bucket->credit = (uint64_t)bucket->burst*bucket->token_interval;
+        }
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
     }
 
-    #ifdef DEBUG
-        // Display the current value in the attribute for debugging purposes
-        uint16_t attribute_length = 0;
-        uint8_t* attribute_value = NULL;
+    // Wake the notification scheduler so held payloads are sent with the new rate
+    bsp_wake_notification_scheduler();
+} // Change the rate limit of the notifications of a profile
 
-        hal_ble_get_attr_value(param->read.handle,&attribute_length,&attribute_value);
-        // Display them as characters
-        ESP_LOGI(log_tags[4+profile_id],"DEBUG Attribute Value: %s",attribute_value);
-        ESP_LOGI(log_tags[4+profile_id],"DEBUG Attribute Length: %d",attribute_length);
-        ESP_LOGI(log_tags[4+profile_id],"DEBUG Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-        ESP_LOGI(log_tags[4+profile_id],"DEBUG Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-    #endif
+uint32_t bsp_get_notification_token_wait_time(int profile_id){
+    notification_token_bucket_t* bucket = &bsp_gatt_server_application_profile_table[profile_id].notification_token_bucket;
+    uint64_t current_time = hal_ble_get_time(false);
 
-}
+    // Refill the bucket with the time that passed since the last refill
+    bucket->credit += current_time - bucket->last_refill_time;
+    bucket->last_refill_time = current_time;
+    if(bucket->credit > (uint64_t)bucket->burst*bucket->token_interval){
+        bucket->credit = (uint64_t)bucket->burst*bucket->token_interval;
+    }
 
-void bsp_write_characteristic_data(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
-    // Write the data to the characteristic
-    // Check if the write is under characteristic length
+    if(bucket->credit >= bucket->token_interval){
+        return 0;
+    }
+    return (bucket->token_interval - bucket->credit + 999)/1000; // Rounded up to the next millisecond
+} // Get the time until a profile has a notification token
 
-    if(param->write.len <= bsp_gatt_server_application_profile_table[profile_id].local_storage_limit){
-        // It is under the size that is allowed so it can be written without any buffering
-        if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
-            esp_err_t err = hal_ble_set_attr_value(param->write.handle,param->write.len,param->write.value);
-            if(err != ESP_OK){
-                ESP_LOGE(log_tags[4+profile_id],"Error Setting Attribute Value");
-            }else{
-                ESP_LOGI(log_tags[4+profile_id],"Attribute Value Set");
-            }
+void bsp_consume_notification_token(int profile_id){
+    notification_token_bucket_t* bucket = &bsp_gatt_server_application_profile_table[profile_id].notification_token_bucket;
+    bucket->credit = (bucket->credit > bucket->token_interval) ? bucket->credit - bucket->token_interval : 0;
+} // Use up a notification token of a profile
 
-            #ifdef DEBUG
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Before Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Before Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-            #endif
-            // Copy the value to the characteristic storage
-            memset(bsp_gatt_server_application_profile_table[profile_id].local_storage,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit); // Clear the memory
-            memcpy(bsp_gatt_server_application_profile_table[profile_id].local_storage,param->write.value,param->write.len); // Copy the new value to the storage
+void bsp_set_notification_retry_policy(int profile_id,uint8_t max_retries,uint16_t base_delay_ms,uint16_t max_delay_ms){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        notification_retry_t* retry = &bsp_gatt_server_application_profile_table[profile_id].notification_retry;
+        retry->max_retries = max_retries;
+        retry->base_delay = (base_delay_ms > 0) ? base_delay_ms : 1;
+        retry->max_delay = (max_delay_ms > retry->base_delay) ? max_delay_ms : retry->base_delay;
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+    }
+} // Change the retry policy of the notifications of a profile
 
-            bsp_gatt_server_application_profile_table[profile_id].local_storage_len = param->write.len; // Update the value length
+void bsp_schedule_notification_retry(int profile_id){
+    notification_retry_t* retry = &bsp_gatt_server_application_profile_table[profile_id].notification_retry;
 
-            ESP_LOGI(log_tags[4+profile_id],"Characteristic Storage Updated");
+    if(retry->retry_count >= retry->max_retries){
+        // Out of retries so the payload is dropped
+        ESP_LOGE(log_tags[4+profile_id],"Notification Dropped After %d Retries",retry->retry_count);
+        bsp_release_notification_entry(profile_id,NOTIFICATION_RESULT_FAILED);
+        retry->retry_count = 0;
+        retry->failed_count++;
+        return;
+    }
 
-            // This is the write operation that is commpleted so the semaphore can be given out here
-            xSemaphoreGive(bsp_profile_semaphores[profile_id]);
-            ESP_LOGI(log_tags[4+profile_id],"Semaphore Given");
+    // Exponential backoff, half of the delay is random so that the profiles do not retry in lockstep
+    uint32_t delay = (uint32_t)retry->base_delay << retry->retry_count;
+    if(delay > retry->max_delay){
+        delay = retry->max_delay;
+    }
+    delay = delay/2 + hal_get_random()%(delay/2 + 1);
+    retry->retry_count++;
+
+    ESP_LOGW(log_tags[4+profile_id],"Notification Retry %d Scheduled In %lu ms",retry->retry_count,(unsigned long)delay);
+    atomic_store(&retry->retry_scheduled,true);
+    if(retry->retry_timer == NULL ||
+       xTimerChangePeriod(retry->retry_timer,pdMS_TO_TICKS(delay) + 1,0) != pdPASS){
+        // Without the timer the payload is retried on the next wake up of the notification scheduler
+        ESP_LOGE(log_tags[4+profile_id],"Error Starting Notification Retry Timer");
+        atomic_store(&retry->retry_scheduled,false);
+    }
+} // Schedule a retry of the failed notification
 
-            #ifdef DEBUG
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG After Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG After Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-            #endif
+void bsp_notification_retry_timer_callback(TimerHandle_t timer){
+    int profile_id = (int)(intptr_t)pvTimerGetTimerID(timer);
 
-            #ifdef DEBUG
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Characteristic Value: %s",param->write.value);
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Characteristic Length: %d",param->write.len);
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                ESP_LOGW(log_tags[4+profile_id],"DEBUG Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-            #endif
+    atomic_store(&bsp_gatt_server_application_profile_table[profile_id].notification_retry.retry_scheduled,false);
+    bsp_wake_notification_scheduler();
+} // Wake the notification scheduler to retry the failed notification
 
-            // Send a response to the client
-            esp_gatt_rsp_t rsp = hal_ble_create_gatt_response(param->write.handle,param->write.len,param->write.value);
+void bsp_handle_congestion_event(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    (void)gatt_interface; // The event is for the connection, not for the interface it arrived on
+    uint16_t connection_id = param->congest.conn_id;
+    if(connection_id >= MAX_CONNECTIONS){
+        ESP_LOGE(log_tags[4+profile_id],"Congestion Event For Untracked Connection: %d",connection_id);
+        return;
+    }
 
-            err = hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,&rsp);
-            if (err != ESP_OK) {
-                ESP_LOGE(log_tags[4+profile_id], "Failed to send write response: %s", esp_err_to_name(err));
-            }
-        }else{
-            ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore");
-        }
+    // Every profile receives the event so only the first one to see the change handles it
+    bool was_congested = atomic_exchange(&bsp_connection_congested[connection_id],param->congest.congested);
+    if(was_congested == param->congest.congested){
+        return;
     }
-}
 
-static void bsp_server_gap_profile_handler(esp_gap_ble_cb_event_t event,esp_ble_gap_cb_param_t *param){
-    
-}
+    if(param->congest.congested){
+        ESP_LOGW(log_tags[4+profile_id],"Connection %d Congested",connection_id);
+        bsp_connection_congestion_count[connection_id]++;
+    }else{
+        ESP_LOGI(log_tags[4+profile_id],"Connection %d Congestion Relieved",connection_id);
+        // Wake the notification scheduler so that the held payloads of the connection are drained
+        bsp_wake_notification_scheduler();
+    }
+} // Handle a congestion event of a connection
 
-static void bsp_server_gatt_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
-    if(event == ESP_GATTS_REG_EVT){
-            // This event is done when the GATT Server is created and profiles need to be registered
-            ESP_LOGI(GATT_CALLBACK,"GATT Server Registration Event status: %d",param->reg.status);
-            // need to make sure that the status of the registration is successful
-            esp_gatt_status_t reg_status =  param->reg.status;
-            if(reg_status == ESP_OK){
-                ESP_LOGI(GATT_CALLBACK,"GATT Server Registration Successful");
-                // Now we need to get the application profile and set the interface
-                ESP_LOGI(GATT_CALLBACK,"Setting registration for profile: %d",param->reg.app_id);
-
-                // Set the specific profile interface
-                bsp_gatt_server_application_profile_table[param->reg.app_id].profile_interface = gatt_interface;
-                ESP_LOGI(GATT_CALLBACK,"Assigned GATT Interface for profile: %d",param->reg.app_id);
-                // Create the service for the profile
-                esp_gatt_srvc_id_t service_id = hal_ble_create_service_id(service_uuids[param->reg.app_id]);
-                esp_err_t err = hal_ble_create_service(gatt_interface,&service_id,10);
-                if(err != ESP_OK){
-                    ESP_LOGE(GATT_CALLBACK,"Error Creating Service for profile: %d",param->reg.app_id);
-                    return;
+static void bsp_release_indication(int profile_id){
+    uint16_t connection_id = bsp_gatt_server_application_profile_table[profile_id].connection_id;
+    if(connection_id < MAX_CONNECTIONS){
+        int owner = profile_id + 1;
+        atomic_compare_exchange_strong(&bsp_connection_indicating_profile[connection_id],&owner,0);
+    }
+
+    // The profile completes its indication and the other profiles of the connection can send theirs straight away
+    bsp_wake_notification_scheduler();
+} // Free the connection for the next indication
+
+void bsp_handle_indication_confirmation(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    (void)gatt_interface; // The connection and handle of the event identify the indication
+    notification_indication_t* indication = &bsp_gatt_server_application_profile_table[profile_id].notification_indication;
+    uint8_t expected_state = INDICATION_PENDING;
+
+    // Sent notifications also raise this event, so only the one for the connection and handle of the pending indication confirms it
+    if(param->conf.conn_id != indication->connection_id || param->conf.handle != indication->handle){
+        return;
+    }
+
+    // Confirmations arriving after the timeout are ignored
+    uint8_t result = (param->conf.status == ESP_GATT_OK) ? INDICATION_CONFIRMED : INDICATION_FAILED;
+    if(!atomic_compare_exchange_strong(&indication->state,&expected_state,result)){
+        return;
+    }
+
+    if(indication->timeout_timer != NULL){
+        xTimerStop(indication->timeout_timer,0);
+    }
+    if(result == INDICATION_CONFIRMED){
+        indication->confirmed_count++;
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Indication Rejected With Status: %d",param->conf.status);
+    }
+    bsp_release_indication(profile_id);
+} // Handle the confirmation of an indication
+
+void bsp_indication_timeout_timer_callback(TimerHandle_t timer){
+    int profile_id = (int)(intptr_t)pvTimerGetTimerID(timer);
+    notification_indication_t* indication = &bsp_gatt_server_application_profile_table[profile_id].notification_indication;
+    uint8_t expected_state = INDICATION_PENDING;
+
+    if(atomic_compare_exchange_strong(&indication->state,&expected_state,INDICATION_FAILED)){
+        ESP_LOGW(log_tags[4+profile_id],"Indication Not Confirmed Within %d ms",indication->timeout);
+        indication->timeout_count++;
+        bsp_release_indication(profile_id);
+    }
+} // Fail the indication that was not confirmed in time
+
+void bsp_set_indication_timeout(int profile_id,uint16_t timeout_ms){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        bsp_gatt_server_application_profile_table[profile_id].notification_indication.timeout = (timeout_ms > 0) ? timeout_ms : 1;
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+    }
+} // Change the time a profile waits for an indication to be confirmed
+
+void bsp_set_notification_delta(int profile_id,bool enabled){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        // The first frame after a change of mode is always a full frame
+        bsp_gatt_server_application_profile_table[profile_id].notification_delta.enabled = enabled;
+        for(int characteristic = 0; characteristic < bsp_gatt_server_application_profile_table[profile_id].num_characteristics; characteristic++){
+            atomic_store(&bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].delta_synced,false);
+        }
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+    }
+} // Enable or disable the delta encoding of the notifications of a profile
+
+static void bsp_complete_notification(int profile_id);
+
+static void bsp_complete_indication(int profile_id){
+    // The confirmation callbacks only move the state out of pending, the payload is completed or retried here by the notification scheduler
+    if(atomic_exchange(&bsp_gatt_server_application_profile_table[profile_id].notification_indication.state,INDICATION_IDLE) == INDICATION_CONFIRMED){
+        bsp_complete_notification(profile_id);
+    }else{
+        // The client may not hold the stored value anymore so the retry is sent as a full frame
+        profile_t* profile = &bsp_gatt_server_application_profile_table[profile_id];
+        atomic_store(&profile->characteristics[profile->notification_entry.characteristic].delta_synced,false);
+        bsp_schedule_notification_retry(profile_id);
+    }
+} // Complete or retry the indication once its confirmation state is known
+
+#ifdef NOTIFICATION_BATCHING
+
+bool bsp_is_notification_batching_active(int profile_id,uint8_t characteristic){
+    // Indications stay on the characteristic of the profile so that each update is still acknowledged
+    // The records carry the profile ID, so only the first characteristic of a profile is batched
+    return profile_id != BATCH_PROFILE_ID && characteristic == 0 &&
+           bsp_gatt_server_application_profile_table[BATCH_PROFILE_ID].characteristics[0].cccd_status == 0x0001 &&
+           bsp_gatt_server_application_profile_table[profile_id].characteristics[0].cccd_status != 0x0002 &&
+           bsp_gatt_server_application_profile_table[profile_id].connection_id == bsp_gatt_server_application_profile_table[BATCH_PROFILE_ID].connection_id;
+} // Check if the updates of a profile are packed into the batch
+
+bool bsp_add_to_notification_batch(int profile_id){
+    profile_t* batch = &bsp_gatt_server_application_profile_table[BATCH_PROFILE_ID];
+    uint8_t notification_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+    bool added = false;
+
+    if(xSemaphoreTake(bsp_profile_semaphores[BATCH_PROFILE_ID],portMAX_DELAY) == pdTRUE){
+        // The batch has to fit in one notification of the negotiated MTU
+        uint16_t capacity = bsp_notification_batch.mtu - 3;
+        if(capacity > batch->characteristics[0].local_storage_limit){
+            capacity = batch->characteristics[0].local_storage_limit;
+        }
+
+        if(batch->notification_entry.length + 2 + notification_len <= capacity){
+            if(batch->notification_entry.length == 0){
+                // The first record starts the window
+                batch->notification_entry.push_time = hal_ble_get_time(false);
+            }
+            // The payload is referenced in place, it stays in its pool block until the batch is sent
+            bsp_notification_batch.payloads[profile_id] = bsp_gatt_server_application_profile_table[profile_id].notification_buffer;
+            bsp_notification_batch.lengths[profile_id] = notification_len;
+            batch->notification_entry.length += 2 + notification_len;
+            bsp_notification_batch.members |= (1 << profile_id);
+            added = true;
+        }else{
+            bsp_notification_batch.full = true;
+        }
+
+        xSemaphoreGive(bsp_profile_semaphores[BATCH_PROFILE_ID]);
+    }else{
+        ESP_LOGE(BATCH_PROFILE_CB,"Error Taking Semaphore for Profile: %d",BATCH_PROFILE_ID);
+    }
+
+    return added;
+} // Pack the payload of a profile into the batch
+
+bool bsp_flush_notification_batch(TickType_t* wait_ticks){
+    profile_t* batch = &bsp_gatt_server_application_profile_table[BATCH_PROFILE_ID];
+    uint32_t members = 0;
+    bool sent = false;
+
+    if(xSemaphoreTake(bsp_profile_semaphores[BATCH_PROFILE_ID],portMAX_DELAY) != pdTRUE){
+        ESP_LOGE(BATCH_PROFILE_CB,"Error Taking Semaphore for Profile: %d",BATCH_PROFILE_ID);
+        return false;
+    }
+
+    if(batch->notification_entry.length == 0 || atomic_load(&batch->notification_retry.retry_scheduled) || bsp_is_connection_congested(batch->connection_id)){
+        // Nothing packed, or the batch is held until its retry timer or the end of the congestion wakes the scheduler
+        xSemaphoreGive(bsp_profile_semaphores[BATCH_PROFILE_ID]);
+        return false;
+    }
+
+    if(batch->characteristics[0].cccd_status != 0x0001){
+        // The client unsubscribed so the members are released and notified on their own characteristics
+        members = bsp_notification_batch.members;
+        bsp_notification_batch.members = 0;
+        bsp_notification_batch.full = false;
+        batch->notification_entry.length = 0;
+        xSemaphoreGive(bsp_profile_semaphores[BATCH_PROFILE_ID]);
+        return members != 0;
+    }
+
+    uint64_t elapsed_time = hal_ble_get_time(false) - batch->notification_entry.push_time;
+    if(!bsp_notification_batch.full && elapsed_time < NOTIFICATION_BATCH_WINDOW*1000){
+        // Wait for the rest of the window so that other profiles can add their updates
+        TickType_t remaining_ticks = pdMS_TO_TICKS((NOTIFICATION_BATCH_WINDOW*1000 - elapsed_time)/1000) + 1;
+        if(remaining_ticks < *wait_ticks){
+            *wait_ticks = remaining_ticks;
+        }
+        xSemaphoreGive(bsp_profile_semaphores[BATCH_PROFILE_ID]);
+        return false;
+    }
+
+    // Each record is a header segment followed by the payload segment, the HAL assembles them once into the batch buffer
+    uint8_t record_headers[NUM_PROFILES][2];
+    hal_ble_segment_t segments[2*NUM_PROFILES];
+    uint8_t num_segments = 0;
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        if(!(bsp_notification_batch.members & (1 << profile_id))){
+            continue;
+        }
+        record_headers[profile_id][0] = profile_id;
+        record_headers[profile_id][1] = bsp_notification_batch.lengths[profile_id];
+        segments[num_segments++] = (hal_ble_segment_t){.data = record_headers[profile_id],.length = 2};
+        segments[num_segments++] = (hal_ble_segment_t){.data = bsp_notification_batch.payloads[profile_id],.length = bsp_notification_batch.lengths[profile_id]};
+    }
+
+    esp_err_t err = hal_ble_send_notification_segments(batch->profile_interface,batch->connection_id,batch->characteristics[0].handle,segments,num_segments,batch->notification_buffer,batch->characteristics[0].local_storage_limit);
+    if(err != ESP_OK){
+        ESP_LOGE(BATCH_PROFILE_CB,"Error Sending Batch: %s",esp_err_to_name(err));
+        if(!bsp_is_connection_congested(batch->connection_id)){
+            bsp_schedule_notification_retry(BATCH_PROFILE_ID);
+        }
+    }else{
+        ESP_LOGI(BATCH_PROFILE_CB,"Batch Sent Length: %d",batch->notification_entry.length);
+        #ifdef TESTING
+            atomic_fetch_add(&bsp_notification_copy_counts.batch_copies,num_segments/2);
+            atomic_fetch_add(&bsp_notification_copy_counts.stack_copies,1);
+        #endif
+        bsp_complete_notification(BATCH_PROFILE_ID);
+        bsp_notification_batch.batch_count++;
+        sent = true;
+    }
+
+    if(batch->notification_entry.length == 0){
+        // The batch was sent or dropped after its retries, either way its members are done
+        members = bsp_notification_batch.members;
+        bsp_notification_batch.members = 0;
+        bsp_notification_batch.full = false;
+    }
+    xSemaphoreGive(bsp_profile_semaphores[BATCH_PROFILE_ID]);
+
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        if(!(members & (1 << profile_id))){
+            continue;
+        }
+        if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+            if(sent){
+                bsp_complete_notification(profile_id);
+                bsp_notification_batch.batched_count++;
+            }else{
+                bsp_release_notification_entry(profile_id,NOTIFICATION_RESULT_FAILED);
+                bsp_gatt_server_application_profile_table[profile_id].notification_retry.failed_count++;
+            }
+            xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+        }else{
+            ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+        }
+    }
+
+    return sent;
+} // Send the batch and complete its members
+
+#endif
+
+bool bsp_is_connection_congested(uint16_t connection_id){
+    return (connection_id < MAX_CONNECTIONS) && atomic_load(&bsp_connection_congested[connection_id]);
+} // Check if a connection is congested
+
+void bsp_set_notification_queue_policy(int profile_id,notification_queue_policy_t policy){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    atomic_store_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_queue.policy,policy,memory_order_relaxed);
+} // Change the policy of the notification queue of a profile
+
+void bsp_set_notification_ttl(int profile_id,uint32_t ttl_ms){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    // Only payloads pushed afterwards use the new time to live
+    atomic_store_explicit(&bsp_gatt_server_application_profile_table[profile_id].notification_ttl,ttl_ms,memory_order_relaxed);
+} // Change the default time to live of the payloads of a profile
+
+#ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+
+static void bsp_record_notification_latency(int profile_id,notification_stage_t stage,uint64_t latency){
+    // Called by the notification scheduler with the semaphore of the profile held
+    notification_histogram_t* histogram = &bsp_gatt_server_application_profile_table[profile_id].notification_latency.stages[stage];
+    uint32_t latency_us = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+
+    int bucket = (latency_us < 2) ? 0 : 31 - __builtin_clz(latency_us);
+    if(bucket >= NOTIFICATION_HISTOGRAM_BUCKETS){
+        bucket = NOTIFICATION_HISTOGRAM_BUCKETS - 1;
+    }
+    if(histogram->buckets[bucket] < UINT16_MAX){
+        histogram->buckets[bucket]++;
+    }
+    if(latency_us > histogram->max){
+        histogram->max = latency_us;
+    }
+} // Add a latency to the histogram of a stage
+
+bool bsp_get_notification_latency(int profile_id,notification_stage_t stage,notification_histogram_t* histogram){
+    if(!bsp_is_valid_profile(profile_id)){
+        return false;
+    }
+    if(stage >= NUM_NOTIFICATION_STAGES){
+        return false;
+    }
+
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) != pdTRUE){
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+        return false;
+    }
+    *histogram = bsp_gatt_server_application_profile_table[profile_id].notification_latency.stages[stage];
+    xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    return true;
+} // Copy the latency histogram of a stage
+
+void bsp_reset_notification_latency(int profile_id){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        memset(bsp_gatt_server_application_profile_table[profile_id].notification_latency.stages,0,sizeof(bsp_gatt_server_application_profile_table[profile_id].notification_latency.stages));
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+    }
+} // Clear the latency histograms of a profile
+
+int bsp_format_notification_latency(int profile_id,char* record,size_t size){
+    if(!bsp_is_valid_profile(profile_id)){
+        return 0;
+    }
+    static const char stage_names[NUM_NOTIFICATION_STAGES] = {'q','r','s','t'};
+    notification_histogram_t histogram;
+    int length = 0;
+
+    if(record == NULL || size == 0){
+        return 0;
+    }
+    length += snprintf(record,size,"p%d",profile_id);
+
+    for(int stage = 0; stage < NUM_NOTIFICATION_STAGES && length < (int)size; stage++){
+        if(!bsp_get_notification_latency(profile_id,stage,&histogram)){
+            break;
+        }
+        int last_bucket = NOTIFICATION_HISTOGRAM_BUCKETS - 1;
+        while(last_bucket >= 0 && histogram.buckets[last_bucket] == 0){
+            last_bucket--;
+        }
+        length += snprintf(record + length,size - length,";%c:%lu:",stage_names[stage],(unsigned long)histogram.max);
+        for(int bucket = 0; bucket <= last_bucket && length < (int)size; bucket++){
+            length += snprintf(record + length,size - length,(bucket == 0) ? "%u" : ",%u",histogram.buckets[bucket]);
+        }
+    }
+
+    return (length < (int)size) ? length : (int)size - 1;
+} // Format the latency histograms of a profile as one record
+
+void bsp_dump_notification_latency(){
+    char record[256];
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        bsp_format_notification_latency(profile_id,record,sizeof(record));
+        ESP_LOGI(NOTIFICATION_SCHEDULER,"Latency %s",record);
+    }
+} // Log the latency record of every profile
+
+#endif
+
+void bsp_init_semaphores(uint8_t num_profiles){
+    // Initialize the semaphores, they are kept when the server is stopped so initializing it again does not create them twice
+    for(int profile_no = 0; profile_no < num_profiles; profile_no++){
+       if(bsp_profile_semaphores[profile_no] != NULL){
+           continue;
+       }
+       bsp_profile_semaphores[profile_no] = xSemaphoreCreateMutexStatic(&bsp_profile_semaphore_storage[profile_no]);
+       ESP_LOGI(log_tags[4+profile_no],"Semaphore Created for Profile: %d",profile_no);
+    }
+} // Initialize the semaphores for the profiles
+
+void bsp_wake_notification_scheduler(){
+    if(bsp_notification_scheduler_handle != NULL){
+        xTaskNotifyGive(bsp_notification_scheduler_handle);
+    }
+} // Wake the notification scheduler
+
+void bsp_set_notification_priority(int profile_id,notification_priority_t priority,uint16_t quantum){
+    if(!bsp_is_valid_profile(profile_id)){
+        return;
+    }
+    if(priority >= NUM_NOTIFICATION_PRIORITIES){
+        ESP_LOGE(log_tags[4+profile_id],"Invalid Notification Priority: %d",priority);
+        return;
+    }
+
+    // The schedule belongs to the notification scheduler so the semaphore is needed to change it
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+        bsp_gatt_server_application_profile_table[profile_id].notification_schedule.priority = priority;
+        bsp_gatt_server_application_profile_table[profile_id].notification_schedule.quantum = (quantum > 0) ? quantum : 1;
+        bsp_gatt_server_application_profile_table[profile_id].notification_schedule.deficit = 0;
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    }else{
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+    }
+
+    bsp_wake_notification_scheduler();
+} // Change the priority class and quantum of a profile
+
+static bool bsp_has_subscribed_characteristic(int profile_id){
+    // A profile packed into the batch characteristic does not need its own subscription
+    profile_t* profile = &bsp_gatt_server_application_profile_table[profile_id];
+    for(int characteristic = 0; characteristic < profile->num_characteristics; characteristic++){
+        if(bsp_is_notification_enabled(profile->characteristics[characteristic].cccd_status)){
+            return true;
+        }
+        #ifdef NOTIFICATION_BATCHING
+            if(bsp_is_notification_batching_active(profile_id,characteristic)){
+                return true;
+            }
+        #endif
+    }
+    return false;
+} // Check if any characteristic of a profile can be notified
+
+static bool bsp_has_pending_notification(int profile_id){
+    return bsp_gatt_server_application_profile_table[profile_id].notification_entry.length != 0 ||
+           bsp_notification_queue_count(&bsp_gatt_server_application_profile_table[profile_id].notification_queue) > 0;
+} // Check if a profile has a payload in flight or waiting in its queue
+
+static uint8_t bsp_service_notification_profile(int profile_id,int32_t deficit,TickType_t* wait_ticks){
+    // Send the next payload of the profile if it fits in the deficit, returns the length that was sent or 0 when the profile cannot send right now
+    uint8_t sent_len = 0;
+
+    if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) != pdTRUE){
+        ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore for Profile: %d",profile_id);
+        return 0;
+    }
+
+    bool notifications_enabled = bsp_has_subscribed_characteristic(profile_id);
+
+    while(notifications_enabled && bsp_has_pending_notification(profile_id)){
+        #ifdef NOTIFICATION_BATCHING
+            if(bsp_notification_batch.members & (1 << profile_id)){
+                // The payload is packed in the batch and is completed once the batch is sent
+                break;
+            }
+        #endif
+        uint8_t indication_state = atomic_load(&bsp_gatt_server_application_profile_table[profile_id].notification_indication.state);
+        if(indication_state == INDICATION_PENDING){
+            // The indication is waiting for the confirmation of the client, which wakes the scheduler
+            break;
+        }else if(indication_state != INDICATION_IDLE){
+            bsp_complete_indication(profile_id);
+            continue;
+        }
+        if(bsp_drop_expired_notification(profile_id)){
+            // A stale payload held by a retry or a congestion no longer blocks the newer payloads behind it
+            continue;
+        }
+        if(atomic_load(&bsp_gatt_server_application_profile_table[profile_id].notification_retry.retry_scheduled)){
+            // The failed payload is waiting for its retry timer, which wakes the scheduler
+            break;
+        }
+        if(bsp_is_connection_congested(bsp_gatt_server_application_profile_table[profile_id].connection_id)){
+            // The payloads are held until the congestion is relieved, which wakes the scheduler
+            break;
+        }
+        uint32_t token_wait_time = bsp_get_notification_token_wait_time(profile_id);
+        #ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+            notification_latency_t* latency = &bsp_gatt_server_application_profile_table[profile_id].notification_latency;
+            if(token_wait_time > 0 && latency->rate_limit_start == 0){
+                latency->rate_limit_start = hal_ble_get_time(false);
+            }else if(token_wait_time == 0 && latency->rate_limit_start != 0){
+                // The rate limit released the profile
+                bsp_record_notification_latency(profile_id,NOTIFICATION_STAGE_RATE_LIMIT,hal_ble_get_time(false) - latency->rate_limit_start);
+                latency->rate_limit_start = 0;
+            }
+        #endif
+        if(token_wait_time > 0){
+            // The payload is held in the queue until a token is available
+            if(pdMS_TO_TICKS(token_wait_time) + 1 < *wait_ticks){
+                *wait_ticks = pdMS_TO_TICKS(token_wait_time) + 1;
+            }
+            break;
+        }
+        if(bsp_gatt_server_application_profile_table[profile_id].notification_entry.length == 0){
+            // Take ownership of the next block, the payload is sent straight from it
+            if(!bsp_notification_queue_pop(&bsp_gatt_server_application_profile_table[profile_id].notification_queue,&bsp_gatt_server_application_profile_table[profile_id].notification_entry)){
+                break;
+            }
+            bsp_gatt_server_application_profile_table[profile_id].notification_buffer = bsp_notification_pool.blocks[bsp_gatt_server_application_profile_table[profile_id].notification_entry.block];
+            #ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+                latency->dequeue_time = hal_ble_get_time(false);
+                bsp_record_notification_latency(profile_id,NOTIFICATION_STAGE_QUEUE,latency->dequeue_time - bsp_gatt_server_application_profile_table[profile_id].notification_entry.push_time);
+            #endif
+            if(bsp_drop_expired_notification(profile_id)){
+                // The payload went stale while it was queued behind the rate limit or the congestion
+                continue;
+            }
+            uint8_t characteristic = bsp_gatt_server_application_profile_table[profile_id].notification_entry.characteristic;
+            bool characteristic_enabled = bsp_is_notification_enabled(bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].cccd_status);
+            #ifdef NOTIFICATION_BATCHING
+                characteristic_enabled = characteristic_enabled || bsp_is_notification_batching_active(profile_id,characteristic);
+            #endif
+            if(!characteristic_enabled){
+                // Another characteristic of the profile is subscribed but not this one, nothing would ever send the payload
+                bsp_release_notification_entry(profile_id,NOTIFICATION_RESULT_NOT_SUBSCRIBED);
+                continue;
+            }
+        }
+        if(bsp_gatt_server_application_profile_table[profile_id].notification_entry.length > deficit){
+            // The payload waits for the next round of its class, which runs straight away because nothing else may wake the scheduler
+            *wait_ticks = 0;
+            break;
+        }
+
+        uint8_t notification_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+        bsp_update_characteristic_data(profile_id);
+        if(bsp_gatt_server_application_profile_table[profile_id].notification_entry.length == 0 ||
+           atomic_load(&bsp_gatt_server_application_profile_table[profile_id].notification_indication.state) == INDICATION_PENDING){
+            sent_len = notification_len;
+        }
+        #ifdef NOTIFICATION_BATCHING
+            if(bsp_notification_batch.members & (1 << profile_id)){
+                sent_len = notification_len;
+            }
+        #endif
+        // Otherwise the payload is waiting for its retry or a free connection
+        break;
+    }
+
+    xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+    return sent_len;
+}
+
+static bool bsp_run_notification_round(uint8_t priority,TickType_t* wait_ticks){
+    // One deficit round robin round over the profiles of a priority class, returns true if anything was sent
+    bool serviced = false;
+
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        notification_schedule_t* schedule = &bsp_gatt_server_application_profile_table[profile_id].notification_schedule;
+        if(schedule->priority != priority){
+            continue;
+        }
+        #ifdef NOTIFICATION_BATCHING
+            if(profile_id == BATCH_PROFILE_ID){
+                // The batch is sent by bsp_flush_notification_batch() once the other profiles are packed
+                continue;
+            }
+        #endif
+        if(!bsp_has_pending_notification(profile_id)){
+            // An idle profile does not save up its deficit
+            schedule->deficit = 0;
+            continue;
+        }
+
+        schedule->deficit += schedule->quantum;
+        uint8_t sent_len;
+        while((sent_len = bsp_service_notification_profile(profile_id,schedule->deficit,wait_ticks)) > 0){
+            schedule->deficit -= sent_len;
+            serviced = true;
+        }
+
+        if(!bsp_has_pending_notification(profile_id)){
+            schedule->deficit = 0;
+        }else if(schedule->deficit > schedule->quantum + NOTIFICATION_POOL_BLOCK_SIZE){
+            // A profile held back by its rate limit or the link does not build up a burst of deficit, a pool block holds its largest payload
+            schedule->deficit = schedule->quantum + NOTIFICATION_POOL_BLOCK_SIZE;
+        }
+    }
+
+    return serviced;
+}
+
+void bsp_notification_scheduler_task(void *param){
+    (void)param; // The scheduler serves every profile of the server table
+
+    TickType_t wait_ticks = portMAX_DELAY;
+
+    while(1){
+        #ifdef NOTIFICATION_POLLING_MODE
+            // Delay the task
+            vTaskDelay(pdMS_TO_TICKS(NOTIFICATION_POLL_INTERVAL)); // Checking every poll interval to see if the data has changed
+        #else
+            // Block until a producer pushes data to a notification queue or a held payload can be sent
+            ulTaskNotifyTake(pdTRUE,wait_ticks);
+        #endif
+        wait_ticks = portMAX_DELAY;
+
+        // Every round starts again from the highest class so a high priority payload waits at most one round of a lower class
+        bool serviced;
+        do{
+            serviced = false;
+            for(uint8_t priority = 0; priority < NUM_NOTIFICATION_PRIORITIES && !serviced; priority++){
+                serviced = bsp_run_notification_round(priority,&wait_ticks);
+            }
+            #ifdef NOTIFICATION_BATCHING
+                // The batch is only sent once no profile can add to it
+                if(!serviced){
+                    serviced = bsp_flush_notification_batch(&wait_ticks);
                 }
-                ESP_LOGI(GATT_CALLBACK,"Profile Create Service for profile: %d",param->reg.app_id);
-                // Set the specific profile interface
-                bsp_gatt_server_application_profile_table[param->reg.app_id].profile_interface = gatt_interface;
+            #endif
+        }while(serviced);
+
+        #ifdef TESTING
+            ESP_LOGW(NOTIFICATION_SCHEDULER,"TESTING Scheduler Stack High Water Mark: %u bytes",uxTaskGetStackHighWaterMark(NULL));
+        #endif
+    }
+
+} // Send the queued payloads of every profile
+
+void bsp_start_notification_scheduler(){
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        // Create the one shot timer used to retry failed notifications
+        if(bsp_notification_retry_timers[profile_id] == NULL){
+            bsp_notification_retry_timers[profile_id] = xTimerCreateStatic("Notify Retry",1,pdFALSE,(void*)(intptr_t)profile_id,bsp_notification_retry_timer_callback,&bsp_notification_retry_timer_storage[profile_id]);
+        }
+        bsp_gatt_server_application_profile_table[profile_id].notification_retry.retry_timer = bsp_notification_retry_timers[profile_id];
+        if(bsp_gatt_server_application_profile_table[profile_id].notification_retry.retry_timer == NULL){
+            ESP_LOGE(log_tags[4+profile_id],"Error Creating Notification Retry Timer");
+        }
+
+        // Create the one shot timer used to time out unconfirmed indications
+        if(bsp_indication_timeout_timers[profile_id] == NULL){
+            bsp_indication_timeout_timers[profile_id] = xTimerCreateStatic("Indicate Timeout",1,pdFALSE,(void*)(intptr_t)profile_id,bsp_indication_timeout_timer_callback,&bsp_indication_timeout_timer_storage[profile_id]);
+        }
+        bsp_gatt_server_application_profile_table[profile_id].notification_indication.timeout_timer = bsp_indication_timeout_timers[profile_id];
+        if(bsp_gatt_server_application_profile_table[profile_id].notification_indication.timeout_timer == NULL){
+            ESP_LOGE(log_tags[4+profile_id],"Error Creating Indication Timeout Timer");
+        }
+    }
+
+    if(bsp_notification_scheduler_handle != NULL){
+        // The scheduler of an earlier initialization is still running and picks up the new server table
+        bsp_wake_notification_scheduler();
+        return;
+    }
+
+    #ifdef TESTING
+        uint32_t free_heap_before = hal_get_free_heap_size();
+    #endif
+
+    // Start the single task that sends the notifications of every profile, its stack is static so it does not come from the heap
+    bsp_notification_scheduler_handle = xTaskCreateStaticPinnedToCore(
+        bsp_notification_scheduler_task,
+        "Notify Scheduler",
+        NOTIFICATION_SCHEDULER_STACK_SIZE,
+        NULL,
+        5,
+        bsp_notification_scheduler_stack,
+        &bsp_notification_scheduler_tcb,
+        1
+    );
+    if(bsp_notification_scheduler_handle != NULL){
+        ESP_LOGI(NOTIFICATION_SCHEDULER,"Notification Scheduler Started");
+    }else{
+        ESP_LOGE(NOTIFICATION_SCHEDULER,"Error Starting Notification Scheduler");
+    }
+
+    #ifdef TESTING
+        ESP_LOGW(NOTIFICATION_SCHEDULER,"TESTING Scheduler Heap Usage: %lu bytes",(unsigned long)(free_heap_before - hal_get_free_heap_size()));
+    #endif
+}
+
+bool bsp_has_data_changed(const uint8_t* new_data,const uint8_t* old_data,uint16_t length){
+    return memcmp(new_data,old_data,length) != 0;
+} // Check if the data has changed
+
+uint16_t bsp_read_stored_value(characteristic_t* characteristic,uint8_t* destination,uint16_t size){
+    stored_value_t* stored_value = &characteristic->stored_value;
+    unsigned int sequence;
+    uint16_t length;
+
+    // A publish releases the buffer it replaces, so a copy is only kept if the sequence did not change while it was taken
+    do{
+        sequence = atomic_load_explicit(&stored_value->sequence,memory_order_acquire);
+        const uint8_t* buffer = atomic_load_explicit(&stored_value->buffers[sequence & 1],memory_order_relaxed);
+        length = atomic_load_explicit(&stored_value->lengths[sequence & 1],memory_order_relaxed);
+        if(length > size){
+            length = size;
+        }
+        if(buffer != NULL && length > 0){
+            memcpy(destination,buffer,length);
+        }
+        atomic_thread_fence(memory_order_acquire);
+    }while(atomic_load_explicit(&stored_value->sequence,memory_order_relaxed) != sequence);
+
+    return length;
+} // Copy the stored value without taking a lock
+
+uint8_t* bsp_get_stored_value(characteristic_t* characteristic,uint8_t* length){
+    // The caller holds the profile semaphore so no publish can run meanwhile
+    unsigned int slot = atomic_load_explicit(&characteristic->stored_value.sequence,memory_order_relaxed) & 1;
+    *length = atomic_load_explicit(&characteristic->stored_value.lengths[slot],memory_order_relaxed);
+    return atomic_load_explicit(&characteristic->stored_value.buffers[slot],memory_order_relaxed);
+} // Get the stored value in place
+
+uint8_t* bsp_publish_stored_value(characteristic_t* characteristic,uint8_t* buffer,uint8_t block,uint8_t length){
+    stored_value_t* stored_value = &characteristic->stored_value;
+    unsigned int sequence = atomic_load_explicit(&stored_value->sequence,memory_order_relaxed);
+    unsigned int slot = sequence & 1;
+
+    // The new value goes in the free slot and is handed to the readers by the sequence
+    atomic_store_explicit(&stored_value->buffers[slot ^ 1],buffer,memory_order_relaxed);
+    atomic_store_explicit(&stored_value->lengths[slot ^ 1],length,memory_order_relaxed);
+    stored_value->blocks[slot ^ 1] = block;
+    atomic_store_explicit(&stored_value->sequence,sequence + 1,memory_order_release);
+
+    // A reader still copying the replaced value sees the sequence change and retries, so its block can be reused right away
+    uint8_t* replaced = atomic_load_explicit(&stored_value->buffers[slot],memory_order_relaxed);
+    if(stored_value->blocks[slot] != NOTIFICATION_POOL_NO_BLOCK){
+        bsp_notification_pool_release(stored_value->blocks[slot]);
+        stored_value->blocks[slot] = NOTIFICATION_POOL_NO_BLOCK;
+    }
+    return replaced;
+} // Make a buffer the stored value
+
+void bsp_disable_notifications(uint16_t* cccd_status){
+    *cccd_status = 0x0000;
+} // Disable the notifications
+
+void bsp_enable_notifications(uint16_t* cccd_status){
+    *cccd_status = 0x0001;
+} // Enable the notifications
+
+bool bsp_is_notification_enabled(uint16_t cccd_status){
+    return (cccd_status & 0x0003);
+}// Check if the notifications or indications are enabled
+
+void bsp_update_characteristic_data(int profile_id){
+    // Characteristic data needs to be updated and the notifications need to be sent
+    uint8_t notification_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+    if(notification_len == 0){
+        return;
+    }
+    uint8_t characteristic_index = bsp_gatt_server_application_profile_table[profile_id].notification_entry.characteristic;
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic_index];
+
+    uint8_t stored_len = 0;
+    uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+    if(notification_len == stored_len &&
+       !bsp_has_data_changed(bsp_gatt_server_application_profile_table[profile_id].notification_buffer,stored_value,notification_len)){
+        // The client already has this value
+        bsp_release_notification_entry(profile_id,NOTIFICATION_RESULT_SENT);
+        return;
+    }
+
+    #ifdef NOTIFICATION_BATCHING
+        if(bsp_is_notification_batching_active(profile_id,characteristic_index)){
+            // The payload is sent as part of the batch, a full batch leaves it in flight until the batch has been sent
+            bsp_add_to_notification_batch(profile_id);
+            return;
+        }
+    #endif
+
+    // Send the notification to the client, the local storage and the characteristic value are updated once it is sent
+    bsp_send_notification_data(profile_id);
+}
+
+void bsp_handle_add_characteristic_descriptor_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+
+    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event status: %d",param->add_char_descr.status);
+    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event Attribute Handle: %d",param->add_char_descr.attr_handle);
+    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Descriptor Event Service Handle: %d",param->add_char_descr.service_handle);
+
+    // Get the CCCD Value
+    uint16_t cccd_value = 0;
+    uint16_t cccd_len = sizeof(cccd_value);
+    esp_err_t err = esp_ble_gatts_get_attr_value(param->add_char_descr.attr_handle, &cccd_len, (const uint8_t **)&cccd_value);
+
+    // The descriptor belongs to the characteristic that was added last
+    uint8_t characteristic = bsp_gatt_server_profile_config_table[profile_id].characteristics_added - 1;
+    bsp_gatt_server_profile_config_table[profile_id].characteristics[characteristic].characteristic_descriptor_handle = param->add_char_descr.attr_handle;
+    bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].cccd_status = cccd_value;
+    bsp_add_attribute_route(param->add_char_descr.attr_handle,profile_id,characteristic,ATTRIBUTE_ROLE_CCCD);
+
+    if(err != ESP_OK){
+        ESP_LOGE(log_tags[4+profile_id],"Error Getting CCCD Value");
+    }else{
+        ESP_LOGI(log_tags[4+profile_id],"CCCD Value: %d",cccd_value);
+    }
+
+    bsp_add_next_characteristic(profile_id);
+}
+
+void bsp_handle_add_characteristic_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    
+    ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event status: %d",param->add_char.status);
+    uint16_t attribute_length = 0;
+    const uint8_t *attribute_value = NULL;
+
+    #ifdef DEBUG
+        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event status: %d",param->add_char.status);
+        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event Attribute Handle: %d",param->add_char.attr_handle);
+        ESP_LOGI(log_tags[4+profile_id],"GATT Server Add Characteristic Event Service Handle: %d",param->add_char.service_handle);
+    #endif
+
+    // The characteristics are added one at a time so the event is for the one that was added last
+    uint8_t characteristic = bsp_gatt_server_profile_config_table[profile_id].characteristics_added - 1;
+    bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].handle = param->add_char.attr_handle;
+    bsp_add_attribute_route(param->add_char.attr_handle,profile_id,characteristic,ATTRIBUTE_ROLE_VALUE);
+
+    #ifdef DEBUG
+
+        // Getting the attribute value to see if it was set correctly
+        esp_err_t err = hal_ble_get_attr_value(param->add_char.attr_handle,&attribute_length,&attribute_value);
+        if(err != ESP_OK){
+            ESP_LOGE(log_tags[4+profile_id],"Error Getting Attribute Value");
+        }
+
+        ESP_LOGI(log_tags[4+profile_id],"Attribute Length: %d",attribute_length);
+        ESP_LOGI(log_tags[4+profile_id],"Attribute Value: %s",attribute_value);
+        ESP_LOGI(log_tags[4+profile_id],"Attribute Handle: %d",param->add_char.attr_handle);
+    #endif
+
+    if(bsp_gatt_server_profile_config_table[profile_id].characteristics[characteristic].flags & CHARACTERISTIC_FLAG_NOTIFY){
+        // Adding a characteristic descriptor UUID, the next characteristic is added once the descriptor has been added
+        esp_bt_uuid_t cccd_uuid = hal_ble_create_uuid(ESP_GATT_UUID_CHAR_CLIENT_CONFIG,ESP_UUID_LEN_16);
+
+        esp_gatt_perm_t perm = hal_ble_create_permissions(true,true);
+
+        esp_err_t descriptor_err = hal_ble_add_char_descriptor(param->add_char.service_handle,&cccd_uuid,perm,false);
+
+        bsp_gatt_server_profile_config_table[profile_id].characteristics[characteristic].characteristic_descriptor_uuid = cccd_uuid;
+
+        if(descriptor_err != ESP_OK){
+            ESP_LOGE(log_tags[4+profile_id],"Error Adding Characteristic Descriptor");
+        }
+    }else{
+        ESP_LOGI(log_tags[4+profile_id],"Notifications Not Required");
+        bsp_add_next_characteristic(profile_id);
+    }
+}
+
+bool bsp_add_next_characteristic(int profile_id){
+    profile_config_t* profile_config = &bsp_gatt_server_profile_config_table[profile_id];
+    if(profile_config->characteristics_added >= bsp_gatt_server_application_profile_table[profile_id].num_characteristics){
+        ESP_LOGI(log_tags[4+profile_id],"All %d Characteristics Added",profile_config->characteristics_added);
+        return false;
+    }
+
+    // The stack reports the handle of a characteristic in its own event, so the next one is only added after that
+    characteristic_config_t* characteristic_config = &profile_config->characteristics[profile_config->characteristics_added];
+    profile_config->characteristics_added++;
+    esp_err_t err = hal_ble_add_characteristic(profile_config->service_handle,&characteristic_config->characteristic_uuid,characteristic_config->attribute_permissions,characteristic_config->characteristic_properties,&characteristic_config->attribute_value);
+    if(err != ESP_OK){
+        ESP_LOGE(log_tags[4+profile_id],"Error Adding Characteristic %d",profile_config->characteristics_added - 1);
+        return false;
+    }
+    ESP_LOGI(log_tags[4+profile_id],"Added Characteristic %d",profile_config->characteristics_added - 1);
+    return true;
+} // Add the next characteristic of a profile to its service
+
+void bsp_handle_create_service_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    esp_gatt_status_t create_status = param->create.status;
+    if(create_status == ESP_OK){
+        // The service has been created in the event ESP_GATTS_REG_EVT, now the service handle must be created and service must be started
+        // Create the service handle
+        bsp_gatt_server_profile_config_table[profile_id].service_handle = param->create.service_handle;
+        bsp_gatt_server_profile_config_table[profile_id].service_id = param->create.service_id.id.uuid.uuid.uuid16;
+        bsp_add_attribute_route(param->create.service_handle,profile_id,0,ATTRIBUTE_ROLE_SERVICE);
+        ESP_LOGI(log_tags[4+profile_id],"Profile Service Handle: %d",param->create.service_handle);
+
+        ESP_LOGI(log_tags[4+profile_id],"Attempting To Start Service: 0x%X",param->create.service_id.id.uuid.uuid.uuid16);
+        esp_err_t err = hal_ble_start_service(param->create.service_handle);
+        if(err != ESP_OK){
+            ESP_LOGE(log_tags[4+profile_id],"Error In Starting Service for service id: 0x%X with handle: %d",param->create.service_id.id.uuid.uuid.uuid16,param->create.service_handle);
+        }
 
-                // Set the service id for the profile
+        // Since the service is being created, the characteristics for the service must be created
+        // They are added one at a time, each add event adds the next one
+        bsp_gatt_server_profile_config_table[profile_id].characteristics_added = 0;
+        bsp_add_next_characteristic(profile_id);
 
-                bsp_gatt_server_application_profile_table[param->reg.app_id].service_id = service_id.id.uuid.uuid.uuid16;
+        ESP_LOGI(log_tags[4+profile_id],"Sucessfully Started Service for service id: 0x%X with handle: %d",param->create.service_id.id.uuid.uuid.uuid16,param->create.service_handle);
+        }else{
+            ESP_LOGE(log_tags[4+profile_id],"Failed To Start Service For ID: 0x%X",param->create.service_id.id.uuid.uuid.uuid16);
+        }
+}
 
-                ESP_LOGI(GATT_CALLBACK,"Created GATT Service Sucessfully for profile: %d",param->reg.app_id);
-            }else{
-                ESP_LOGE(GATT_CALLBACK,"GATT Server Registration Failed for profile: %d",param->reg.app_id);
-            }
-    }else{
-        // If it is not registartion event then it is a profile event
-        // Need to get the profile interface and call the profile event handler
-        ESP_LOGI(GATT_CALLBACK,"Calling Profile Event Handler");
-        for(int profile_no = 0; profile_no < NUM_PROFILES; profile_no++){
-            if(bsp_gatt_server_application_profile_table[profile_no].profile_interface == gatt_interface|| gatt_interface == ESP_GATT_IF_NONE){
-                // Call the profile event handler
-                ESP_LOGI(GATT_CALLBACK,"Calling Profile Event Handler for profile: %d",profile_no);
-                bsp_gatt_server_application_profile_table[profile_no].profile_event_handler(event,gatt_interface,param);
-            }
+#ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+esp_err_t bsp_create_attribute_table(esp_gatt_if_t gatt_interface,int profile_id){
+    profile_config_t* profile_config = &bsp_gatt_server_profile_config_table[profile_id];
+    uint8_t num_attributes = 0;
+
+    // The stack reads the UUIDs and values after this returns, so the entries only point to static storage
+    memset(profile_config->service_uuid,0,sizeof(profile_config->service_uuid));
+    profile_config->service_uuid[0] = bsp_profile_descriptors[profile_id].service_uuid & 0xFF;
+    profile_config->service_uuid[1] = bsp_profile_descriptors[profile_id].service_uuid >> 8;
+    profile_config->attribute_table[num_attributes++] = (esp_gatts_attr_db_t){
+        {ESP_GATT_AUTO_RSP},
+        {ESP_UUID_LEN_16,(uint8_t*)&bsp_primary_service_uuid,ESP_GATT_PERM_READ,sizeof(profile_config->service_uuid),sizeof(profile_config->service_uuid),profile_config->service_uuid}
+    };
+
+    for(int characteristic = 0; characteristic < bsp_gatt_server_application_profile_table[profile_id].num_characteristics; characteristic++){
+        characteristic_config_t* characteristic_config = &profile_config->characteristics[characteristic];
+        // Declaration, value and the CCCD of a notified characteristic, in the order of the handles the stack hands out
+        profile_config->attribute_table[num_attributes++] = (esp_gatts_attr_db_t){
+            {ESP_GATT_AUTO_RSP},
+            {ESP_UUID_LEN_16,(uint8_t*)&bsp_characteristic_declaration_uuid,ESP_GATT_PERM_READ,sizeof(esp_gatt_char_prop_t),sizeof(esp_gatt_char_prop_t),&characteristic_config->characteristic_properties}
+        };
+        // The value starts empty with its maximum length reserved, writes to a read only value are refused by the stack
+        profile_config->attribute_table[num_attributes++] = (esp_gatts_attr_db_t){
+            {ESP_GATT_AUTO_RSP},
+            {ESP_UUID_LEN_16,(uint8_t*)&characteristic_config->characteristic_uuid.uuid.uuid16,
+             hal_ble_create_permissions(true,(characteristic_config->flags & CHARACTERISTIC_FLAG_WRITABLE) != 0),
+             characteristic_config->attribute_value.attr_max_len,0,NULL}
+        };
+        if(characteristic_config->flags & CHARACTERISTIC_FLAG_NOTIFY){
+            characteristic_config->characteristic_descriptor_uuid = hal_ble_create_uuid(ESP_GATT_UUID_CHAR_CLIENT_CONFIG,ESP_UUID_LEN_16);
+            profile_config->attribute_table[num_attributes++] = (esp_gatts_attr_db_t){
+                {ESP_GATT_AUTO_RSP},
+                {ESP_UUID_LEN_16,(uint8_t*)&bsp_client_configuration_uuid,hal_ble_create_permissions(true,true),
+                 sizeof(bsp_client_configuration_value),sizeof(bsp_client_configuration_value),(uint8_t*)bsp_client_configuration_value}
+            };
         }
-        
     }
 
-}
+    ESP_LOGI(log_tags[4+profile_id],"Creating Attribute Table With %d Attributes",num_attributes);
+    return hal_ble_create_attribute_table(gatt_interface,profile_config->attribute_table,num_attributes,0);
+} // Describe the service of a profile as one attribute table answered by the stack
 
+void bsp_handle_create_attribute_table_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    (void)gatt_interface; // The services are started by handle
+    profile_t* profile = &bsp_gatt_server_application_profile_table[profile_id];
+    profile_config_t* profile_config = &bsp_gatt_server_profile_config_table[profile_id];
 
-// GATT Sever Profile Handlers
+    // The event goes to every profile of the interface, the first two bytes of the 128 bit service UUID hold the 16 bit one
+    if(param->add_attr_tab.svc_uuid.uuid.uuid16 != bsp_profile_descriptors[profile_id].service_uuid){
+        return;
+    }
+    if(param->add_attr_tab.status != ESP_GATT_OK || param->add_attr_tab.num_handle != profile_config->num_handles){
+        ESP_LOGE(log_tags[4+profile_id],"Failed To Create Attribute Table status: %d handles: %d",param->add_attr_tab.status,param->add_attr_tab.num_handle);
+        return;
+    }
 
+    // The handles are in the order of the entries of the attribute table
+    const uint16_t* handles = param->add_attr_tab.handles;
+    uint8_t attribute = 0;
+    profile_config->service_handle = handles[attribute++];
+    bsp_add_attribute_route(profile_config->service_handle,profile_id,0,ATTRIBUTE_ROLE_SERVICE);
+    for(int characteristic_no = 0; characteristic_no < profile->num_characteristics; characteristic_no++){
+        characteristic_t* characteristic = &profile->characteristics[characteristic_no];
+        attribute++; // The declaration of the characteristic
+
+        characteristic->handle = handles[attribute++];
+        bsp_add_attribute_route(characteristic->handle,profile_id,characteristic_no,ATTRIBUTE_ROLE_VALUE);
+        // The value starts empty in the attribute table, as the stored value does
+
+        if(profile_config->characteristics[characteristic_no].flags & CHARACTERISTIC_FLAG_NOTIFY){
+            profile_config->characteristics[characteristic_no].characteristic_descriptor_handle = handles[attribute++];
+            bsp_add_attribute_route(profile_config->characteristics[characteristic_no].characteristic_descriptor_handle,profile_id,characteristic_no,ATTRIBUTE_ROLE_CCCD);
+        }
+    }
+    profile_config->characteristics_added = profile->num_characteristics;
+    ESP_LOGI(log_tags[4+profile_id],"Profile Service Handle: %d",profile_config->service_handle);
 
-static void bsp_gatt_server_music_playback_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
-    switch(event){
-        case ESP_GATTS_REG_EVT:
-            // This event is done when the GATT Server is created and profiles need to be registered
-            break;
-        case ESP_GATTS_CREATE_EVT:
-            // This event is done service is created
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Create Event status: %d",param->create.status);
-            bsp_handle_create_service_request(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID,true);
+    esp_err_t err = hal_ble_start_service(profile_config->service_handle);
+    if(err != ESP_OK){
+        ESP_LOGE(log_tags[4+profile_id],"Error In Starting Service for service id: 0x%X with handle: %d",profile_config->service_id,profile_config->service_handle);
+    }
+}
+#endif
+
+void bsp_handle_read_request(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    // This event is when the client wants to execute a read operation
+    ESP_LOGI(log_tags[4+profile_id],"GATT Server Read Event handle: %d",param->read.handle);
+    if(!param->read.need_rsp){
+        // The stack has already answered the read from the attribute table
+        return;
+    }
+    // The route of the handle tells which characteristic of the profile is read and which of its attributes
+    const attribute_route_t* route = bsp_get_attribute_route(param->read.handle);
+    if(route == NULL || route->profile_id != profile_id){
+        ESP_LOGE(log_tags[4+profile_id],"Read Of Handle Not Owned By Profile: %d",param->read.handle);
+        hal_ble_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_INVALID_HANDLE,NULL);
+        return;
+    }
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[route->characteristic];
+    esp_gatt_rsp_t* rsp = &bsp_gatt_responses[param->read.conn_id % MAX_CONNECTIONS];
+    uint16_t length = 0;
+    esp_err_t err = ESP_OK;
+
+    switch(route->role){
+        case ATTRIBUTE_ROLE_VALUE:
+            // The stored value is copied straight into the response of the connection without a lock, only its used bytes are copied
+            length = bsp_read_stored_value(characteristic,rsp->attr_value.value,sizeof(rsp->attr_value.value));
+            err = bsp_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_OK,param->read.handle,length,rsp->attr_value.value);
             break;
-        case ESP_GATTS_START_EVT:
-            // The service has started so now the characteristic for each of the profiles must be created
-            esp_gatt_status_t start_status = param->start.status;
-            if(start_status == ESP_OK){
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"Music Service Started Successfully with status %d",param->start.status);
-            }else{
-                ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"Music Service Failed to Start with status %d",param->start.status);
-            }
+        case ATTRIBUTE_ROLE_CCCD:
+        {
+            // The CCCD is answered by the application too, its value is the subscription in little endian
+            const uint8_t cccd_value[2] = {characteristic->cccd_status & 0xFF,characteristic->cccd_status >> 8};
+            length = sizeof(cccd_value);
+            err = bsp_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_OK,param->read.handle,length,cccd_value);
             break;
-        case ESP_GATTS_ADD_CHAR_EVT:
-            // This event is done when a characteristic is added
-            bsp_handle_add_characteristic_request(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID,true);
+        }
+        default:
+            // The other attributes are answered by the stack, the profile holds no value for them
+            ESP_LOGE(log_tags[4+profile_id],"Read Of Attribute Without A Value: %d",param->read.handle);
+            err = hal_ble_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_READ_NOT_PERMIT,NULL);
             break;
+    }
+    if(err != ESP_OK){
+        ESP_LOGE(log_tags[4+profile_id],"Error Sending Response");
+    }
 
-        case ESP_GATTS_ADD_CHAR_DESCR_EVT:
-            // This event is done when a characteristic descriptor is added
-            bsp_handle_add_characteristic_descriptor_request(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID);
-            break;
-        break;
-        case ESP_GATTS_READ_EVT:
-            // This event is when the client wants to execute a read operation
-            bsp_handle_read_request(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID);
-            break;
-        case ESP_GATTS_WRITE_EVT:
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB, "GATT Server Write Event handle: %d", param->write.handle);
+    #ifdef DEBUG
+        // Display the current value in the attribute for debugging purposes
+        uint16_t attribute_length = 0;
+        const uint8_t* attribute_value = NULL;
 
-            // // Check CCCD value
-            if(param->write.handle == bsp_gatt_server_application_profile_table[MUSIC_PLAYBACK_PROFILE_ID].characteristic_descriptor_handle){
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB, "Write Value (Length: %d):", param->write.len);
-                for (int i = 0; i < param->write.len; i++) {
-                    ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB, "Byte[%d]: 0x%02X", i, param->write.value[i]);
-                }
-                // CCCD value has been written
-                if(param->write.len == 2){
-                    bsp_handle_client_characteristic_configuration_descriptor(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID);
+        hal_ble_get_attr_value(param->read.handle,&attribute_length,&attribute_value);
+        // Display them as characters
+        ESP_LOGI(log_tags[4+profile_id],"DEBUG Attribute Value: %s",attribute_value);
+        ESP_LOGI(log_tags[4+profile_id],"DEBUG Attribute Length: %d",attribute_length);
+        ESP_LOGI(log_tags[4+profile_id],"DEBUG Storage Value: %.*s",length,rsp->attr_value.value);
+        ESP_LOGI(log_tags[4+profile_id],"DEBUG Storage Length: %d",length);
+    #endif
+
+}
+
+void bsp_write_characteristic_data(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    // Write the data to the characteristic
+    // Check if the write is under characteristic length
+    const attribute_route_t* route = bsp_get_attribute_route(param->write.handle);
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[(route != NULL) ? route->characteristic : 0];
+
+    if(param->write.len <= characteristic->local_storage_limit){
+        // It is under the size that is allowed so it can be written without any buffering
+        if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) == pdTRUE){
+            esp_err_t err = ESP_OK;
+            esp_gatt_status_t status = ESP_GATT_OK;
+            uint8_t stored_len = 0;
+            // The stack has already stored the value in its attribute table when it answers the writes itself
+            #ifndef ATTRIBUTE_TABLE_AUTO_RESPONSE
+                err = hal_ble_set_attr_value(param->write.handle,param->write.len,param->write.value);
+                if(err != ESP_OK){
+                    ESP_LOGE(log_tags[4+profile_id],"Error Setting Attribute Value");
                 }else{
-                    ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"Invalid CCCD Value Length");
+                    ESP_LOGI(log_tags[4+profile_id],"Attribute Value Set");
                 }
-                
-            }else{
-                // Check if the write is under characteristic length
-                ESP_LOGW(MUSIC_PLAYBACK_PROFILE_CB,"Write Event - Storage Value: %s, Storage Length: %d",bsp_gatt_server_application_profile_table[MUSIC_PLAYBACK_PROFILE_ID].local_storage,bsp_gatt_server_application_profile_table[MUSIC_PLAYBACK_PROFILE_ID].local_storage_len);
-                bsp_write_characteristic_data(gatt_interface,param,MUSIC_PLAYBACK_PROFILE_ID);
+            #endif
+
+            #ifdef DEBUG
+            {
+                uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Before Storage Value: %.*s",stored_len,stored_value);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Before Storage Length: %d",stored_len);
             }
-            break;
-        case ESP_GATTS_SET_ATTR_VAL_EVT:
-            // This event is done when the attribute value is set
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Set Attribute Value Event status: %d",param->set_attr_val.status);
-            // Get the attribute value
-            uint16_t attribute_length = 0;
-            uint8_t* attribute_value = NULL;
-
-            esp_err_t err = hal_ble_get_attr_value(param->set_attr_val.attr_handle,&attribute_length,&attribute_value);
-            if(err != ESP_OK){
-                ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"Error Getting Attribute Value");
+            #endif
+            // The value is copied into a buffer of its own and then published, so a read running meanwhile still gets the old value whole
+            // The attribute table of the stack is never published, the stack rewrites it in place while the value is compared or a delta is built
+            uint8_t block = bsp_notification_pool_acquire();
+            if(block != NOTIFICATION_POOL_NO_BLOCK){
+                memcpy(bsp_notification_pool.blocks[block],param->write.value,param->write.len);
+                bsp_publish_stored_value(characteristic,bsp_notification_pool.blocks[block],block,param->write.len);
+                ESP_LOGI(log_tags[4+profile_id],"Characteristic Storage Updated");
             }else{
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"Attribute Length: %d",attribute_length);
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"Attribute Value: %s",attribute_value);
+                ESP_LOGE(log_tags[4+profile_id],"Notification Pool Exhausted, Characteristic Storage Not Updated");
+                status = ESP_GATT_NO_RESOURCES;
             }
-            break;
-        case ESP_GATTS_EXEC_WRITE_EVT:
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Execute Write Event handle: %d",param->exec_write.conn_id);
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB, "Write Event - Handle: %d, Offset: %d, Length: %d",param->write.handle, param->write.offset, param->write.len);
 
-            // TODO: Implement Buffering & Long writes and change the MTU value to be smaller.
-            if(param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC){
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"Execute Write Flag: Execute Write");
+            #ifdef DEBUG
+            {
+                // The semaphore is still held so the stored value is logged in place instead of copied onto the BTC task stack
+                uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Characteristic Value: %.*s",param->write.len,param->write.value);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Characteristic Length: %d",param->write.len);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Storage Value: %.*s",stored_len,stored_value);
+                ESP_LOGW(log_tags[4+profile_id],"DEBUG Storage Length: %d",stored_len);
             }
-            break;
-        case ESP_GATTS_MTU_EVT:
-            // This event is when the MTU is set
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server MTU Event MTU: %d",param->mtu.mtu);
-            break;
-        case ESP_GATTS_CONNECT_EVT:
-            // This evnet is when the client connects to the server
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Connect Event conn_id: %d",param->connect.conn_id);
-            // Need to implement the connection parameters based on the ESP-IDF documentation
-            // According to the the documentation the connection parameters must be initialized only on one profile
-            bsp_gatt_server_application_profile_table[MUSIC_PLAYBACK_PROFILE_ID].connection_id = param->connect.conn_id; // Saving the connection id for the profile
-            bsp_gatt_server_application_profile_table[MUSIC_PLAYBACK_PROFILE_ID].cccd_status = 0x0000; //Initializing it so that the notifications reset.
-            client_connected = true;
-            client_disconnet_timer = 0;
-            break;
-        case ESP_GATTS_DISCONNECT_EVT:
-            // This event is when the client disconnects from the server
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Disconnect Event conn_id: %d",param->disconnect.conn_id);
-            
-            // Reset the attributes for the profile
-            bsp_disconnect_profile(MUSIC_PLAYBACK_PROFILE_ID);
+            #endif
 
-            hal_ble_start_gap_server_advertisement(&gap_server_adv_params); // Restart the advertising
-            client_connected = false;
-            client_disconnet_timer = hal_ble_get_time(true); // Get the current time in milliseconds
+            // This is the write operation that is commpleted so the semaphore can be given out here
+            xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+            ESP_LOGI(log_tags[4+profile_id],"Semaphore Given");
 
-            break;
-        case ESP_GATTS_RESPONSE_EVT:
-            // This event is when the server sends a response to the client
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Response Event conn_id: %d",param->rsp.status);
-            if(param->rsp.status == ESP_GATT_OK){
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Response Event Success");
-            }else{
-                ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Response Event Failed");
-            }
-            break;
-        case ESP_GATTS_CONF_EVT:
-            // This event is when the server sends a confirmation to the client
-            ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Confirmation Event conn_id: %d",param->conf.status);
-            if(param->conf.status == ESP_GATT_OK){
-                ESP_LOGI(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Confirmation Event Success");
-            }else{
-                ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"GATT Server Confirmation Event Failed");
+            // Send a response to the client, the stack has already answered writes without response and writes to the attribute table
+            if(param->write.need_rsp){
+                err = bsp_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,status,param->write.handle,param->write.len,param->write.value);
+                if (err != ESP_OK) {
+                    ESP_LOGE(log_tags[4+profile_id], "Failed to send write response: %s", esp_err_to_name(err));
+                }
             }
-            break;
-        default:
-            ESP_LOGE(MUSIC_PLAYBACK_PROFILE_CB,"Unknown GATT Server Event: %d",event);
-            break;
+        }else{
+            ESP_LOGE(log_tags[4+profile_id],"Error Taking Semaphore");
+        }
     }
 }
 
-static void bsp_gatt_server_time_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
-    switch(event){
-        case ESP_GATTS_REG_EVT:
-            // This event is done when the GATT Server is created and profiles need to be registered
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Registration Event status: %d",param->reg.status);
+esp_err_t bsp_send_gatt_response(esp_gatt_if_t gatt_interface,uint16_t connection_id,uint32_t trans_id,esp_gatt_status_t status,uint16_t handle,uint16_t length,const uint8_t* value){
+    // Every GATT event is handled on one task, the BTC task or the worker when DEFERRED_GATT_EVENTS is defined, and the stack
+    // copies the response before this returns, so a connection beyond MAX_CONNECTIONS can safely share the response of another one
+    esp_gatt_rsp_t* rsp = &bsp_gatt_responses[connection_id % MAX_CONNECTIONS];
+    hal_ble_fill_gatt_response(rsp,handle,length,value);
+    return hal_ble_send_gatt_response(gatt_interface,connection_id,trans_id,status,rsp);
+} // Answer a request from the preallocated response of its connection
+
+void bsp_reset_attribute_routes(){
+    memset(bsp_attribute_routes,0,sizeof(bsp_attribute_routes));
+    bsp_attribute_route_base = 0;
+} // Clear the attribute route table
+
+bool bsp_add_attribute_route(uint16_t handle,int profile_id,uint8_t characteristic,attribute_role_t role){
+    // The services are created in profile order and the stack hands out their handles in one increasing range, so the first service handle starts the table
+    if(bsp_attribute_route_base == 0){
+        bsp_attribute_route_base = handle;
+    }
+    uint16_t index = handle - bsp_attribute_route_base;
+    if(handle < bsp_attribute_route_base || index >= ATTRIBUTE_ROUTE_TABLE_SIZE){
+        ESP_LOGE(log_tags[4+profile_id],"Handle %d Is Outside Of The Attribute Route Table",handle);
+        return false;
+    }
+    bsp_attribute_routes[index].profile_id = profile_id;
+    bsp_attribute_routes[index].characteristic = characteristic;
+    bsp_attribute_routes[index].role = role;
+    return true;
+} // Route an attribute handle to its profile
+
+const attribute_route_t* bsp_get_attribute_route(uint16_t handle){
+    uint16_t index = handle - bsp_attribute_route_base;
+    if(bsp_attribute_route_base == 0 || handle < bsp_attribute_route_base || index >= ATTRIBUTE_ROUTE_TABLE_SIZE || bsp_attribute_routes[index].role == ATTRIBUTE_ROLE_NONE){
+        return NULL;
+    }
+    return &bsp_attribute_routes[index];
+} // Look up the owner of an attribute handle
 
-            break;
+static bool bsp_get_service_event_profile(esp_gatts_cb_event_t event,esp_ble_gatts_cb_param_t *param,int* profile_id){
+    uint16_t service_uuid = 0;
+    uint16_t handle = 0;
+
+    switch(event){
         case ESP_GATTS_CREATE_EVT:
-            // This event is done service is created
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Create Event status: %d",param->create.status);
-            bsp_handle_create_service_request(gatt_interface,param,TIME_PROFILE_ID,false);
+            service_uuid = param->create.service_id.id.uuid.uuid.uuid16;
+            break;
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            service_uuid = param->add_attr_tab.svc_uuid.uuid.uuid16;
             break;
         case ESP_GATTS_START_EVT:
-            // The service has started so now the characteristic for each of the profiles must be created
-            esp_gatt_status_t start_status = param->start.status;
-            if(start_status == ESP_OK){
-               ESP_LOGI(TIME_PROFILE_CB,"Time Service Started Successfully with status %d",param->start.status);
-            }else{
-                ESP_LOGE(TIME_PROFILE_CB,"Time Service Failed to Start with status %d",param->start.status);
-            }
+            handle = param->start.service_handle;
             break;
         case ESP_GATTS_ADD_CHAR_EVT:
-            // This event is done when a characteristic is added
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Add Characteristic Event status: %d",param->add_char.status);
-            bsp_handle_add_characteristic_request(gatt_interface,param,TIME_PROFILE_ID,false);
-            break;
-        case ESP_GATTS_READ_EVT:
-            // This event is when the client wants to execute a read operation
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Read Event handle: %d",param->read.handle);
-            bsp_handle_read_request(gatt_interface,param,TIME_PROFILE_ID);
-            break;
-        case ESP_GATTS_WRITE_EVT:
-            // This event is when the client wants to execute a write operation
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Write Event handle: %d",param->write.handle);
-            bsp_write_characteristic_data(gatt_interface,param,TIME_PROFILE_ID);
+            handle = param->add_char.service_handle;
             break;
-        case ESP_GATTS_EXEC_WRITE_EVT:
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Execute Write Event handle: %d",param->exec_write.conn_id);
+        case ESP_GATTS_ADD_CHAR_DESCR_EVT:
+            handle = param->add_char_descr.service_handle;
             break;
-        case ESP_GATTS_MTU_EVT:
-            // This event is when the MTU is set
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server MTU Event MTU: %d",param->mtu.mtu);
+        case ESP_GATTS_SET_ATTR_VAL_EVT:
+            handle = param->set_attr_val.attr_handle;
             break;
-        case ESP_GATTS_CONNECT_EVT:
-            // This evnet is when the client connects to the server
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Connect Event conn_id: %d",param->connect.conn_id);
-            // Need to implement the connection parameters based on the ESP-IDF documentation
-            esp_ble_conn_update_params_t client_connection_parameters = {
-                .latency = 0,
-                .max_int = 0x30,
-                .min_int = 0x10,
-                .timeout = 500,
-            };
-            memcpy(client_connection_parameters.bda,param->connect.remote_bda,sizeof(esp_bd_addr_t)); // Copying the client address to the connection parameters
-            bsp_gatt_server_application_profile_table[TIME_PROFILE_ID].connection_id = param->connect.conn_id; // Saving the connection id for the profile
-            esp_err_t err = hal_ble_update_conn_params(&client_connection_parameters);
-            if(err != ESP_OK){
-                ESP_LOGE(TIME_PROFILE_CB,"Error Updating Connection Parameters: %s",esp_err_to_name(err));
-            }else{
-                ESP_LOGI(TIME_PROFILE_CB,"Connection Parameters Updated");
+        default:
+            return false;
+    }
+
+    *profile_id = -1;
+    if(service_uuid != 0){
+        // The service has no handle in the route table yet, so its profile is found by the UUID
+        for(int profile_no = 0; profile_no < NUM_PROFILES; profile_no++){
+            if(bsp_profile_descriptors[profile_no].service_uuid == service_uuid){
+                *profile_id = profile_no;
+                break;
             }
-            break;
-        case ESP_GATTS_RESPONSE_EVT:
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Response Event conn_id: %d",param->rsp.status);
-            if(param->rsp.status == ESP_GATT_OK){
-                ESP_LOGI(TIME_PROFILE_CB,"GATT Server Response Event Success");
-            }else{
-                ESP_LOGE(TIME_PROFILE_CB,"GATT Server Response Event Failed");
+        }
+    }else{
+        const attribute_route_t* route = bsp_get_attribute_route(handle);
+        if(route != NULL){
+            *profile_id = route->profile_id;
+        }
+    }
+    return true;
+} // Find the profile that owns the service of a service event
+
+#ifdef DEFERRED_GATT_EVENTS
+
+static void bsp_queue_gatt_event(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
+    if(bsp_gatt_event_queue == NULL){
+        // The worker did not start so the event is handled on the Bluetooth task as it would be without the worker
+        bsp_server_gatt_profile_handler(event,gatt_interface,param);
+        return;
+    }
+
+    gatt_event_record_t record = {.event = event,.gatt_interface = gatt_interface,.param = *param};
+
+    // Only the data behind the pointers that the handlers read is copied, the worker points the parameters at the copy
+    if(event == ESP_GATTS_WRITE_EVT && param->write.value != NULL){
+        memcpy(record.data.write_value,param->write.value,(param->write.len < GATT_EVENT_WRITE_VALUE_SIZE) ? param->write.len : GATT_EVENT_WRITE_VALUE_SIZE);
+    }else if(event == ESP_GATTS_CREAT_ATTR_TAB_EVT && param->add_attr_tab.handles != NULL){
+        memcpy(record.data.attribute_handles,param->add_attr_tab.handles,((param->add_attr_tab.num_handle < PROFILE_MAX_ATTRIBUTES) ? param->add_attr_tab.num_handle : PROFILE_MAX_ATTRIBUTES)*sizeof(uint16_t));
+    }
+
+    // The Bluetooth task never waits for the worker, an event that does not fit is dropped and reported by the worker
+    if(xQueueSend(bsp_gatt_event_queue,&record,0) != pdTRUE){
+        atomic_fetch_add(&bsp_gatt_events_dropped,1);
+        // The client would otherwise wait for the response until the transaction times out
+        if(event == ESP_GATTS_READ_EVT && param->read.need_rsp){
+            hal_ble_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_NO_RESOURCES,NULL);
+        }else if(event == ESP_GATTS_WRITE_EVT && param->write.need_rsp){
+            hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_NO_RESOURCES,NULL);
+        }
+    }
+} // Copy a GATT event into the queue of the worker
+
+void bsp_gatt_event_worker_task(void *param){
+    (void)param; // The worker takes every event from the one GATT event queue
+    gatt_event_record_t record;
+    uint32_t dropped_reported = 0;
+    #ifdef TESTING
+        uint32_t max_duration_reported = 0;
+        unsigned int btc_stack_high_water_mark_reported = ~0u;
+    #endif
+
+    while(1){
+        if(xQueueReceive(bsp_gatt_event_queue,&record,portMAX_DELAY) != pdTRUE){
+            continue;
+        }
+
+        // The buffers of the stack are gone by now so the parameters are pointed at the copies in the record
+        if(record.event == ESP_GATTS_WRITE_EVT){
+            record.param.write.value = record.data.write_value;
+        }else if(record.event == ESP_GATTS_CREAT_ATTR_TAB_EVT){
+            record.param.add_attr_tab.handles = record.data.attribute_handles;
+        }else if(record.event == ESP_GATTS_CONF_EVT){
+            record.param.conf.value = NULL; // The indicated value is not copied and the handlers do not read it
+        }
+        bsp_server_gatt_profile_handler(record.event,record.gatt_interface,&record.param);
+
+        uint32_t dropped = atomic_load(&bsp_gatt_events_dropped);
+        if(dropped < dropped_reported){
+            dropped_reported = 0; // The statistics have been reset
+        }
+        if(dropped != dropped_reported){
+            ESP_LOGE(GATT_CALLBACK,"GATT Event Queue Full, %lu Events Dropped",(unsigned long)(dropped - dropped_reported));
+            dropped_reported = dropped;
+        }
+
+        #ifdef TESTING
+            // The callback must not log, so a new worst case and a new lowest stack mark of the BTC task are logged here
+            uint32_t max_duration = atomic_load(&bsp_gatt_callback_max_duration);
+            if(max_duration != max_duration_reported){
+                ESP_LOGW(GATT_CALLBACK,"TESTING GATT Callback Max Duration: %lu us after event %d",(unsigned long)max_duration,atomic_load(&bsp_gatt_callback_max_duration_event));
+                max_duration_reported = max_duration;
             }
-            break;
-        case ESP_GATTS_DISCONNECT_EVT:
-            // This event is when the client disconnects from the server
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Disconnect Event conn_id: %d",param->disconnect.conn_id);
+            unsigned int btc_stack_high_water_mark = atomic_load(&bsp_btc_stack_high_water_mark);
+            if(btc_stack_high_water_mark != btc_stack_high_water_mark_reported){
+                ESP_LOGW(GATT_CALLBACK,"TESTING BTC Stack High Water Mark: %u bytes after event %d",btc_stack_high_water_mark,atomic_load(&bsp_btc_stack_high_water_mark_event));
+                btc_stack_high_water_mark_reported = btc_stack_high_water_mark;
+            }
+            ESP_LOGW(GATT_CALLBACK,"TESTING GATT Worker Stack High Water Mark: %u bytes",uxTaskGetStackHighWaterMark(NULL));
+        #endif
+    }
+} // Handle the GATT events queued by the Bluetooth callback
 
-             // Reset the attributes for the profile
-            bsp_gatt_server_application_profile_table[TIME_PROFILE_ID].connection_id = 0;
-            bsp_gatt_server_application_profile_table[TIME_PROFILE_ID].cccd_status = 0x0000;
-            bsp_gatt_server_application_profile_table[TIME_PROFILE_ID].characteristic_handle = 0;
-            bsp_gatt_server_application_profile_table[TIME_PROFILE_ID].characteristic_descriptor_handle = 0;
+void bsp_start_gatt_event_worker(){
+    if(bsp_gatt_event_worker_handle != NULL){
+        // The worker of an earlier initialization is still running and handles the events of the new server table
+        return;
+    }
 
-            hal_ble_start_gap_server_advertisement(&gap_server_adv_params); // Restart the advertising
-            break;
-        case ESP_GATTS_ADD_CHAR_DESCR_EVT:
-            // This event is done when a characteristic descriptor is added
-            bsp_handle_add_characteristic_descriptor_request(gatt_interface,param,TIME_PROFILE_ID);
-            break;
+    bsp_gatt_event_queue = xQueueCreateStatic(GATT_EVENT_QUEUE_LENGTH,sizeof(gatt_event_record_t),bsp_gatt_event_queue_buffer,&bsp_gatt_event_queue_storage);
+    if(bsp_gatt_event_queue == NULL){
+        ESP_LOGE(GATT_INIT,"Error Creating GATT Event Queue");
+        return;
+    }
 
-        case ESP_GATTS_SET_ATTR_VAL_EVT:
-            ESP_LOGI(TIME_PROFILE_CB,"GATT Server Set Attribute Value Event status: %d",param->set_attr_val.status);
-            break;
-        default:
-            ESP_LOGE(TIME_PROFILE_CB,"Unknown GATT Server Event: %d",event);
-            break;
+    // The worker runs next to the notification scheduler, its stack is static so it does not come from the heap
+    bsp_gatt_event_worker_handle = xTaskCreateStaticPinnedToCore(
+        bsp_gatt_event_worker_task,
+        "GATT Worker",
+        GATT_EVENT_WORKER_STACK_SIZE,
+        NULL,
+        5,
+        bsp_gatt_event_worker_stack,
+        &bsp_gatt_event_worker_tcb,
+        1
+    );
+    if(bsp_gatt_event_worker_handle != NULL){
+        ESP_LOGI(GATT_INIT,"GATT Event Worker Started");
+    }else{
+        bsp_gatt_event_queue = NULL; // The callback handles the events itself
+        ESP_LOGE(GATT_INIT,"Error Starting GATT Event Worker, Events Are Handled On The Bluetooth Task");
     }
 }
 
-static void bsp_gatt_server_todo_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
-         switch(event){
-        case ESP_GATTS_REG_EVT:
+#endif
+
+static void bsp_server_gatt_callback(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
+    uint64_t start_time = hal_ble_get_time(false);
+
+    #ifdef DEFERRED_GATT_EVENTS
+        bsp_queue_gatt_event(event,gatt_interface,param);
+    #else
+        bsp_server_gatt_profile_handler(event,gatt_interface,param);
+    #endif
+
+    uint64_t duration = hal_ble_get_time(false) - start_time;
+    uint32_t duration_us = (duration > UINT32_MAX) ? UINT32_MAX : (uint32_t)duration;
+    atomic_fetch_add(&bsp_gatt_callback_events,1);
+    if(duration_us > atomic_load(&bsp_gatt_callback_max_duration)){
+        // Only the Bluetooth task writes the maximum so it needs no compare and swap
+        atomic_store(&bsp_gatt_callback_max_duration_event,event);
+        atomic_store(&bsp_gatt_callback_max_duration,duration_us);
+        #if defined(TESTING) && !defined(DEFERRED_GATT_EVENTS)
+            ESP_LOGW(GATT_CALLBACK,"TESTING GATT Callback Max Duration: %lu us after event %d",(unsigned long)duration_us,event);
+        #endif
+    }
+
+    #ifdef TESTING
+        // Every GATT callback runs on the BTC task, so the lowest mark seen here is the deepest the callbacks have gone
+        unsigned int stack_high_water_mark = uxTaskGetStackHighWaterMark(NULL);
+        if(stack_high_water_mark < atomic_load(&bsp_btc_stack_high_water_mark)){
+            // Only the Bluetooth task writes the mark so it needs no compare and swap either
+            atomic_store(&bsp_btc_stack_high_water_mark_event,event);
+            atomic_store(&bsp_btc_stack_high_water_mark,stack_high_water_mark);
+            #ifndef DEFERRED_GATT_EVENTS
+                ESP_LOGW(GATT_CALLBACK,"TESTING BTC Stack High Water Mark: %u bytes after event %d",stack_high_water_mark,event);
+            #endif
+        }
+    #endif
+} // Handle or queue a GATT event and record how long the Bluetooth task was held
+
+void bsp_get_gatt_callback_stats(gatt_callback_stats_t* stats){
+    stats->max_duration = atomic_load(&bsp_gatt_callback_max_duration);
+    stats->max_duration_event = (esp_gatts_cb_event_t)atomic_load(&bsp_gatt_callback_max_duration_event);
+    stats->events = atomic_load(&bsp_gatt_callback_events);
+    #ifdef DEFERRED_GATT_EVENTS
+        stats->dropped_events = atomic_load(&bsp_gatt_events_dropped);
+    #else
+        stats->dropped_events = 0;
+    #endif
+} // Copy the time the Bluetooth task has spent in the GATT callback
+
+void bsp_reset_gatt_callback_stats(){
+    atomic_store(&bsp_gatt_callback_max_duration,0);
+    atomic_store(&bsp_gatt_callback_max_duration_event,0);
+    atomic_store(&bsp_gatt_callback_events,0);
+    #ifdef DEFERRED_GATT_EVENTS
+        atomic_store(&bsp_gatt_events_dropped,0);
+    #endif
+} // Clear the time the Bluetooth task has spent in the GATT callback
+
+void bsp_dump_gatt_callback_stats(){
+    gatt_callback_stats_t stats;
+    bsp_get_gatt_callback_stats(&stats);
+    ESP_LOGI(GATT_CALLBACK,"GATT Callback Max Duration: %lu us Event: %d Events: %lu Dropped: %lu",(unsigned long)stats.max_duration,stats.max_duration_event,(unsigned long)stats.events,(unsigned long)stats.dropped_events);
+} // Log the worst case GATT callback duration
+
+static void bsp_server_gap_profile_handler(esp_gap_ble_cb_event_t event,esp_ble_gap_cb_param_t *param){
+    #ifdef TESTING
+        // Only the first start is the boot, advertising is restarted on every disconnection
+        if(event == ESP_GAP_BLE_ADV_START_COMPLETE_EVT && !bsp_advertising_start_reported){
+            bsp_advertising_start_reported = true;
+            uint64_t current_time = hal_ble_get_time(false);
+            ESP_LOGW(GAP_CALLBACK,"TESTING Advertising Started With %d GATT Applications: %llu us After Boot, %llu us After Initialization, status: %d",
+                NUM_GATT_APPLICATIONS,current_time,current_time - bsp_server_init_time,param->adv_start_cmpl.status);
+        }
+    #endif
+}
+
+static void bsp_server_gatt_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
+    int profile_id;
+
+    if(event == ESP_GATTS_REG_EVT){
             // This event is done when the GATT Server is created and profiles need to be registered
-            break;
-        case ESP_GATTS_CREATE_EVT:
-            // This event is done service is created
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Create Event status: %d",param->create.status);
-            bsp_handle_create_service_request(gatt_interface,param,TODO_PROFILE_ID,false);
-            break;
-        case ESP_GATTS_START_EVT:
-            // The service has started so now the characteristic for each of the profiles must be created
-            esp_gatt_status_t start_status = param->start.status;
-            if(start_status == ESP_OK){
-                ESP_LOGI(TODO_PROFILE_CB,"Todo Service Started Successfully with status %d",param->start.status);
-            }else{
-               ESP_LOGE(TODO_PROFILE_CB,"Todo Service Failed to Start with status %d",param->start.status);
-            }
-            break;
-        case ESP_GATTS_ADD_CHAR_EVT:
-            // This event is done when a characteristic is added
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Add Characteristic Event status: %d",param->add_char.status);
+            ESP_LOGI(GATT_CALLBACK,"GATT Server Registration Event status: %d",param->reg.status);
+            // need to make sure that the status of the registration is successful
+            esp_gatt_status_t reg_status =  param->reg.status;
+            if(reg_status == ESP_OK){
+                ESP_LOGI(GATT_CALLBACK,"GATT Server Registration Successful");
+                #ifdef SINGLE_GATT_APPLICATION
+                    // The one application hosts every service, so the services of all profiles are created under its interface
+                    int first_profile = 0;
+                    int last_profile = NUM_PROFILES - 1;
+                #else
+                    int first_profile = param->reg.app_id;
+                    int last_profile = param->reg.app_id;
+                #endif
+                for(int profile_id = first_profile; profile_id <= last_profile; profile_id++){
+                    // Now we need to get the application profile and set the interface
+                    ESP_LOGI(GATT_CALLBACK,"Setting registration for profile: %d",profile_id);
+
+                    // Set the specific profile interface
+                    bsp_gatt_server_application_profile_table[profile_id].profile_interface = gatt_interface;
+                    ESP_LOGI(GATT_CALLBACK,"Assigned GATT Interface for profile: %d",profile_id);
+                    #ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+                        // Create the service and its characteristics in one request, the stack then answers the reads of the profile
+                        esp_err_t err = bsp_create_attribute_table(gatt_interface,profile_id);
+                    #else
+                        // Create the service for the profile
+                        esp_gatt_srvc_id_t service_id = hal_ble_create_service_id(bsp_profile_descriptors[profile_id].service_uuid);
+                        esp_err_t err = hal_ble_create_service(gatt_interface,&service_id,bsp_gatt_server_profile_config_table[profile_id].num_handles);
+                    #endif
+                    if(err != ESP_OK){
+                        ESP_LOGE(GATT_CALLBACK,"Error Creating Service for profile: %d",profile_id);
+                        continue;
+                    }
+                    ESP_LOGI(GATT_CALLBACK,"Profile Create Service for profile: %d",profile_id);
 
-            bsp_handle_add_characteristic_request(gatt_interface,param,TODO_PROFILE_ID,false);
-            break;
+                    // Set the service id for the profile
 
-        case ESP_GATTS_ADD_CHAR_DESCR_EVT:
-            // This event is done when a characteristic descriptor is added
-            bsp_handle_add_characteristic_descriptor_request(gatt_interface,param,TODO_PROFILE_ID);
-            break;
-        case ESP_GATTS_READ_EVT:
-            // This event is when the client wants to execute a read operation
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Read Event handle: %d",param->read.handle);
-            bsp_handle_read_request(gatt_interface,param,TODO_PROFILE_ID);
-            break;
-        case ESP_GATTS_WRITE_EVT:
-            // This event is when the client wants to execute a write operation
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Write Event handle: %d",param->write.handle);
-            // // Check CCCD value
-            if(param->write.handle == bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].characteristic_descriptor_handle){
-                ESP_LOGI(MUSIC_PROFILE_CB, "Write Value (Length: %d):", param->write.len);
-                for (int i = 0; i < param->write.len; i++) {
-                    // ESP_LOGI(TODO_PROFILE_ID, "Byte[%d]: 0x%02X", i, param->write.value[i]);
-                }
-                // CCCD value has been written
-                if(param->write.len == 2){
-                    bsp_handle_client_characteristic_configuration_descriptor(gatt_interface,param,TODO_PROFILE_ID);
-                }else{
-                    ESP_LOGE(MUSIC_PROFILE_CB,"Invalid CCCD Value Length");
+                    bsp_gatt_server_profile_config_table[profile_id].service_id = bsp_profile_descriptors[profile_id].service_uuid;
+
+                    ESP_LOGI(GATT_CALLBACK,"Created GATT Service Sucessfully for profile: %d",profile_id);
                 }
-                
-            }else{
-                // Check if the write is under characteristic length
-                bsp_write_characteristic_data(gatt_interface,param,TODO_PROFILE_ID);
-            }
-            break;
-        case ESP_GATTS_EXEC_WRITE_EVT:
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Execute Write Event handle: %d",param->exec_write.conn_id);
-            break;
-        case ESP_GATTS_MTU_EVT:
-            // This event is when the MTU is set
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server MTU Event MTU: %d",param->mtu.mtu);
-            break;
-        case ESP_GATTS_CONNECT_EVT:
-            // This evnet is when the client connects to the server
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Connect Event conn_id: %d",param->connect.conn_id);
-            // Need to implement the connection parameters based on the ESP-IDF documentation
-            esp_ble_conn_update_params_t client_connection_parameters = hal_ble_create_conn_params(0x10,0x30,0,500);
-            memcpy(client_connection_parameters.bda,param->connect.remote_bda,sizeof(esp_bd_addr_t)); // Copying the client address to the connection parameters
-            bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].connection_id = param->connect.conn_id; // Saving the connection id for the profile
-
-            esp_err_t err = hal_ble_update_conn_params(&client_connection_parameters);
-            if(err != ESP_OK){
-                ESP_LOGE(TODO_PROFILE_CB,"Error Updating Connection Parameters: %s",esp_err_to_name(err));
             }else{
-                ESP_LOGI(TODO_PROFILE_CB,"Connection Parameters Updated");
+                ESP_LOGE(GATT_CALLBACK,"GATT Server Registration Failed for profile: %d",param->reg.app_id);
             }
-            break;
-        case ESP_GATTS_RESPONSE_EVT:
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Response Event conn_id: %d",param->rsp.status);
-            if(param->rsp.status == ESP_GATT_OK){
-                ESP_LOGI(TODO_PROFILE_CB,"GATT Server Response Event Success");
-            }else{
-                ESP_LOGE(TODO_PROFILE_CB,"GATT Server Response Event Failed");
+    }else if(event == ESP_GATTS_READ_EVT || event == ESP_GATTS_WRITE_EVT){
+        // Reads and writes carry the attribute handle, so only the profile that owns it is called
+        uint16_t handle = (event == ESP_GATTS_READ_EVT) ? param->read.handle : param->write.handle;
+        const attribute_route_t* route = bsp_get_attribute_route(handle);
+        if(route != NULL){
+            bsp_gatt_server_profile_event_handler(event,gatt_interface,param,route->profile_id);
+            return;
+        }
+        ESP_LOGE(GATT_CALLBACK,"No Profile Owns Handle: %d",handle);
+        // The stack waits for the response of the application so the client is told the handle is invalid
+        if(event == ESP_GATTS_READ_EVT && param->read.need_rsp){
+            hal_ble_send_gatt_response(gatt_interface,param->read.conn_id,param->read.trans_id,ESP_GATT_INVALID_HANDLE,NULL);
+        }else if(event == ESP_GATTS_WRITE_EVT && param->write.need_rsp){
+            hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_INVALID_HANDLE,NULL);
+        }
+    }else if(event == ESP_GATTS_CONF_EVT){
+        // Confirmations carry the handle of the characteristic that was sent, so only the profile that owns it is called
+        const attribute_route_t* route = bsp_get_attribute_route(param->conf.handle);
+        if(route != NULL){
+            bsp_gatt_server_profile_event_handler(event,gatt_interface,param,route->profile_id);
+        }else{
+            ESP_LOGE(GATT_CALLBACK,"No Profile Owns Confirmed Handle: %d",param->conf.handle);
+        }
+    }else if(bsp_get_service_event_profile(event,param,&profile_id)){
+        // Service events carry the UUID or a handle of the service, so only its profile is called even when one interface hosts every service
+        if(profile_id >= 0){
+            bsp_gatt_server_profile_event_handler(event,gatt_interface,param,profile_id);
+        }else{
+            ESP_LOGE(GATT_CALLBACK,"No Profile Owns The Service Of Event: %d",event);
+        }
+    }else{
+        // If it is not registartion event then it is a profile event
+        // Events without an attribute handle are for every profile of the interface
+        ESP_LOGI(GATT_CALLBACK,"Calling Profile Event Handler");
+        for(int profile_no = 0; profile_no < NUM_PROFILES; profile_no++){
+            if(bsp_gatt_server_application_profile_table[profile_no].profile_interface == gatt_interface|| gatt_interface == ESP_GATT_IF_NONE){
+                // Call the profile event handler
+                ESP_LOGI(GATT_CALLBACK,"Calling Profile Event Handler for profile: %d",profile_no);
+                bsp_gatt_server_profile_event_handler(event,gatt_interface,param,profile_no);
             }
-            break;
-        case ESP_GATTS_DISCONNECT_EVT:
-            // This event is when the client disconnects from the server
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Disconnect Event conn_id: %d",param->disconnect.conn_id);
-            
-            // Reset the attributes for the profile
-            bsp_disconnect_profile(TODO_PROFILE_ID);
-            // Now that the profile has been disconnected, the advertising can be started again
-            hal_ble_start_gap_server_advertisement(&gap_server_adv_params);
-            break;
-        case ESP_GATTS_SET_ATTR_VAL_EVT:
-            ESP_LOGI(TODO_PROFILE_CB,"GATT Server Set Attribute Value Event status: %d",param->set_attr_val.status);
-            break;
-        default:
-            ESP_LOGE(TODO_PROFILE_CB,"Unknown GATT Server Event: %d",event);
-            break;
+        }
+        
     }
 }
 
-static void bsp_gatt_server_music_profile_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param){
+
+// GATT Sever Profile Handlers
+
+
+static void bsp_gatt_server_profile_event_handler(esp_gatts_cb_event_t event,esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
+    uint8_t flags = bsp_profile_descriptors[profile_id].flags;
+
     switch(event){
         case ESP_GATTS_REG_EVT:
-            // This event is done when the GATT Server is created and profiles need to be registered
-
+            // This event is done when the GATT Server is created and profiles need to be registered, the service is created by the server handler
             break;
         case ESP_GATTS_CREATE_EVT:
             // This event is done service is created
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Create Event status: %d",param->create.status);
-            bsp_handle_create_service_request(gatt_interface,param,MUSIC_PROFILE_ID,true);
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Create Event status: %d",param->create.status);
+            bsp_handle_create_service_request(gatt_interface,param,profile_id);
             break;
         case ESP_GATTS_START_EVT:
             // The service has started so now the characteristic for each of the profiles must be created
-            esp_gatt_status_t start_status = param->start.status;
-            if(start_status == ESP_OK){
-                ESP_LOGI(MUSIC_PROFILE_CB,"Music Service Started Successfully with status %d",param->start.status);
+            if(param->start.status == ESP_OK){
+                ESP_LOGI(log_tags[4+profile_id],"Service Started Successfully with status %d",param->start.status);
+                #ifdef TESTING
+                    // The server is ready once every service has started, the heap gone since the initialization started is what the stack took
+                    if(++bsp_services_started == NUM_PROFILES){
+                        uint64_t current_time = hal_ble_get_time(false);
+                        ESP_LOGW(GATT_INIT,"TESTING All Services Started With %d GATT Applications: %llu us After Boot, %llu us After Initialization, Stack Heap Usage: %lu bytes",
+                            NUM_GATT_APPLICATIONS,current_time,current_time - bsp_server_init_time,(unsigned long)(bsp_server_init_free_heap - hal_get_free_heap_size()));
+                    }
+                #endif
             }else{
-                ESP_LOGE(MUSIC_PROFILE_CB,"Music Service Failed to Start with status %d",param->start.status);
+                ESP_LOGE(log_tags[4+profile_id],"Service Failed to Start with status %d",param->start.status);
             }
             break;
         case ESP_GATTS_ADD_CHAR_EVT:
             // This event is done when a characteristic is added
-            bsp_handle_add_characteristic_request(gatt_interface,param,MUSIC_PROFILE_ID,true);
+            bsp_handle_add_characteristic_request(gatt_interface,param,profile_id);
             break;
-
         case ESP_GATTS_ADD_CHAR_DESCR_EVT:
             // This event is done when a characteristic descriptor is added
-            bsp_handle_add_characteristic_descriptor_request(gatt_interface,param,MUSIC_PROFILE_ID);
+            bsp_handle_add_characteristic_descriptor_request(gatt_interface,param,profile_id);
             break;
-        break;
+        #ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            // This event is done when the attribute table of a service has been created
+            bsp_handle_create_attribute_table_request(gatt_interface,param,profile_id);
+            break;
+        #endif
         case ESP_GATTS_READ_EVT:
             // This event is when the client wants to execute a read operation
-            bsp_handle_read_request(gatt_interface,param,MUSIC_PROFILE_ID);
+            bsp_handle_read_request(gatt_interface,param,profile_id);
             break;
         case ESP_GATTS_WRITE_EVT:
-            ESP_LOGI(MUSIC_PROFILE_CB, "GATT Server Write Event handle: %d", param->write.handle);
-
-            // // Check CCCD value
-            if(param->write.handle == bsp_gatt_server_application_profile_table[MUSIC_PROFILE_ID].characteristic_descriptor_handle){
-                ESP_LOGI(MUSIC_PROFILE_CB, "Write Value (Length: %d):", param->write.len);
-                for (int i = 0; i < param->write.len; i++) {
-                    ESP_LOGI(MUSIC_PROFILE_CB, "Byte[%d]: 0x%02X", i, param->write.value[i]);
-                }
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Write Event handle: %d",param->write.handle);
+            const attribute_route_t* route = bsp_get_attribute_route(param->write.handle);
+            if(route != NULL && route->role == ATTRIBUTE_ROLE_CCCD){
                 // CCCD value has been written
                 if(param->write.len == 2){
-                    bsp_handle_client_characteristic_configuration_descriptor(gatt_interface,param,MUSIC_PROFILE_ID);
+                    bsp_handle_client_characteristic_configuration_descriptor(gatt_interface,param,profile_id);
                 }else{
-                    ESP_LOGE(MUSIC_PROFILE_CB,"Invalid CCCD Value Length");
+                    ESP_LOGE(log_tags[4+profile_id],"Invalid CCCD Value Length");
                 }
-                
+            }else if(route != NULL && (bsp_gatt_server_profile_config_table[profile_id].characteristics[route->characteristic].flags & CHARACTERISTIC_FLAG_WRITABLE)){
+                bsp_write_characteristic_data(gatt_interface,param,profile_id);
             }else{
-                // Check if the write is under characteristic length
-                ESP_LOGW(MUSIC_PROFILE_CB,"Write Event - Storage Value: %s, Storage Length: %d",bsp_gatt_server_application_profile_table[MUSIC_PROFILE_ID].local_storage,bsp_gatt_server_application_profile_table[MUSIC_PROFILE_ID].local_storage_len);
-                bsp_write_characteristic_data(gatt_interface,param,MUSIC_PROFILE_ID);
+                ESP_LOGE(log_tags[4+profile_id],"Invalid Write To Read Only Characteristic");
+                if(param->write.need_rsp){
+                    hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_WRITE_NOT_PERMIT,NULL);
+                }
             }
             break;
         case ESP_GATTS_SET_ATTR_VAL_EVT:
             // This event is done when the attribute value is set
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Set Attribute Value Event status: %d",param->set_attr_val.status);
-            // Get the attribute value
-            uint16_t attribute_length = 0;
-            uint8_t* attribute_value = NULL;
-
-            esp_err_t err = hal_ble_get_attr_value(param->set_attr_val.attr_handle,&attribute_length,&attribute_value);
-            if(err != ESP_OK){
-                ESP_LOGE(MUSIC_PROFILE_CB,"Error Getting Attribute Value");
-            }else{
-                ESP_LOGI(MUSIC_PROFILE_CB,"Attribute Length: %d",attribute_length);
-                ESP_LOGI(MUSIC_PROFILE_CB,"Attribute Value: %s",attribute_value);
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Set Attribute Value Event status: %d",param->set_attr_val.status);
+            #ifdef DEBUG
+            {
+                uint16_t attribute_length = 0;
+                const uint8_t* attribute_value = NULL;
+
+                if(hal_ble_get_attr_value(param->set_attr_val.attr_handle,&attribute_length,&attribute_value) != ESP_OK){
+                    ESP_LOGE(log_tags[4+profile_id],"Error Getting Attribute Value");
+                }else{
+                    ESP_LOGI(log_tags[4+profile_id],"Attribute Length: %d",attribute_length);
+                }
             }
+            #endif
             break;
         case ESP_GATTS_EXEC_WRITE_EVT:
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Execute Write Event handle: %d",param->exec_write.conn_id);
-            ESP_LOGI(MUSIC_PROFILE_CB, "Write Event - Handle: %d, Offset: %d, Length: %d",param->write.handle, param->write.offset, param->write.len);
-
             // TODO: Implement Buffering & Long writes and change the MTU value to be smaller.
-            if(param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC){
-                ESP_LOGI(MUSIC_PROFILE_CB,"Execute Write Flag: Execute Write");
-            }
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Execute Write Event conn_id: %d",param->exec_write.conn_id);
             break;
         case ESP_GATTS_MTU_EVT:
             // This event is when the MTU is set
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server MTU Event MTU: %d",param->mtu.mtu);
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server MTU Event MTU: %d",param->mtu.mtu);
+            #ifdef NOTIFICATION_BATCHING
+                if(flags & PROFILE_FLAG_BATCH){
+                    bsp_notification_batch.mtu = param->mtu.mtu; // The batch is sized to fit in one notification
+                }
+            #endif
             break;
         case ESP_GATTS_CONNECT_EVT:
             // This evnet is when the client connects to the server
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Connect Event conn_id: %d",param->connect.conn_id);
-            // Need to implement the connection parameters based on the ESP-IDF documentation
-            // According to the the documentation the connection parameters must be initialized only on one profile
-            bsp_gatt_server_application_profile_table[MUSIC_PROFILE_ID].connection_id = param->connect.conn_id; // Saving the connection id for the profile
-            bsp_gatt_server_application_profile_table[MUSIC_PROFILE_ID].cccd_status = 0x0000; //Initializing it so that the notifications reset.
-            client_connected = true;
-            client_disconnet_timer = 0;
-            // Update the connection parameters
-
-                // err = esp_ble_gap_update_conn_params(&conn_params); // Update the connection parameters
-
-                // #ifdef DEBUG
-                //     if(err != ESP_OK){
-                //         ESP_LOGE("Power Management","Error Updating Connection Parameters: %s",esp_err_to_name(err));
-                //     }else{
-                //         ESP_LOGI("Power Management","Connection Parameters Updated");
-                //     }
-                // #endif
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Connect Event conn_id: %d",param->connect.conn_id);
+            bsp_gatt_server_application_profile_table[profile_id].connection_id = param->connect.conn_id; // Saving the connection id for the profile
+            for(int characteristic = 0; characteristic < bsp_gatt_server_application_profile_table[profile_id].num_characteristics; characteristic++){
+                bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].cccd_status = 0x0000; //Initializing it so that the notifications reset.
+            }
+            #ifdef NOTIFICATION_BATCHING
+                if(flags & PROFILE_FLAG_BATCH){
+                    bsp_notification_batch.mtu = DEFAULT_ATT_MTU;
+                }
+            #endif
+            if(flags & PROFILE_FLAG_CONN_PARAMS){
+                esp_ble_conn_update_params_t client_connection_parameters = hal_ble_create_conn_params(0x10,0x30,0,500);
+                memcpy(client_connection_parameters.bda,param->connect.remote_bda,sizeof(esp_bd_addr_t)); // Copying the client address to the connection parameters
+                esp_err_t err = hal_ble_update_conn_params(&client_connection_parameters);
+                if(err != ESP_OK){
+                    ESP_LOGE(log_tags[4+profile_id],"Error Updating Connection Parameters: %s",esp_err_to_name(err));
+                }else{
+                    ESP_LOGI(log_tags[4+profile_id],"Connection Parameters Updated");
+                }
+            }
+            if(flags & PROFILE_FLAG_PRESENCE){
+                client_connected = true;
+                client_disconnet_timer = 0;
+            }
             break;
         case ESP_GATTS_DISCONNECT_EVT:
             // This event is when the client disconnects from the server
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Disconnect Event conn_id: %d",param->disconnect.conn_id);
-            
-            // Reset the attributes for the profile
-            bsp_disconnect_profile(MUSIC_PROFILE_ID);
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Disconnect Event conn_id: %d",param->disconnect.conn_id);
 
-            hal_ble_start_gap_server_advertisement(&gap_server_adv_params);
-            client_connected = false;
-            client_disconnet_timer = hal_ble_get_time(true); // Get the current time in milliseconds
+            // Reset the attributes for the profile
+            bsp_disconnect_profile(profile_id);
 
+            if(flags & PROFILE_FLAG_ADVERTISE){
+                hal_ble_start_gap_server_advertisement(&gap_server_adv_params); // Restart the advertising
+            }
+            if(flags & PROFILE_FLAG_PRESENCE){
+                client_connected = false;
+                client_disconnet_timer = hal_ble_get_time(true); // Get the current time in milliseconds
+            }
             break;
         case ESP_GATTS_RESPONSE_EVT:
             // This event is when the server sends a response to the client
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Response Event conn_id: %d",param->rsp.status);
             if(param->rsp.status == ESP_GATT_OK){
-                ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Response Event Success");
+                ESP_LOGI(log_tags[4+profile_id],"GATT Server Response Event Success");
             }else{
-                ESP_LOGE(MUSIC_PROFILE_CB,"GATT Server Response Event Failed");
+                ESP_LOGE(log_tags[4+profile_id],"GATT Server Response Event Failed with status: %d",param->rsp.status);
             }
             break;
         case ESP_GATTS_CONF_EVT:
-            // This event is when the server sends a confirmation to the client
-            ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Confirmation Event conn_id: %d",param->conf.status);
-            if(param->conf.status == ESP_GATT_OK){
-                ESP_LOGI(MUSIC_PROFILE_CB,"GATT Server Confirmation Event Success");
-            }else{
-                ESP_LOGE(MUSIC_PROFILE_CB,"GATT Server Confirmation Event Failed");
-            }
+            // This event is when a notification has been sent or the client has confirmed an indication
+            ESP_LOGI(log_tags[4+profile_id],"GATT Server Confirmation Event conn_id: %d",param->conf.conn_id);
+            // The event is routed by handle to the owning profile, which takes it only if it matches its pending indication
+            bsp_handle_indication_confirmation(gatt_interface,param,profile_id);
+            break;
+        case ESP_GATTS_CONGEST_EVT:
+            // This event is when the controller buffers of the connection fill up or are freed again
+            bsp_handle_congestion_event(gatt_interface,param,profile_id);
             break;
         default:
-            ESP_LOGE(MUSIC_PROFILE_CB,"Unknown GATT Server Event: %d",event);
+            ESP_LOGE(log_tags[4+profile_id],"Unknown GATT Server Event: %d",event);
             break;
     }
-
 }
 
 void bsp_disconnect_profile(int profile_id){
     // Disconnect the profile
-    bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].connection_id = 0;
-    bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].cccd_status = 0x0000;
-    bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].characteristic_handle = 0;
-    bsp_gatt_server_application_profile_table[TODO_PROFILE_ID].characteristic_descriptor_handle = 0;
+    if(bsp_gatt_server_application_profile_table[profile_id].connection_id < MAX_CONNECTIONS){
+        atomic_store(&bsp_connection_congested[bsp_gatt_server_application_profile_table[profile_id].connection_id],false);
+        atomic_store(&bsp_connection_indicating_profile[bsp_gatt_server_application_profile_table[profile_id].connection_id],0);
+    }
+    // An unconfirmed indication stays in flight and is sent again once the client subscribes
+    if(bsp_gatt_server_application_profile_table[profile_id].notification_indication.timeout_timer != NULL){
+        xTimerStop(bsp_gatt_server_application_profile_table[profile_id].notification_indication.timeout_timer,0);
+    }
+    atomic_store(&bsp_gatt_server_application_profile_table[profile_id].notification_indication.state,INDICATION_IDLE);
+    bsp_gatt_server_application_profile_table[profile_id].notification_indication.connection_id = 0xFFFF; // Set again when the indication is resent
+    bsp_gatt_server_application_profile_table[profile_id].notification_indication.handle = 0;
+    bsp_gatt_server_application_profile_table[profile_id].connection_id = 0;
+    for(int characteristic = 0; characteristic < bsp_gatt_server_application_profile_table[profile_id].num_characteristics; characteristic++){
+        atomic_store(&bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].delta_synced,false);
+        bsp_gatt_server_application_profile_table[profile_id].characteristics[characteristic].cccd_status = 0x0000;
+    }
 }
 
 static void bsp_handle_client_characteristic_configuration_descriptor(esp_gatt_if_t gatt_interface,esp_ble_gatts_cb_param_t *param,int profile_id){
     // Implement the CCCD handling logic
+    // The route of the CCCD handle tells which characteristic of the profile is configured
+    const attribute_route_t* route = bsp_get_attribute_route(param->write.handle);
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[(route != NULL) ? route->characteristic : 0];
     
     uint16_t cccd_write_value = param->write.value[1] << 8 | param->write.value[0];// Take the first byte and shift it 8 bits to the left and then OR it with the second byte
     // Now checking for the states of the CCCD
     if(cccd_write_value == 0x0001){
         ESP_LOGI(GATT_CALLBACK,"Notification Enabled");
-        // Send a response to the client stating that the CCCD value has been set
-        esp_gatt_rsp_t rsp = {
-            .attr_value = {
-                .handle = param->write.handle,
-                .len = param->write.len,
+    }else if(cccd_write_value == 0x0002){
+        ESP_LOGI(GATT_CALLBACK,"Indication Enabled");
+    }else if(cccd_write_value == 0x0000){
+        ESP_LOGI(GATT_CALLBACK,"Notification/Indication Disabled");
+    }else{
+        ESP_LOGE(GATT_CALLBACK,"Unknown CCCD Value: %d",cccd_write_value);
+    }
+
+    if(cccd_write_value <= 0x0002){
+        // Send a response to the client stating that the CCCD value has been set, unless the stack has already answered it
+        if(param->write.need_rsp){
+            esp_err_t err = bsp_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,param->write.handle,param->write.len,param->write.value);
+            if (err != ESP_OK){
+               ESP_LOGE(GATT_CALLBACK,"Error Sending Response");
+               ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
             }
-        };
+        }
+
+        // Set the value of the CCCD state in the profile table
+        characteristic->cccd_status = cccd_write_value;
+    }
+
+    // The client may have missed updates while it was not subscribed so the next frame is a full frame
+    atomic_store(&characteristic->delta_synced,false);
+
+    // Payloads held while the client was not subscribed can now be sent
+    bsp_wake_notification_scheduler();
+}
+
+static void bsp_complete_notification(int profile_id){
+    uint8_t notification_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+    uint8_t* notification_data = bsp_gatt_server_application_profile_table[profile_id].notification_buffer;
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[bsp_gatt_server_application_profile_table[profile_id].notification_entry.characteristic];
+
+    #ifdef TESTING
+        ESP_LOGW(GATT_CALLBACK,"TESTING Push To Notification Latency: %llu us Priority: %d",hal_ble_get_time(false) - bsp_gatt_server_application_profile_table[profile_id].notification_entry.push_time,bsp_gatt_server_application_profile_table[profile_id].notification_schedule.priority);
+    #endif
+
+    #ifdef ATTRIBUTE_TABLE_AUTO_RESPONSE
+        // The stack answers reads from its attribute table, so the sent payload is also stored there, the stack copies it before this returns
+        if(hal_ble_set_attr_value(characteristic->handle,notification_len,notification_data) != ESP_OK){
+            ESP_LOGE(GATT_CALLBACK,"Error Storing Sent Value In The Attribute Table");
+        }
+    #endif
+    // The sent block becomes the stored value, reads through the BSP are answered from the stored value so the attribute value in the stack is not read back
+    if(bsp_gatt_server_application_profile_table[profile_id].notification_entry.block != NOTIFICATION_POOL_NO_BLOCK){
+        bsp_publish_stored_value(characteristic,notification_data,bsp_gatt_server_application_profile_table[profile_id].notification_entry.block,notification_len);
+    }else{
+        // The batch is assembled into its own buffer, which is swapped with the stored value instead of copied
+        bsp_gatt_server_application_profile_table[profile_id].notification_buffer = bsp_publish_stored_value(characteristic,notification_data,NOTIFICATION_POOL_NO_BLOCK,notification_len);
+    }
+    atomic_store(&characteristic->delta_synced,true); // The client holds the stored value
+
+    #ifdef NOTIFICATION_LATENCY_HISTOGRAMS
+        // The batch is not taken out of a queue so only the payloads of the member profiles are measured
+        notification_latency_t* latency = &bsp_gatt_server_application_profile_table[profile_id].notification_latency;
+        if(latency->dequeue_time != 0){
+            uint64_t send_time = hal_ble_get_time(false);
+            bsp_record_notification_latency(profile_id,NOTIFICATION_STAGE_SEND,send_time - latency->dequeue_time);
+            bsp_record_notification_latency(profile_id,NOTIFICATION_STAGE_TOTAL,send_time - bsp_gatt_server_application_profile_table[profile_id].notification_entry.push_time);
+            latency->dequeue_time = 0;
+        }
+    #endif
 
-        memcpy(rsp.attr_value.value,param->write.value,param->write.len);
+    // The payload has been delivered
+    bsp_report_notification_result(&bsp_gatt_server_application_profile_table[profile_id].notification_entry,NOTIFICATION_RESULT_SENT);
+    bsp_gatt_server_application_profile_table[profile_id].notification_entry.block = NOTIFICATION_POOL_NO_BLOCK;
+    bsp_gatt_server_application_profile_table[profile_id].notification_entry.length = 0;
+    bsp_gatt_server_application_profile_table[profile_id].notification_retry.retry_count = 0;
+    bsp_consume_notification_token(profile_id);
 
-        esp_err_t err = esp_ble_gatts_send_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,&rsp);
-        if (err != ESP_OK){
-           ESP_LOGE(GATT_CALLBACK,"Error Sending Response");
-           ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
+    #ifdef DEBUG
+        ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Queue Count: %d",bsp_notification_queue_count(&bsp_gatt_server_application_profile_table[profile_id].notification_queue));
+        {
+            uint8_t stored_len = 0;
+            uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %.*s",stored_len,stored_value);
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",stored_len);
         }
+    #endif
+} // Update the stored value once the payload has been sent or confirmed
+
+static uint8_t bsp_build_notification_frame(int profile_id,uint8_t* frame_headers,hal_ble_segment_t* segments){
+    // Splits the payload into the segments of the frame, returns the number of segments
+    notification_delta_t* delta = &bsp_gatt_server_application_profile_table[profile_id].notification_delta;
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[bsp_gatt_server_application_profile_table[profile_id].notification_entry.characteristic];
+    uint8_t* value = bsp_gatt_server_application_profile_table[profile_id].notification_buffer;
+    uint8_t value_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+
+    if(!delta->enabled){
+        // The plain value is passed to the stack as it is
+        segments[0] = (hal_ble_segment_t){.data = value,.length = value_len};
+        return 1;
+    }
 
-        // Set the value of the CCCD state in the profile table
-        bsp_gatt_server_application_profile_table[profile_id].cccd_status = 0x0001;
-    }else if(cccd_write_value == 0x0002){
-        ESP_LOGI(GATT_CALLBACK,"Indication Enabled");
-        // Send a response to the client stating that the CCCD value has been set
-        esp_gatt_rsp_t rsp = hal_ble_create_gatt_response(param->write.handle,param->write.len,param->write.value);
+    if(atomic_load(&characteristic->delta_synced)){
+        // Runs of changed bytes against the stored value, gaps of up to 2 unchanged bytes are cheaper to send than a new run header
+        uint8_t stored_len = 0;
+        uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+        uint8_t num_segments = 1;
+        uint16_t frame_len = 2;
+        uint8_t runs = 0;
+        uint16_t offset = 0;
+
+        frame_headers[0] = NOTIFICATION_FRAME_DELTA;
+        frame_headers[1] = value_len;
+        segments[0] = (hal_ble_segment_t){.data = frame_headers,.length = 2};
+
+        while(offset < value_len && frame_len < value_len + 1){
+            if(offset < stored_len && value[offset] == stored_value[offset]){
+                offset++;
+                continue;
+            }
+            if(runs == NOTIFICATION_DELTA_MAX_RUNS){
+                frame_len = value_len + 1;
+                break;
+            }
+
+            uint16_t run_end = offset + 1;
+            for(uint16_t next = run_end; next < value_len && next <= run_end + 2; next++){
+                if(next >= stored_len || value[next] != stored_value[next]){
+                    run_end = next + 1;
+                }
+            }
 
-        esp_err_t err = esp_ble_gatts_send_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,&rsp);
-        hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,&rsp);
-        if (err != ESP_OK){
-           ESP_LOGE(GATT_CALLBACK,"Error Sending Response");
-           ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
+            uint8_t* run_header = &frame_headers[2 + 2*runs];
+            run_header[0] = offset;
+            run_header[1] = run_end - offset;
+            segments[num_segments++] = (hal_ble_segment_t){.data = run_header,.length = 2};
+            segments[num_segments++] = (hal_ble_segment_t){.data = &value[offset],.length = run_end - offset};
+            frame_len += 2 + run_end - offset;
+            runs++;
+            offset = run_end;
         }
-        // Set the value of the CCCD state in the profile table
-        bsp_gatt_server_application_profile_table[profile_id].cccd_status = 0x0002;
-    }else if(cccd_write_value == 0x0000){
-        ESP_LOGI(GATT_CALLBACK,"Notification/Indication Disabled");
-        // Send a response to the client stating that the CCCD value has been set
-        esp_gatt_rsp_t rsp = hal_ble_create_gatt_response(param->write.handle,param->write.len,param->write.value);
 
-        esp_err_t err = hal_ble_send_gatt_response(gatt_interface,param->write.conn_id,param->write.trans_id,ESP_GATT_OK,&rsp);
-        if (err != ESP_OK){
-           ESP_LOGE(GATT_CALLBACK,"Error Sending Response");
-           ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
+        if(frame_len < value_len + 1){
+            return num_segments;
         }
+    }
 
-        // Set the value of the CCCD state in the profile table
-        bsp_gatt_server_application_profile_table[profile_id].cccd_status = 0x0000;
-        
+    // The client is not known to hold the stored value or the delta would not be smaller
+    frame_headers[0] = NOTIFICATION_FRAME_FULL;
+    segments[0] = (hal_ble_segment_t){.data = frame_headers,.length = 1};
+    segments[1] = (hal_ble_segment_t){.data = value,.length = value_len};
+    return 2;
+} // Build the full or delta frame of the payload of a profile
+
+static void bsp_count_notification_frame(int profile_id,hal_ble_segment_t* segments,uint8_t num_segments){
+    notification_delta_t* delta = &bsp_gatt_server_application_profile_table[profile_id].notification_delta;
+    if(!delta->enabled){
+        return;
+    }
+
+    if(segments[0].data != NULL && ((uint8_t*)segments[0].data)[0] == NOTIFICATION_FRAME_DELTA){
+        uint16_t frame_len = 0;
+        for(uint8_t segment = 0; segment < num_segments; segment++){
+            frame_len += segments[segment].length;
+        }
+        delta->delta_count++;
+        delta->saved_bytes += bsp_gatt_server_application_profile_table[profile_id].notification_entry.length + 1 - frame_len;
     }else{
-        ESP_LOGE(GATT_CALLBACK,"Unknown CCCD Value: %d",cccd_write_value);
+        delta->full_count++;
     }
-}
+} // Count the frames sent by a profile in delta mode
 
 void bsp_send_notification_data(int profile_id){
     // Send the data to the client if notifications are enabled
-    if(bsp_gatt_server_application_profile_table[profile_id].cccd_status == 0x0001){
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[bsp_gatt_server_application_profile_table[profile_id].notification_entry.characteristic];
+    if(characteristic->cccd_status == 0x0001){
         // Notifications are enabled
-        // ESP_LOGI(GATT_CALLBACK,"Sending Notification Data");
-        esp_err_t err = ESP_FAIL;
-        for(int counter = 0; counter< MAX_NOTIFCATION_RETRIES; counter++){
-            // Check if enough time has passed between last notification
-            uint64_t current_time = hal_ble_get_time(false);
-            ESP_LOGI(GATT_CALLBACK,"Try No: %d",counter);
-            if(bsp_gatt_server_application_profile_table[profile_id].last_notification_time != 0){
-                uint64_t time_difference = current_time - bsp_gatt_server_application_profile_table[profile_id].last_notification_time;
-                ESP_LOGI(GATT_CALLBACK,"Time Difference: %llu",time_difference);
-                ESP_LOGI(GATT_CALLBACK,"Checking Time Difference");
-                if(time_difference < NOTIFICATION_INTERVAL){
-                    ESP_LOGE(GATT_CALLBACK,"Not Enough Time has Passed since last notification");
-                    break;
-                }else{
-                    // Enough time has passed
-                    ESP_LOGI(GATT_CALLBACK,"Enough Time has Passed since last notification");
-                    ESP_LOGI(GATT_CALLBACK,"Sending Notification Data");
-                    #ifdef DEBUG
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data: %s",bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data Length: %d",bsp_gatt_server_application_profile_table[profile_id].notification_queue_len);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-                    #endif
-                    err = hal_ble_send_notification(bsp_gatt_server_application_profile_table[profile_id].profile_interface,
-                            bsp_gatt_server_application_profile_table[profile_id].connection_id,
-                            bsp_gatt_server_application_profile_table[profile_id].characteristic_handle,
-                            bsp_gatt_server_application_profile_table[profile_id].notification_queue_len,
-                            bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                    if(err != ESP_OK){
-                        ESP_LOGE(GATT_CALLBACK,"Error Sending Notification Data retrying...");
-                        ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
-                        vTaskDelay(pdMS_TO_TICKS((counter+1)*50)); // Adding a delay before retrying and increasing it as per the counter
-                    }else{
-                        ESP_LOGI(GATT_CALLBACK,"Notification Data Sent");
-
-                        // Write the value to the local storage
-                        memset(bsp_gatt_server_application_profile_table[profile_id].local_storage,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit); // Clear the memory
-                        memcpy(bsp_gatt_server_application_profile_table[profile_id].local_storage,bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,bsp_gatt_server_application_profile_table[profile_id].notification_queue_len); // Copy the new value to the storage
-                        bsp_gatt_server_application_profile_table[profile_id].local_storage_len = bsp_gatt_server_application_profile_table[profile_id].notification_queue_len; // Update the value length
-
-                        // Clear the notification queue
-                        memset(bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit);
-                        bsp_gatt_server_application_profile_table[profile_id].notification_queue_len = 0;
-                        bsp_gatt_server_application_profile_table[profile_id].last_notification_time = current_time;
-
-                        #ifdef DEBUG
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data: %s",bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data Length: %d",bsp_gatt_server_application_profile_table[profile_id].notification_queue_len);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-                        #endif
-
-                        break;
-                    }
-                }
-            }else{
-                // Last Notification time is 0 so it is the first notification
-                 // Enough time has passed
-                    ESP_LOGI(GATT_CALLBACK,"Enough Time has Passed since last notification");
-                    ESP_LOGI(GATT_CALLBACK,"Sending Notification Data");
-                    #ifdef DEBUG
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data: %s",bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data Length: %d",bsp_gatt_server_application_profile_table[profile_id].notification_queue_len);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                        ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-                    #endif
-                 err = hal_ble_send_notification(bsp_gatt_server_application_profile_table[profile_id].profile_interface,                            bsp_gatt_server_application_profile_table[profile_id].connection_id,
-                                                 bsp_gatt_server_application_profile_table[profile_id].characteristic_handle,
-                                                 bsp_gatt_server_application_profile_table[profile_id].notification_queue_len,
-                                                 bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                    if(err != ESP_OK){
-                        ESP_LOGE(GATT_CALLBACK,"Error Sending Notification Data retrying...");
-                        ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
-                    }else{
-                        ESP_LOGI(GATT_CALLBACK,"Notification Data Sent");
-
-                        // Write the value to the local storage
-                        memset(bsp_gatt_server_application_profile_table[profile_id].local_storage,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit); // Clear the memory
-                        memcpy(bsp_gatt_server_application_profile_table[profile_id].local_storage,bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,bsp_gatt_server_application_profile_table[profile_id].notification_queue_len); // Copy the new value to the storage
-                        bsp_gatt_server_application_profile_table[profile_id].local_storage_len = bsp_gatt_server_application_profile_table[profile_id].notification_queue_len; // Update the value length
-
-                        // Clear the notification queue
-                        memset(bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer,0,bsp_gatt_server_application_profile_table[profile_id].local_storage_limit);
-                        bsp_gatt_server_application_profile_table[profile_id].last_notification_time = current_time; // Update the last notification time
-                        bsp_gatt_server_application_profile_table[profile_id].notification_queue_len = 0;
-
-                        #ifdef DEBUG
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data: %s",bsp_gatt_server_application_profile_table[profile_id].notification_queue_buffer);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data Length: %d",bsp_gatt_server_application_profile_table[profile_id].notification_queue_len);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %s",bsp_gatt_server_application_profile_table[profile_id].local_storage);
-                            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",bsp_gatt_server_application_profile_table[profile_id].local_storage_len);
-                        #endif
-
-                        break;
-                    }
-                    
-            }
+        uint8_t notification_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+        if(notification_len == 0){
+            ESP_LOGI(GATT_CALLBACK,"No Notification Data To Send");
+            return;
         }
+
+        // Only one attempt is made here, failures are retried by the retry timer so the caller never blocks
+        ESP_LOGI(GATT_CALLBACK,"Sending Notification Data");
+        #ifdef DEBUG
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Data Length: %d",notification_len);
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Notification Queue Count: %d",bsp_notification_queue_count(&bsp_gatt_server_application_profile_table[profile_id].notification_queue));
+            uint8_t stored_len = 0;
+            uint8_t* stored_value = bsp_get_stored_value(characteristic,&stored_len);
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Value: %.*s",stored_len,stored_value);
+            ESP_LOGW(GATT_CALLBACK,"DEBUG Local Storage Length: %d",stored_len);
+        #endif
+        // Delta mode adds a frame header to the payload, the HAL assembles them without an extra copy here
+        uint8_t frame_headers[2 + 2*NOTIFICATION_DELTA_MAX_RUNS];
+        hal_ble_segment_t segments[1 + 2*NOTIFICATION_DELTA_MAX_RUNS];
+        uint8_t num_segments = bsp_build_notification_frame(profile_id,frame_headers,segments);
+        esp_err_t err = hal_ble_send_notification_segments(bsp_gatt_server_application_profile_table[profile_id].profile_interface,
+                bsp_gatt_server_application_profile_table[profile_id].connection_id,
+                characteristic->handle,
+                segments,
+                num_segments,
+                NULL,
+                0);
         if(err != ESP_OK){
             ESP_LOGE(GATT_CALLBACK,"Error Sending Notification Data");
+            ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
+            if(bsp_is_connection_congested(bsp_gatt_server_application_profile_table[profile_id].connection_id)){
+                // The controller buffers are full, the payload is held without using up a retry until the congestion is relieved
+                ESP_LOGW(GATT_CALLBACK,"Connection Congested, Holding Notification Data");
+            }else{
+                bsp_schedule_notification_retry(profile_id);
+            }
+        }else{
+            ESP_LOGI(GATT_CALLBACK,"Notification Data Sent");
+            #ifdef TESTING
+                atomic_fetch_add(&bsp_notification_copy_counts.stack_copies,1);
+            #endif
+            bsp_count_notification_frame(profile_id,segments,num_segments);
+            bsp_complete_notification(profile_id);
         }
-    }else if(bsp_gatt_server_application_profile_table[profile_id].cccd_status == 0x0002){
+    }else if(characteristic->cccd_status == 0x0002){
         // Indications are enabled
+        uint8_t indication_len = bsp_gatt_server_application_profile_table[profile_id].notification_entry.length;
+        uint16_t connection_id = bsp_gatt_server_application_profile_table[profile_id].connection_id;
+        notification_indication_t* indication = &bsp_gatt_server_application_profile_table[profile_id].notification_indication;
+        if(indication_len == 0){
+            ESP_LOGI(GATT_CALLBACK,"No Indication Data To Send");
+            return;
+        }
+
+        // Only one indication can wait for a confirmation on a connection, the others are held until it is confirmed
+        int free_owner = 0;
+        if(connection_id < MAX_CONNECTIONS && !atomic_compare_exchange_strong(&bsp_connection_indicating_profile[connection_id],&free_owner,profile_id + 1)){
+            ESP_LOGI(GATT_CALLBACK,"Indication Held Until Connection %d Confirms Profile %d",connection_id,free_owner - 1);
+            return;
+        }
+
+        // The notification scheduler is not blocked while waiting, the confirmation or the timeout wakes it to complete the payload
         ESP_LOGI(GATT_CALLBACK,"Sending Indication Data");
-        // esp_ble_gatts_send_indicate(gatt_server_application_profile_table[profile_id].profile_interface,gatt_server_application_profile_table[profile_id].connection_id,gatt_server_application_profile_table[profile_id].characteristic_handle,sizeof(data),&data,true);
+        // The handle is the one of the characteristic of the in flight entry, so the notifications of the other characteristics of the profile cannot confirm it
+        indication->connection_id = connection_id;
+        indication->handle = characteristic->handle;
+        atomic_store(&indication->state,INDICATION_PENDING);
+        if(indication->timeout_timer != NULL){
+            xTimerChangePeriod(indication->timeout_timer,pdMS_TO_TICKS(indication->timeout) + 1,0);
+        }
+        uint8_t frame_headers[2 + 2*NOTIFICATION_DELTA_MAX_RUNS];
+        hal_ble_segment_t segments[1 + 2*NOTIFICATION_DELTA_MAX_RUNS];
+        uint8_t num_segments = bsp_build_notification_frame(profile_id,frame_headers,segments);
+        esp_err_t err = hal_ble_send_indication_segments(bsp_gatt_server_application_profile_table[profile_id].profile_interface,
+                connection_id,
+                characteristic->handle,
+                segments,
+                num_segments,
+                NULL,
+                0);
+        if(err != ESP_OK){
+            ESP_LOGE(GATT_CALLBACK,"Error Sending Indication Data");
+            ESP_LOGE(GATT_CALLBACK,"Error Code: %s",esp_err_to_name(err));
+            if(indication->timeout_timer != NULL){
+                xTimerStop(indication->timeout_timer,0);
+            }
+            atomic_store(&indication->state,INDICATION_IDLE);
+            bsp_release_indication(profile_id);
+            if(bsp_is_connection_congested(connection_id)){
+                // The controller buffers are full, the payload is held without using up a retry until the congestion is relieved
+                ESP_LOGW(GATT_CALLBACK,"Connection Congested, Holding Indication Data");
+            }else{
+                bsp_schedule_notification_retry(profile_id);
+            }
+        }else{
+            #ifdef TESTING
+                atomic_fetch_add(&bsp_notification_copy_counts.stack_copies,1);
+            #endif
+            bsp_count_notification_frame(profile_id,segments,num_segments);
+        }
     }else{
        // Display the cccd value
-        ESP_LOGI(GATT_CALLBACK,"CCCD Value: %d",bsp_gatt_server_application_profile_table[profile_id].cccd_status);
+        ESP_LOGI(GATT_CALLBACK,"CCCD Value: %d",characteristic->cccd_status);
     }
 }
 
 void bsp_stop_server(){
     // Stopping the server
     esp_ble_gap_stop_advertising();
+    // Application N was registered by profile N, so its interface is the one that profile holds
+    for(int app_id = 0; app_id < NUM_GATT_APPLICATIONS; app_id++){
+        esp_ble_gatts_app_unregister(bsp_gatt_server_application_profile_table[app_id].profile_interface);
+    }
+    // The timers are kept for the next initialization so a pending retry or timeout must not fire into the freed table
     for(int profile_no = 0; profile_no < NUM_PROFILES; profile_no++){
-        esp_ble_gatts_app_unregister(bsp_gatt_server_application_profile_table[profile_no].profile_interface);
+        if(bsp_gatt_server_application_profile_table[profile_no].notification_retry.retry_timer != NULL){
+            xTimerStop(bsp_gatt_server_application_profile_table[profile_no].notification_retry.retry_timer,0);
+        }
+        if(bsp_gatt_server_application_profile_table[profile_no].notification_indication.timeout_timer != NULL){
+            xTimerStop(bsp_gatt_server_application_profile_table[profile_no].notification_indication.timeout_timer,0);
+        }
     }
     // Free the server profile table
     bsp_free_server_profile_table(bsp_gatt_server_application_profile_table,NUM_PROFILES);
 }
 
+#ifdef TESTING
+
+// State of the notification queue contention benchmark shared by the producer tasks
+static int contention_benchmark_profile_id;
+static int contention_benchmark_pushes;
+static int contention_benchmark_producers;
+static atomic_uint contention_benchmark_running;
+static atomic_uint contention_benchmark_total_time;
+static atomic_uint contention_benchmark_max_time;
+
+void notification_queue_contention_task(void *param){
+    int producer_no = (int)(intptr_t)param;
+    uint8_t payload[bsp_gatt_server_application_profile_table[contention_benchmark_profile_id].characteristics[0].local_storage_limit];
+    memset(payload,producer_no,sizeof(payload));
+
+    for(int push_no = 0; push_no < contention_benchmark_pushes; push_no++){
+        payload[0] = push_no;
+        uint64_t start_time = hal_ble_get_time(false);
+        bsp_push_data_to_notification_queue(contention_benchmark_profile_id,payload,sizeof(payload));
+        unsigned int push_time = (unsigned int)(hal_ble_get_time(false) - start_time);
+
+        atomic_fetch_add(&contention_benchmark_total_time,push_time);
+        unsigned int max_time = atomic_load(&contention_benchmark_max_time);
+        while(push_time > max_time && !atomic_compare_exchange_weak(&contention_benchmark_max_time,&max_time,push_time));
+        taskYIELD();
+    }
+
+    if(atomic_fetch_sub(&contention_benchmark_running,1) == 1){
+        // The last producer reports the results
+        notification_queue_t* queue = &bsp_gatt_server_application_profile_table[contention_benchmark_profile_id].notification_queue;
+        ESP_LOGW("TESTING","Contention Benchmark Average Push Time: %u us",atomic_load(&contention_benchmark_total_time) / (contention_benchmark_pushes * contention_benchmark_producers));
+        ESP_LOGW("TESTING","Contention Benchmark Max Push Time: %u us",atomic_load(&contention_benchmark_max_time));
+        ESP_LOGW("TESTING","Contention Benchmark Coalesced: %u Rejected: %u Dropped: %u",atomic_load(&queue->coalesced_count),atomic_load(&queue->rejected_count),atomic_load(&queue->dropped_count));
+    }
+    vTaskDelete(NULL);
+}
+
+void test_notification_queue_contention(int profile_id,int producer_count,int pushes_per_producer){
+    contention_benchmark_profile_id = profile_id;
+    contention_benchmark_pushes = pushes_per_producer;
+    contention_benchmark_producers = producer_count;
+    atomic_store(&contention_benchmark_running,producer_count);
+    atomic_store(&contention_benchmark_total_time,0);
+    atomic_store(&contention_benchmark_max_time,0);
+
+    for(int producer_no = 0; producer_no < producer_count; producer_no++){
+        xTaskCreatePinnedToCore(notification_queue_contention_task,"Contention Task",2048,(void*)(intptr_t)producer_no,5,NULL,tskNO_AFFINITY);
+    }
+}
+
+void test_notification_zero_copy(int profile_id,int pushes){
+    // Needs a client subscribed to the profile so that the payloads are sent
+    uint8_t* last_buffer = NULL;
+    int pushed = 0;
+
+    atomic_store(&bsp_notification_copy_counts.producer_copies,0);
+    atomic_store(&bsp_notification_copy_counts.batch_copies,0);
+    atomic_store(&bsp_notification_copy_counts.stack_copies,0);
+
+    for(int push_no = 0; push_no < pushes; push_no++){
+        // Fill the pool buffer in place, every payload is different so none of them is skipped as unchanged
+        uint8_t* buffer = bsp_acquire_notification_buffer(profile_id);
+        if(buffer == NULL){
+            break;
+        }
+        memset(buffer,'a' + (push_no % 26),bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit);
+        buffer[0] = push_no;
+        if(bsp_push_notification_buffer(profile_id,buffer,bsp_gatt_server_application_profile_table[profile_id].characteristics[0].local_storage_limit)){
+            last_buffer = buffer;
+            pushed++;
+        }
+
+        // Give the scheduler time to send the payload before the next one is pushed
+        vTaskDelay(pdMS_TO_TICKS(NOTIFICATION_INTERVAL + 50));
+    }
+
+    unsigned int producer_copies = atomic_load(&bsp_notification_copy_counts.producer_copies);
+    unsigned int stack_copies = atomic_load(&bsp_notification_copy_counts.stack_copies);
+    ESP_LOGW("TESTING","Zero Copy Pushed: %d Producer Copies: %u Stack Copies: %u",pushed,producer_copies,stack_copies);
+
+    // Each payload must only have been copied into the stack, and the last one must now be the stored value
+    uint8_t stored_len = 0;
+    bool stored = (bsp_get_stored_value(&bsp_gatt_server_application_profile_table[profile_id].characteristics[0],&stored_len) == last_buffer);
+    if(producer_copies == 0 && stack_copies == (unsigned int)pushed && stored){
+        ESP_LOGW("TESTING","Zero Copy Test Passed");
+    }else{
+        ESP_LOGE("TESTING","Zero Copy Test Failed");
+    }
+    assert(pushed > 0);
+    assert(producer_copies == 0);
+    assert(stack_copies == (unsigned int)pushed);
+    assert(stored);
+}
+
+static uint32_t profile_table_layout_read_cost(const uint8_t* table,size_t stride,int iterations){
+    // Reads the fields the notification scheduler checks for every profile on every round
+    volatile uint32_t checksum = 0;
+    uint64_t start_time = hal_ble_get_time(false);
+    for(int iteration = 0; iteration < iterations; iteration++){
+        for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+            const profile_t* profile = (const profile_t*)(table + profile_id*stride);
+            checksum += profile->characteristics[0].cccd_status + profile->connection_id + profile->characteristics[0].handle + profile->notification_entry.length + atomic_load_explicit(&profile->characteristics[0].stored_value.lengths[0],memory_order_relaxed);
+        }
+    }
+    return (uint32_t)(hal_ble_get_time(false) - start_time);
+}
+
+void test_profile_table_layout(int iterations){
+    // The table before the split had the setup information of every profile interleaved with its state
+    typedef struct{
+        profile_t profile;
+        profile_config_t profile_config;
+    } interleaved_profile_t;
+    static interleaved_profile_t interleaved_profile_table[NUM_PROFILES];
+    for(int profile_id = 0; profile_id < NUM_PROFILES; profile_id++){
+        interleaved_profile_table[profile_id].profile = bsp_gatt_server_application_profile_table[profile_id];
+    }
+
+    ESP_LOGW("TESTING","Profile Layout Hot: %u bytes Config: %u bytes Interleaved: %u bytes Arena: %u bytes",
+             (unsigned int)sizeof(profile_t),(unsigned int)sizeof(profile_config_t),(unsigned int)sizeof(interleaved_profile_t),(unsigned int)sizeof(profile_arena_t));
+
+    uint32_t hot_time = profile_table_layout_read_cost((const uint8_t*)bsp_gatt_server_application_profile_table,sizeof(profile_t),iterations);
+    uint32_t interleaved_time = profile_table_layout_read_cost((const uint8_t*)interleaved_profile_table,sizeof(interleaved_profile_t),iterations);
+    ESP_LOGW("TESTING","Profile Layout Notify Loop Of %d Rounds, Hot Table: %lu us Interleaved Table: %lu us",iterations,(unsigned long)hot_time,(unsigned long)interleaved_time);
+}
+
+static volatile uint32_t gatt_response_stack_sink;
+
+static esp_gatt_rsp_t __attribute__((noinline)) gatt_response_by_value(uint16_t handle,uint16_t length,const uint8_t* value){
+    // The builder used before, the whole response is zeroed and returned through the stack of the caller
+    esp_gatt_rsp_t rsp;
+    memset(&rsp,0,sizeof(rsp));
+    rsp.attr_value.handle = handle;
+    rsp.attr_value.len = length;
+    memcpy(rsp.attr_value.value,value,length);
+    return rsp;
+}
+
+static void __attribute__((noinline)) gatt_response_by_value_send(uint16_t handle,uint16_t length,const uint8_t* value){
+    esp_gatt_rsp_t rsp = gatt_response_by_value(handle,length,value);
+    gatt_response_stack_sink += rsp.attr_value.value[0];
+}
+
+static void __attribute__((noinline)) gatt_response_in_place_send(uint16_t handle,uint16_t length,const uint8_t* value){
+    hal_ble_fill_gatt_response(&bsp_gatt_responses[0],handle,length,value);
+    gatt_response_stack_sink += bsp_gatt_responses[0].attr_value.value[0];
+}
+
+static void gatt_response_stack_usage_task(void* parameters){
+    (void)parameters;
+    static const uint8_t value[2] = {0x01,0x00};
+
+    // The high water mark only falls, so the in place response is measured first on the fresh stack
+    UBaseType_t baseline = uxTaskGetStackHighWaterMark(NULL);
+    gatt_response_in_place_send(0x002a,sizeof(value),value);
+    UBaseType_t in_place = uxTaskGetStackHighWaterMark(NULL);
+    gatt_response_by_value_send(0x002a,sizeof(value),value);
+    UBaseType_t by_value = uxTaskGetStackHighWaterMark(NULL);
+
+    ESP_LOGW("TESTING","GATT Response Size: %u bytes, Stack Used In Place: %u bytes By Value: %u bytes",
+             (unsigned int)sizeof(esp_gatt_rsp_t),(unsigned int)(baseline - in_place),(unsigned int)(baseline - by_value));
+    vTaskDelete(NULL);
+}
+
+void test_gatt_response_stack_usage(){
+    xTaskCreatePinnedToCore(gatt_response_stack_usage_task,"Response Stack Task",4096,NULL,5,NULL,tskNO_AFFINITY);
+}
+
+static int stored_value_test_profile_id = 0;
+static atomic_bool stored_value_test_running = false;
+static atomic_int stored_value_test_readers = 0;
+static atomic_uint stored_value_test_reads = 0;
+static atomic_uint stored_value_test_torn_reads = 0;
+
+void stored_value_reader_task(void *param){
+    (void)param; // The profile under test is set by test_stored_value_consistency()
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[stored_value_test_profile_id].characteristics[0];
+    uint8_t value[NOTIFICATION_POOL_BLOCK_SIZE];
+
+    while(atomic_load(&stored_value_test_running)){
+        // Every published value is filled with its own length, so a mix of two values or a wrong length shows as a torn read
+        uint16_t length = bsp_read_stored_value(characteristic,value,sizeof(value));
+        bool torn = false;
+        for(uint16_t byte = 0; byte < length; byte++){
+            torn |= (value[byte] != length);
+        }
+        if(torn){
+            atomic_fetch_add(&stored_value_test_torn_reads,1);
+        }
+        atomic_fetch_add(&stored_value_test_reads,1);
+        taskYIELD();
+    }
+    atomic_fetch_sub(&stored_value_test_readers,1);
+    vTaskDelete(NULL);
+}
+
+void test_stored_value_consistency(int profile_id,int reader_count,int publishes){
+    // Needs a characteristic that fits in a pool block, the writer publishes the way a client write does
+    characteristic_t* characteristic = &bsp_gatt_server_application_profile_table[profile_id].characteristics[0];
+    stored_value_test_profile_id = profile_id;
+    atomic_store(&stored_value_test_reads,0);
+    atomic_store(&stored_value_test_torn_reads,0);
+    atomic_store(&stored_value_test_readers,reader_count);
+    atomic_store(&stored_value_test_running,true);
+
+    for(int reader_no = 0; reader_no < reader_count; reader_no++){
+        xTaskCreatePinnedToCore(stored_value_reader_task,"Stored Value Reader",2048,NULL,5,NULL,tskNO_AFFINITY);
+    }
+
+    int published = 0;
+    for(int publish_no = 0; publish_no < publishes; publish_no++){
+        uint8_t length = 1 + (publish_no % ((characteristic->local_storage_limit < NOTIFICATION_POOL_BLOCK_SIZE) ? characteristic->local_storage_limit : NOTIFICATION_POOL_BLOCK_SIZE));
+        if(xSemaphoreTake(bsp_profile_semaphores[profile_id],portMAX_DELAY) != pdTRUE){
+            break;
+        }
+        // The lowest free block is taken, so it is usually the block the previous publish released while a reader may be copying it
+        uint8_t block = bsp_notification_pool_acquire();
+        if(block != NOTIFICATION_POOL_NO_BLOCK){
+            memset(bsp_notification_pool.blocks[block],length,length);
+            bsp_publish_stored_value(characteristic,bsp_notification_pool.blocks[block],block,length);
+            published++;
+        }
+        xSemaphoreGive(bsp_profile_semaphores[profile_id]);
+        if((publish_no & 0x3F) == 0){
+            vTaskDelay(1);
+        }
+    }
+
+    atomic_store(&stored_value_test_running,false);
+    while(atomic_load(&stored_value_test_readers) > 0){
+        vTaskDelay(1);
+    }
+
+    unsigned int torn_reads = atomic_load(&stored_value_test_torn_reads);
+    ESP_LOGW("TESTING","Stored Value Publishes: %d Reads: %u Torn Reads: %u",published,atomic_load(&stored_value_test_reads),torn_reads);
+    if(torn_reads == 0){
+        ESP_LOGW("TESTING","Stored Value Consistency Test Passed");
+    }else{
+        ESP_LOGE("TESTING","Stored Value Consistency Test Failed");
+    }
+}
+
+#endif
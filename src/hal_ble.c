@@ -119,6 +119,70 @@ esp_err_t hal_ble_send_indication(uint16_t gatt_if,uint16_t conn_id,uint16_t cha
     return err;
 }
 
+// Staging buffer used when the caller does not assemble the segments into its own buffer
+static uint8_t hal_ble_pdu_staging[HAL_BLE_MAX_PDU_LEN];
+static StaticSemaphore_t hal_ble_pdu_staging_mutex_storage;
+static SemaphoreHandle_t hal_ble_pdu_staging_mutex = NULL;
+static portMUX_TYPE hal_ble_pdu_staging_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t hal_ble_send_segments(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,const hal_ble_segment_t* segments,uint8_t num_segments,uint8_t* pdu,uint16_t pdu_size,bool need_confirm){
+    if(segments == NULL || num_segments == 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if(num_segments == 1){
+        // Nothing to assemble, the stack copies the segment into the PDU
+        return esp_ble_gatts_send_indicate(gatt_if,conn_id,char_handle,segments[0].length,(uint8_t*)segments[0].data,need_confirm);
+    }
+
+    uint32_t length = 0;
+    for(uint8_t segment = 0; segment < num_segments; segment++){
+        length += segments[segment].length;
+    }
+
+    bool staged = (pdu == NULL);
+    if(staged){
+        // Created on first use so that every sender shares one staging buffer
+        portENTER_CRITICAL(&hal_ble_pdu_staging_lock);
+        if(hal_ble_pdu_staging_mutex == NULL){
+            hal_ble_pdu_staging_mutex = xSemaphoreCreateMutexStatic(&hal_ble_pdu_staging_mutex_storage);
+        }
+        portEXIT_CRITICAL(&hal_ble_pdu_staging_lock);
+
+        pdu = hal_ble_pdu_staging;
+        pdu_size = HAL_BLE_MAX_PDU_LEN;
+    }
+    if(length > pdu_size || length > HAL_BLE_MAX_PDU_LEN){
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if(staged && xSemaphoreTake(hal_ble_pdu_staging_mutex,portMAX_DELAY) != pdTRUE){
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint16_t offset = 0;
+    for(uint8_t segment = 0; segment < num_segments; segment++){
+        memcpy(pdu + offset,segments[segment].data,segments[segment].length);
+        offset += segments[segment].length;
+    }
+    esp_err_t err = esp_ble_gatts_send_indicate(gatt_if,conn_id,char_handle,offset,pdu,need_confirm);
+
+    if(staged){
+        xSemaphoreGive(hal_ble_pdu_staging_mutex);
+    }
+    return err;
+} // Assemble the segments once and hand the value to the stack
+
+esp_err_t hal_ble_send_notification_segments(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,const hal_ble_segment_t* segments,uint8_t num_segments,uint8_t* pdu,uint16_t pdu_size){
+    esp_err_t err = hal_ble_send_segments(gatt_if,conn_id,char_handle,segments,num_segments,pdu,pdu_size,false);
+    return err;
+}
+
+esp_err_t hal_ble_send_indication_segments(uint16_t gatt_if,uint16_t conn_id,uint16_t char_handle,const hal_ble_segment_t* segments,uint8_t num_segments,uint8_t* pdu,uint16_t pdu_size){
+    esp_err_t err = hal_ble_send_segments(gatt_if,conn_id,char_handle,segments,num_segments,pdu,pdu_size,true);
+    return err;
+}
+
 esp_err_t hal_ble_update_conn_params(esp_ble_conn_update_params_t *params){
     esp_err_t err = esp_ble_gap_update_conn_params(params);
     return err;
@@ -134,6 +198,11 @@ esp_err_t hal_ble_create_service(uint16_t gatt_if,esp_gatt_srvc_id_t* service_uu
     return err;
 }
 
+esp_err_t hal_ble_create_attribute_table(uint16_t gatt_if,const esp_gatts_attr_db_t* attribute_table,uint8_t num_attributes,uint8_t service_instance){
+    esp_err_t err = esp_ble_gatts_create_attr_tab(attribute_table,gatt_if,num_attributes,service_instance);
+    return err;
+}
+
 esp_gatt_srvc_id_t hal_ble_create_service_id(uint16_t service_id){
     // Need to create the service for the profile
     esp_gatt_srvc_id_t service_uuid = {
@@ -173,17 +242,18 @@ esp_bt_uuid_t hal_ble_create_uuid(uint16_t uuid,uint8_t len){
     return bt_uuid;
 }
 
-esp_gatt_rsp_t hal_ble_create_gatt_response(uint16_t handle,uint16_t length,uint8_t *value){
-    esp_gatt_rsp_t rsp = {
-        .attr_value = {
-            .handle = handle,
-            .len = length
-        }
-    };
-
-    memcpy(rsp.attr_value.value,value,length);
-
-    return rsp;
+void hal_ble_fill_gatt_response(esp_gatt_rsp_t *rsp,uint16_t handle,uint16_t length,const uint8_t *value){
+    // The response is not cleared first, the stack only reads the first len bytes of the value
+    if(length > ESP_GATT_MAX_ATTR_LEN){
+        length = ESP_GATT_MAX_ATTR_LEN;
+    }
+    rsp->attr_value.handle = handle;
+    rsp->attr_value.offset = 0;
+    rsp->attr_value.len = length;
+    rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+    if(length > 0 && value != rsp->attr_value.value){
+        memcpy(rsp->attr_value.value,value,length);
+    }
 }
 
 esp_err_t hal_ble_add_char_descriptor(uint16_t service_handle,esp_bt_uuid_t* cccd_uuid,esp_gatt_perm_t permissions,uint16_t initial_value){
@@ -0,0 +1,2 @@
+#pragma once
+#include "idf_stub_all.h"
@@ -0,0 +1,226 @@
+#pragma once
+/*
+    Host stand-ins for the ESP-IDF and FreeRTOS declarations used by the BLE component
+
+    Only the types, macros and prototypes needed to compile src/bsp_ble.c on a host are declared. Nothing here is
+    implemented, so a host test may only call code that does not reach the stack or the RTOS. The log macros check
+    their format but print nothing.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_TIMEOUT 0x107
+const char *esp_err_to_name(esp_err_t);
+#define ESP_LOGI(tag, fmt, ...) ((void)(tag), (void)(0 && printf(fmt, ##__VA_ARGS__)))
+#define ESP_LOGW(tag, fmt, ...) ((void)(tag), (void)(0 && printf(fmt, ##__VA_ARGS__)))
+#define ESP_LOGE(tag, fmt, ...) ((void)(tag), (void)(0 && printf(fmt, ##__VA_ARGS__)))
+#define ESP_LOGD(tag, fmt, ...) ((void)(tag), (void)(0 && printf(fmt, ##__VA_ARGS__)))
+#define ESP_LOGV(tag, fmt, ...) ((void)(tag), (void)(0 && printf(fmt, ##__VA_ARGS__)))
+#define DRAM_ATTR
+#define IRAM_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
+uint32_t esp_random(void);
+/* FreeRTOS */
+typedef int BaseType_t; typedef unsigned UBaseType_t; typedef uint32_t TickType_t;
+typedef void* TaskHandle_t; typedef void* SemaphoreHandle_t; typedef void* QueueHandle_t; typedef void* TimerHandle_t; typedef void* EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+typedef void (*TaskFunction_t)(void*);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define tskNO_AFFINITY 0x7fffffff
+#define configMAX_PRIORITIES 25
+typedef struct { int x; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(m) ((void)(m))
+#define portEXIT_CRITICAL(m) ((void)(m))
+#define portENTER_CRITICAL_ISR(m) ((void)(m))
+#define portEXIT_CRITICAL_ISR(m) ((void)(m))
+#define portYIELD_FROM_ISR(x) ((void)(x))
+#define taskYIELD() ((void)0)
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t,const char*,uint32_t,void*,UBaseType_t,TaskHandle_t*,BaseType_t);
+BaseType_t xTaskCreate(TaskFunction_t,const char*,uint32_t,void*,UBaseType_t,TaskHandle_t*);
+void vTaskDelete(TaskHandle_t);
+void vTaskDelay(TickType_t);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t);
+BaseType_t xTaskNotifyGive(TaskHandle_t);
+void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*);
+BaseType_t xTaskNotify(TaskHandle_t, uint32_t, int);
+BaseType_t xTaskNotifyWait(uint32_t,uint32_t,uint32_t*,TickType_t);
+#define eSetBits 1
+#define eIncrement 2
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(void*);
+typedef struct { int x[20]; } StaticSemaphore_t;
+typedef struct { int x[20]; } StaticQueue_t;
+typedef struct { int x[20]; } StaticTimer_t;
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
+void vSemaphoreDelete(SemaphoreHandle_t);
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+QueueHandle_t xQueueCreateStatic(UBaseType_t, UBaseType_t, uint8_t*, StaticQueue_t*);
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t);
+BaseType_t xQueueSendFromISR(QueueHandle_t, const void*, BaseType_t*);
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t);
+void vQueueDelete(QueueHandle_t);
+TimerHandle_t xTimerCreate(const char*, TickType_t, UBaseType_t, void*, TimerCallbackFunction_t);
+TimerHandle_t xTimerCreateStatic(const char*, TickType_t, UBaseType_t, void*, TimerCallbackFunction_t, StaticTimer_t*);
+BaseType_t xTimerStart(TimerHandle_t, TickType_t);
+BaseType_t xTimerStop(TimerHandle_t, TickType_t);
+BaseType_t xTimerChangePeriod(TimerHandle_t, TickType_t, TickType_t);
+BaseType_t xTimerReset(TimerHandle_t, TickType_t);
+BaseType_t xTimerDelete(TimerHandle_t, TickType_t);
+void* pvTimerGetTimerID(TimerHandle_t);
+BaseType_t xTimerIsTimerActive(TimerHandle_t);
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t, EventBits_t);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t, EventBits_t, BaseType_t, BaseType_t, TickType_t);
+size_t xPortGetFreeHeapSize(void);
+size_t esp_get_free_heap_size(void);
+size_t heap_caps_get_free_size(uint32_t);
+#define MALLOC_CAP_INTERNAL (1<<11)
+#define MALLOC_CAP_8BIT (1<<2)
+/* timer */
+int64_t esp_timer_get_time(void);
+typedef struct esp_timer* esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void*);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+typedef struct { esp_timer_cb_t callback; void* arg; esp_timer_dispatch_t dispatch_method; const char* name; bool skip_unhandled_events; } esp_timer_create_args_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t*, esp_timer_handle_t*);
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_stop(esp_timer_handle_t);
+esp_err_t esp_timer_delete(esp_timer_handle_t);
+bool esp_timer_is_active(esp_timer_handle_t);
+/* sleep */
+typedef enum { ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_DOMAIN_RC_FAST } esp_sleep_pd_domain_t;
+typedef enum { ESP_PD_OPTION_OFF, ESP_PD_OPTION_ON, ESP_PD_OPTION_AUTO } esp_sleep_pd_option_t;
+esp_err_t esp_light_sleep_start(void);
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t);
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t, esp_sleep_pd_option_t);
+esp_err_t nvs_flash_init(void);
+/* bt */
+typedef uint8_t esp_bd_addr_t[6];
+typedef enum { ESP_BT_MODE_IDLE, ESP_BT_MODE_BLE, ESP_BT_MODE_CLASSIC_BT, ESP_BT_MODE_BTDM } esp_bt_mode_t;
+typedef struct { int x; } esp_bt_controller_config_t;
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() {0}
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t);
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t*);
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t);
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+typedef enum { ESP_BLE_PWR_TYPE_ADV } esp_ble_power_type_t;
+typedef enum { ESP_PWR_LVL_N12, ESP_PWR_LVL_P9 } esp_power_level_t;
+esp_err_t esp_ble_tx_power_set(esp_ble_power_type_t, esp_power_level_t);
+#define ESP_UUID_LEN_16 2
+#define ESP_UUID_LEN_32 4
+#define ESP_UUID_LEN_128 16
+typedef struct { uint16_t len; union { uint16_t uuid16; uint32_t uuid32; uint8_t uuid128[16]; } uuid; } __attribute__((packed)) esp_bt_uuid_t;
+/* gap */
+typedef enum { ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT=0, ESP_GAP_BLE_ADV_START_COMPLETE_EVT=6 } esp_gap_ble_cb_event_t;
+typedef union { struct { int status; } adv_start_cmpl; } esp_ble_gap_cb_param_t;
+typedef void (*esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t*);
+typedef struct { bool set_scan_rsp, include_name, include_txpower; int min_interval, max_interval, appearance; uint16_t manufacturer_len; uint8_t *p_manufacturer_data; uint16_t service_data_len; uint8_t *p_service_data; uint16_t service_uuid_len; uint8_t* p_service_uuid; uint8_t flag; } esp_ble_adv_data_t;
+#define ESP_BLE_ADV_FLAG_GEN_DISC 0x02
+#define ESP_BLE_ADV_FLAG_BREDR_NOT_SPT 0x04
+typedef enum { ADV_TYPE_IND } esp_ble_adv_type_t;
+typedef enum { BLE_ADDR_TYPE_PUBLIC } esp_ble_addr_type_t;
+typedef enum { ADV_CHNL_ALL = 7 } esp_ble_adv_channel_t;
+typedef enum { ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY } esp_ble_adv_filter_t;
+typedef struct { uint16_t adv_int_min, adv_int_max; esp_ble_adv_type_t adv_type; esp_ble_addr_type_t own_addr_type; esp_bd_addr_t peer_addr; esp_ble_addr_type_t peer_addr_type; esp_ble_adv_channel_t channel_map; esp_ble_adv_filter_t adv_filter_policy; } esp_ble_adv_params_t;
+typedef struct { esp_bd_addr_t bda; uint16_t min_int, max_int, latency, timeout; } esp_ble_conn_update_params_t;
+esp_err_t esp_ble_gap_set_device_name(const char*);
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t);
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t*);
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t*);
+esp_err_t esp_ble_gap_stop_advertising(void);
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t*);
+/* gatt */
+typedef uint8_t esp_gatt_if_t;
+#define ESP_GATT_IF_NONE 0xff
+#define ESP_GATT_MAX_ATTR_LEN 512
+#define ESP_GATT_AUTH_REQ_NONE 0
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+typedef enum { ESP_GATT_OK = 0, ESP_GATT_INVALID_HANDLE = 1, ESP_GATT_READ_NOT_PERMIT=2, ESP_GATT_WRITE_NOT_PERMIT=3, ESP_GATT_INVALID_OFFSET=7, ESP_GATT_INVALID_ATTR_LEN = 0x0d, ESP_GATT_NO_RESOURCES=0x80, ESP_GATT_INTERNAL_ERROR=0x81, ESP_GATT_ERROR=0x85, ESP_GATT_CONGESTED=0x8f, ESP_GATT_BUSY=0x84, ESP_GATT_TIMEOUT=0x94 } esp_gatt_status_t;
+typedef uint16_t esp_gatt_perm_t;
+typedef uint8_t esp_gatt_char_prop_t;
+#define ESP_GATT_PERM_READ 1
+#define ESP_GATT_PERM_WRITE (1<<4)
+#define ESP_GATT_CHAR_PROP_BIT_READ (1<<1)
+#define ESP_GATT_CHAR_PROP_BIT_WRITE_NR (1<<2)
+#define ESP_GATT_CHAR_PROP_BIT_WRITE (1<<3)
+#define ESP_GATT_CHAR_PROP_BIT_NOTIFY (1<<4)
+#define ESP_GATT_CHAR_PROP_BIT_INDICATE (1<<5)
+#define ESP_GATT_UUID_PRI_SERVICE 0x2800
+#define ESP_GATT_UUID_CHAR_DECLARE 0x2803
+#define ESP_GATT_UUID_CHAR_CLIENT_CONFIG 0x2902
+#define ESP_GATT_UUID_CHAR_DESCRIPTION 0x2901
+#define ESP_GATT_PREP_WRITE_EXEC 1
+#define ESP_GATT_AUTO_RSP 2
+#define ESP_GATT_RSP_BY_APP 1
+typedef struct { esp_bt_uuid_t uuid; uint8_t inst_id; } __attribute__((packed)) esp_gatt_id_t;
+typedef struct { esp_gatt_id_t id; bool is_primary; } __attribute__((packed)) esp_gatt_srvc_id_t;
+typedef struct { uint16_t attr_max_len; uint16_t attr_len; uint8_t *attr_value; } esp_attr_value_t;
+typedef struct { uint8_t value[ESP_GATT_MAX_ATTR_LEN]; uint16_t handle; uint16_t offset; uint16_t len; uint8_t auth_req; } esp_gatt_value_t;
+typedef union { esp_gatt_value_t attr_value; uint16_t handle; } esp_gatt_rsp_t;
+typedef struct { uint8_t auto_rsp; } esp_attr_control_t;
+typedef struct { uint16_t uuid_length; uint8_t *uuid_p; uint16_t perm; uint16_t max_length; uint16_t length; uint8_t *value; } esp_attr_desc_t;
+typedef struct { esp_attr_control_t attr_control; esp_attr_desc_t att_desc; } esp_gatts_attr_db_t;
+typedef struct { uint16_t interval, latency, timeout; } esp_gatt_conn_params_t;
+typedef enum { ESP_GATTS_REG_EVT=0, ESP_GATTS_READ_EVT=1, ESP_GATTS_WRITE_EVT=2, ESP_GATTS_EXEC_WRITE_EVT=3, ESP_GATTS_MTU_EVT=4, ESP_GATTS_CONF_EVT=5, ESP_GATTS_UNREG_EVT=6, ESP_GATTS_CREATE_EVT=7, ESP_GATTS_ADD_INCL_SRVC_EVT=8, ESP_GATTS_ADD_CHAR_EVT=9, ESP_GATTS_ADD_CHAR_DESCR_EVT=10, ESP_GATTS_DELETE_EVT=11, ESP_GATTS_START_EVT=12, ESP_GATTS_STOP_EVT=13, ESP_GATTS_CONNECT_EVT=14, ESP_GATTS_DISCONNECT_EVT=15, ESP_GATTS_OPEN_EVT=16, ESP_GATTS_CANCEL_OPEN_EVT=17, ESP_GATTS_CLOSE_EVT=18, ESP_GATTS_LISTEN_EVT=19, ESP_GATTS_CONGEST_EVT=20, ESP_GATTS_RESPONSE_EVT=21, ESP_GATTS_CREAT_ATTR_TAB_EVT=22, ESP_GATTS_SET_ATTR_VAL_EVT=23, ESP_GATTS_SEND_SERVICE_CHANGE_EVT=24 } esp_gatts_cb_event_t;
+typedef union {
+  struct { esp_gatt_status_t status; uint16_t app_id; } reg;
+  struct { uint16_t conn_id; uint32_t trans_id; esp_bd_addr_t bda; uint16_t handle; uint16_t offset; bool is_long; bool need_rsp; } read;
+  struct { uint16_t conn_id; uint32_t trans_id; esp_bd_addr_t bda; uint16_t handle; uint16_t offset; bool need_rsp; bool is_prep; uint16_t len; uint8_t *value; } write;
+  struct { uint16_t conn_id; uint32_t trans_id; esp_bd_addr_t bda; uint8_t exec_write_flag; } exec_write;
+  struct { uint16_t conn_id; uint16_t mtu; } mtu;
+  struct { esp_gatt_status_t status; uint16_t conn_id; uint16_t handle; uint16_t len; uint8_t *value; } conf;
+  struct { esp_gatt_status_t status; uint16_t service_handle; esp_gatt_srvc_id_t service_id; } create;
+  struct { esp_gatt_status_t status; uint16_t attr_handle; uint16_t service_handle; esp_bt_uuid_t char_uuid; } add_char;
+  struct { esp_gatt_status_t status; uint16_t attr_handle; uint16_t service_handle; esp_bt_uuid_t descr_uuid; } add_char_descr;
+  struct { esp_gatt_status_t status; uint16_t service_handle; } start;
+  struct { uint16_t conn_id; uint8_t link_role; esp_bd_addr_t remote_bda; esp_gatt_conn_params_t conn_params; } connect;
+  struct { uint16_t conn_id; esp_bd_addr_t remote_bda; int reason; } disconnect;
+  struct { uint16_t conn_id; bool congested; } congest;
+  struct { esp_gatt_status_t status; uint16_t handle; } rsp;
+  struct { esp_gatt_status_t status; esp_bt_uuid_t svc_uuid; uint8_t svc_inst_id; uint16_t num_handle; uint16_t *handles; } add_attr_tab;
+  struct { uint16_t srvc_handle; uint16_t attr_handle; esp_gatt_status_t status; } set_attr_val;
+} esp_ble_gatts_cb_param_t;
+typedef void (*esp_gatts_cb_t)(esp_gatts_cb_event_t, esp_gatt_if_t, esp_ble_gatts_cb_param_t*);
+esp_gatt_status_t esp_ble_gatts_get_attr_value(uint16_t, uint16_t*, const uint8_t**);
+esp_err_t esp_ble_gatts_set_attr_value(uint16_t, uint16_t, const uint8_t*);
+esp_err_t esp_ble_gatts_add_char(uint16_t, esp_bt_uuid_t*, esp_gatt_perm_t, esp_gatt_char_prop_t, esp_attr_value_t*, esp_attr_control_t*);
+esp_err_t esp_ble_gatts_add_char_descr(uint16_t, esp_bt_uuid_t*, esp_gatt_perm_t, esp_attr_value_t*, esp_attr_control_t*);
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t);
+esp_err_t esp_ble_gatts_app_register(uint16_t);
+esp_err_t esp_ble_gatts_app_unregister(esp_gatt_if_t);
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t, uint16_t, uint16_t, uint16_t, uint8_t*, bool);
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t, uint16_t, uint32_t, esp_gatt_status_t, esp_gatt_rsp_t*);
+esp_err_t esp_ble_gatts_create_service(esp_gatt_if_t, esp_gatt_srvc_id_t*, uint16_t);
+esp_err_t esp_ble_gatts_start_service(uint16_t);
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t*, esp_gatt_if_t, uint16_t, uint8_t);
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t);
+#ifndef STUB_STATIC_TASK
+#define STUB_STATIC_TASK
+typedef struct { int x[90]; } StaticTask_t;
+typedef uint8_t StackType_t;
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t,const char*,uint32_t,void*,UBaseType_t,StackType_t*,StaticTask_t*,BaseType_t);
+#endif
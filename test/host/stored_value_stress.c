@@ -0,0 +1,162 @@
+/*
+    Host stress test of the lock free stored value reads
+
+    One writer publishes pool blocks as the stored value of a characteristic while reader threads copy it with
+    bsp_read_stored_value() and a producer thread keeps taking the released blocks and scribbling over them, like the
+    producers of the notification pool do on the target. Every published value is n bytes of the value n, so a read
+    whose bytes do not all equal its length is torn.
+
+    Usage: stored_value_stress [readers] [publishes] [--in-place]
+    --in-place runs the same readers against one buffer that is cleared and rewritten in place, the scheme the stored
+    values used before they were double buffered, to show what the test catches.
+    The test fails if a double buffered read is torn or a pool block is lost.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "../../src/bsp_ble.c"
+
+#define STRESS_DEFAULT_READERS 3
+#define STRESS_DEFAULT_PUBLISHES 3000000
+#define STRESS_MAX_READERS 16
+
+static characteristic_t stress_characteristic;
+static uint8_t stress_storage[NOTIFICATION_POOL_BLOCK_SIZE];
+static atomic_bool stress_running;
+static atomic_ulong stress_reads;
+static atomic_ulong stress_torn_reads;
+
+// The stored value before it was double buffered, cleared and rewritten in place while readers copied it
+static bool stress_in_place;
+static uint8_t stress_in_place_buffer[NOTIFICATION_POOL_BLOCK_SIZE];
+static atomic_uchar stress_in_place_length;
+
+static void* stress_reader_thread(void* param){
+    (void)param;
+    uint8_t value[NOTIFICATION_POOL_BLOCK_SIZE];
+
+    while(atomic_load(&stress_running)){
+        uint16_t length;
+        if(stress_in_place){
+            length = atomic_load(&stress_in_place_length);
+            memcpy(value,stress_in_place_buffer,length);
+        }else{
+            length = bsp_read_stored_value(&stress_characteristic,value,sizeof(value));
+        }
+
+        bool torn = false;
+        for(uint16_t byte = 0; byte < length; byte++){
+            torn |= (value[byte] != length);
+        }
+        if(torn){
+            atomic_fetch_add(&stress_torn_reads,1);
+        }
+        atomic_fetch_add(&stress_reads,1);
+    }
+    return NULL;
+} // Copy the stored value and count the reads whose bytes do not match their length
+
+static void* stress_producer_thread(void* param){
+    (void)param;
+
+    while(atomic_load(&stress_running)){
+        uint8_t block = bsp_notification_pool_acquire();
+        if(block != NOTIFICATION_POOL_NO_BLOCK){
+            memset(bsp_notification_pool.blocks[block],0xEE,NOTIFICATION_POOL_BLOCK_SIZE);
+            bsp_notification_pool_release(block);
+        }
+    }
+    return NULL;
+} // Reuse every released block straight away, so a reader still copying one sees it overwritten
+
+static void stress_init_characteristic(){
+    // The same initial state as bsp_create_profile() gives a characteristic
+    atomic_init(&stress_characteristic.stored_value.buffers[0],stress_storage);
+    atomic_init(&stress_characteristic.stored_value.buffers[1],NULL);
+    atomic_init(&stress_characteristic.stored_value.lengths[0],0);
+    atomic_init(&stress_characteristic.stored_value.lengths[1],0);
+    stress_characteristic.stored_value.blocks[0] = NOTIFICATION_POOL_NO_BLOCK;
+    stress_characteristic.stored_value.blocks[1] = NOTIFICATION_POOL_NO_BLOCK;
+    atomic_init(&stress_characteristic.stored_value.sequence,0);
+    stress_characteristic.local_storage_limit = NOTIFICATION_POOL_BLOCK_SIZE;
+}
+
+int main(int argc,char** argv){
+    int readers = STRESS_DEFAULT_READERS;
+    long publishes = STRESS_DEFAULT_PUBLISHES;
+    int positional = 0;
+
+    for(int arg = 1; arg < argc; arg++){
+        if(strcmp(argv[arg],"--in-place") == 0){
+            stress_in_place = true;
+        }else if(positional++ == 0){
+            readers = atoi(argv[arg]);
+        }else{
+            publishes = atol(argv[arg]);
+        }
+    }
+    if(readers < 1 || readers > STRESS_MAX_READERS || publishes < 1){
+        fprintf(stderr,"Usage: %s [readers 1-%d] [publishes] [--in-place]\n",argv[0],STRESS_MAX_READERS);
+        return 2;
+    }
+
+    (void)advertisement_timer; // Declared by bsp_ble.h for the power management, which the test does not run
+
+    bsp_init_notification_pool();
+    stress_init_characteristic();
+
+    pthread_t reader_threads[STRESS_MAX_READERS];
+    pthread_t producer_thread;
+    atomic_store(&stress_running,true);
+    for(int reader = 0; reader < readers; reader++){
+        pthread_create(&reader_threads[reader],NULL,stress_reader_thread,NULL);
+    }
+    pthread_create(&producer_thread,NULL,stress_producer_thread,NULL);
+
+    // The writer holds the profile semaphore on the target, here it is the only writer so no lock is needed
+    long published = 0;
+    for(long publish = 0; publish < publishes; publish++){
+        uint8_t length = 1 + publish % NOTIFICATION_POOL_BLOCK_SIZE;
+        if(stress_in_place){
+            memset(stress_in_place_buffer,0,sizeof(stress_in_place_buffer));
+            memset(stress_in_place_buffer,length,length);
+            atomic_store(&stress_in_place_length,length);
+            published++;
+            continue;
+        }
+
+        uint8_t block = bsp_notification_pool_acquire();
+        if(block == NOTIFICATION_POOL_NO_BLOCK){
+            continue; // The producer holds the only free block for a moment
+        }
+        memset(bsp_notification_pool.blocks[block],length,length);
+        bsp_publish_stored_value(&stress_characteristic,bsp_notification_pool.blocks[block],block,length);
+        published++;
+    }
+
+    atomic_store(&stress_running,false);
+    for(int reader = 0; reader < readers; reader++){
+        pthread_join(reader_threads[reader],NULL);
+    }
+    pthread_join(producer_thread,NULL);
+
+    // Only the block of the last published value is still held
+    int free_blocks = __builtin_popcount(atomic_load(&bsp_notification_pool.free_blocks));
+    int expected_free_blocks = stress_in_place ? NOTIFICATION_POOL_BLOCKS : NOTIFICATION_POOL_BLOCKS - 1;
+    unsigned long reads = atomic_load(&stress_reads);
+    unsigned long torn_reads = atomic_load(&stress_torn_reads);
+
+    printf("%s: %d readers, %ld publishes, %lu reads, %lu torn, %d/%d free blocks\n",
+        stress_in_place ? "in place" : "double buffered",readers,published,reads,torn_reads,free_blocks,expected_free_blocks);
+
+    if(stress_in_place){
+        return 0; // Torn reads are expected, the run only shows what the double buffered one is checked for
+    }
+    if(torn_reads != 0 || free_blocks != expected_free_blocks || reads == 0){
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}